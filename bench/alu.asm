@@ -0,0 +1,17 @@
+; ALU-heavy loop: ADD/AND/NOT on registers only, about 105M instructions
+.ORIG x3000
+                     LD        R5,Outer
+OuterLoop            LD        R4,Inner
+InnerLoop            ADD       R0,R0,R4
+                     AND       R1,R0,#15
+                     NOT       R2,R1
+                     ADD       R3,R2,R0
+                     AND       R3,R3,R1
+                     ADD       R4,R4,#-1
+                     BRp       InnerLoop
+                     ADD       R5,R5,#-1
+                     BRp       OuterLoop
+                     HALT
+Outer                .FILL     #3000
+Inner                .FILL     #5000
+.END
@@ -0,0 +1,19 @@
+; LDI/STI through pointers: bounce a counter between x4000 and x5000 (about 105M instructions)
+.ORIG x3000
+                     LD        R5,Outer
+OuterLoop            LD        R4,Inner
+InnerLoop            LDI       R0,PointerA
+                     ADD       R0,R0,#1
+                     STI       R0,PointerB
+                     LDI       R1,PointerB
+                     STI       R1,PointerA
+                     ADD       R4,R4,#-1
+                     BRp       InnerLoop
+                     ADD       R5,R5,#-1
+                     BRp       OuterLoop
+                     HALT
+PointerA             .FILL     x4000
+PointerB             .FILL     x5000
+Outer                .FILL     #500
+Inner                .FILL     #30000
+.END
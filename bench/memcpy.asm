@@ -0,0 +1,20 @@
+; Memory copy through LDR/STR: 8192 words from x4000 to x8000, 2000 times (about 98M instructions)
+.ORIG x3000
+                     LD        R5,Passes
+Pass                 LD        R1,Source
+                     LD        R2,Dest
+                     LD        R3,Words
+Copy                 LDR       R4,R1,#0
+                     STR       R4,R2,#0
+                     ADD       R1,R1,#1
+                     ADD       R2,R2,#1
+                     ADD       R3,R3,#-1
+                     BRp       Copy
+                     ADD       R5,R5,#-1
+                     BRp       Pass
+                     HALT
+Passes               .FILL     #2000
+Source               .FILL     x4000
+Dest                 .FILL     x8000
+Words                .FILL     #8192
+.END
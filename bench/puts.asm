@@ -0,0 +1,15 @@
+; PUTS-heavy output: a 64-character line, 800000 times (about 51 MB of output)
+.ORIG x3000
+                     LD        R5,Outer
+OuterLoop            LD        R4,Inner
+InnerLoop            LEA       R0,Line
+                     PUTS
+                     ADD       R4,R4,#-1
+                     BRp       InnerLoop
+                     ADD       R5,R5,#-1
+                     BRp       OuterLoop
+                     HALT
+Outer                .FILL     #25
+Inner                .FILL     #32000
+Line                 .STRINGZ  "The quick brown fox jumps over the lazy dog, 0123456789 ABCDEF.\n"
+.END
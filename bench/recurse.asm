@@ -0,0 +1,34 @@
+; Recursive fib(20) by JSR/RET, 400 times (about 88M instructions).
+; n is in R0 and fib(n) comes back in R1; R6 is the stack.
+.ORIG x3000
+                     LD        R6,StackBase
+                     LD        R5,Repeat
+Again                LD        R0,N
+                     JSR       Fib
+                     ADD       R5,R5,#-1
+                     BRp       Again
+                     HALT
+;
+Fib                  ADD       R2,R0,#-2
+                     BRzp      Recur
+                     ADD       R1,R0,#0      ; fib(0) = 0, fib(1) = 1
+                     RET
+Recur                ADD       R6,R6,#-3
+                     STR       R7,R6,#0
+                     STR       R0,R6,#1
+                     ADD       R0,R0,#-1
+                     JSR       Fib           ; fib(n-1)
+                     STR       R1,R6,#2
+                     LDR       R0,R6,#1
+                     ADD       R0,R0,#-2
+                     JSR       Fib           ; fib(n-2)
+                     LDR       R2,R6,#2
+                     ADD       R1,R1,R2
+                     LDR       R7,R6,#0
+                     ADD       R6,R6,#3
+                     RET
+;
+StackBase            .FILL     xC000
+Repeat               .FILL     #400
+N                    .FILL     #20
+.END
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Run every workload in bench/ headless with fixed input and print one
+# JSON object per line:
+#
+#   {"workload": ..., "instructions": ..., "seconds": ..., "mips": ...,
+#    "max_rss_kb": ..., "syscalls": ..., "syscalls_per_kinstr": ...}
+#
+# usage: bench/run.sh simulator [simulator options...]
+# Each workload is timed once as is and run once more under
+# bench/measure -c to count its system calls.
+[ $# -ge 1 ] || { echo "usage: $0 simulator [options...]" >&2; exit 2; }
+SIM=$(cd "$(dirname "$1")" && pwd)/$(basename "$1"); shift
+OPTIONS="$*"
+BENCH=$(cd "$(dirname "$0")" && pwd)
+MEASURE=$BENCH/measure
+WORK=$(mktemp -d) || exit 2
+trap 'rm -rf "$WORK"' EXIT
+
+# tests/lab2.asm, the calculator: 50000 rounds of push, multiply, negate, add, display, clear
+awk 'BEGIN { for (i = 0; i < 50000; i++) printf "25\r37\r*D99\r-+DC"; printf "X" }' > "$WORK/lab2.txt"
+
+# name, then the simulator arguments
+while read -r name args; do
+    cd "$WORK" || exit 2
+    # the REPL writes dumpsim into the current directory
+    eval "set -- $args"
+    printf 'go\nrdump\nquit\n' | "$MEASURE" "$SIM" $OPTIONS "$@" > out.txt 2> time.txt
+    printf 'go\nrdump\nquit\n' | "$MEASURE" -c "$SIM" $OPTIONS "$@" > /dev/null 2> count.txt
+    count=$(sed -n 's/^Instruction Count : //p' out.txt | tail -1)
+    awk -v name="$name" -v count="${count:-0}" '
+        FNR == 1 { file++ }
+        /^seconds=/ {
+            for (i = 1; i <= NF; i++) { split($i, kv, "="); value[file, kv[1]] = kv[2] }
+        }
+        END {
+            seconds = value[1, "seconds"]; syscalls = value[2, "syscalls"]
+            printf "{\"workload\": \"%s\", \"instructions\": %d, \"seconds\": %.6f, \"mips\": %.2f, ", \
+                   name, count, seconds, (seconds > 0 ? count / seconds / 1e6 : 0)
+            printf "\"max_rss_kb\": %d, ", value[1, "max_rss_kb"]
+            if (syscalls < 0)
+                printf "\"syscalls\": null, \"syscalls_per_kinstr\": null}\n"
+            else
+                printf "\"syscalls\": %d, \"syscalls_per_kinstr\": %.4f}\n", \
+                       syscalls, (count > 0 ? syscalls * 1000 / count : 0)
+        }' time.txt count.txt
+done <<EOF
+alu $BENCH/alu.obj
+memcpy $BENCH/memcpy.obj
+recurse $BENCH/recurse.obj
+indirect $BENCH/indirect.obj
+puts $BENCH/puts.obj
+lab2 --input-file $WORK/lab2.txt $BENCH/../tests/lab2.obj
+EOF
@@ -8,58 +8,91 @@
  * Summary:     The project can load an ISA program in pure decimal text format
  *              as mentioned in the original document.
  *              See original document for usage.
- * Known issue: PSR not implemented.
+ * Known issue: TRAPs are simulated in C unless --os or --traps sends them
+ *              through the vector table.
  * License:     All the codes are open-sourced at https://github.com/Gennadiyev/yet-another-lc3-sim.git
  *              under the MIT License.
  */
 
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
-/* Simulate inputs without echo */
+/*
+  Simulate inputs without echo.  The terminal is switched to raw
+  mode at the first GETC/IN of a go/run and stays raw until control
+  is back at the LC-3-SIM> prompt, so a stream of GETCs costs no
+  termios calls.  Output processing is left on, so LF still starts
+  a new line while the terminal is raw.
+*/
 struct termios orig_termios;
+int terminal_raw = 0;
 
 void reset_terminal_mode()
 {
+    if (!terminal_raw)
+        return;
     tcsetattr(0, TCSANOW, &orig_termios);
+    terminal_raw = 0;
 }
 
 void set_conio_terminal_mode()
 {
+    static int registered = 0;
     struct termios new_termios;
 
+    if (terminal_raw)
+        return;
+
     /* take two copies - one for now, one for later */
     tcgetattr(0, &orig_termios);
     memcpy(&new_termios, &orig_termios, sizeof(new_termios));
 
-    /* register cleanup handler, and set the new terminal mode */
-    atexit(reset_terminal_mode);
+    /* register cleanup handler once, and set the new terminal mode */
+    if (!registered) {
+        atexit(reset_terminal_mode);
+        registered = 1;
+    }
     cfmakeraw(&new_termios);
+    new_termios.c_oflag = orig_termios.c_oflag;
     tcsetattr(0, TCSANOW, &new_termios);
+    terminal_raw = 1;
 }
 
-int kbhit()
+/* Sleep until a key is ready instead of spinning on it */
+void waitKey()
 {
-    struct timeval tv = { 0L, 0L };
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(0, &fds);
-    return select(1, &fds, NULL, NULL, &tv) > 0;
+    struct pollfd fds = { 0, POLLIN, 0 };
+
+    while (poll(&fds, 1, -1) < 0 && errno == EINTR)
+        ;
 }
 
 int getch()
 {
-    int r;
     unsigned char c;
-    if ((r = read(0, &c, sizeof(c))) < 0) {
-        return r;
-    } else {
-        return c;
-    }
+
+    if (read(0, &c, sizeof(c)) != 1)
+        return EOF;
+    return c;
 }
 /* End simulates non-echoing inputs */
 
@@ -69,12 +102,6 @@ int getch()
 /*                                                             */
 /***************************************************************/
 
-/***************************************************************/
-/* These are the functions you'll have to write.               */
-/***************************************************************/
-
-void processInstruction();
-
 /***************************************************************/
 /* A couple of useful definitions.                             */
 /***************************************************************/
@@ -91,40 +118,674 @@ void processInstruction();
 /***************************************************************/
 /*
   MEMORY[A] stores the word address A
+
+  With --cores several host threads share MEMORY, so getMemory,
+  setMemory and the stack pushes and pops read and write a word as
+  one relaxed atomic access: a core never sees half of another
+  core's store, but nothing orders stores to different words.
+  loadWord/storeWord make that one volatile 16-bit access, which
+  the compiler may not split, merge or cache in a register, and
+  which the hosts this builds on carry out as a single aligned
+  load or store.  (GCC's __atomic_load_n compiles to the same
+  instruction but costs the interpreter a register.)  The JIT's
+  loads are single movzx instructions.
+*/
+
+#define WORDS_IN_MEM    0x10000
+
+#define loadWord(memory, address)           (*(volatile uint16_t *) &(memory)[address])
+#define storeWord(memory, address, value)   (*(volatile uint16_t *) &(memory)[address] = (uint16_t) (value))
+
+/***************************************************************/
+/* Page attribute table.                                       */
+/***************************************************************/
+/*
+  Memory is split into 256 pages of 256 words.  PAGE_HANDLER[p] is
+  NULL for plain RAM, which getMemory/setMemory access directly;
+  any other page is routed through its handler.  Pages with words
+  the protection table does not allow go through protectedAccess,
+  and pages xFE00 and xFF00 also hold the device registers.
 */
+#define PAGE_SHIFT      8
+#define PAGES           (WORDS_IN_MEM >> PAGE_SHIFT)
+#define PAGE_WORDS      (1 << PAGE_SHIFT)
 
-#define WORDS_IN_MEM    0x08000
-int MEMORY[WORDS_IN_MEM];
+/***************************************************************/
+/* Device registers.                                           */
+/***************************************************************/
+/*
+  Status registers have a ready bit (15) and an interrupt enable
+  bit (14).  The keyboard is fed from the VM's input; the display
+  is always ready.  The timer sets its ready bit every TMI
+  milliseconds and reading TMR clears it.  Clearing bit 15 of MCR
+  stops the machine.  Keyboard and timer interrupts are taken at
+  priority 4 through INTV entries x80 and x81.  CID reads as the
+  number of the core reading it and NCORES as how many there are
+  (0 and 1 without --cores).
+*/
+#define KBSR_ADDR       0xFE00
+#define KBDR_ADDR       0xFE02
+#define DSR_ADDR        0xFE04
+#define DDR_ADDR        0xFE06
+#define TMR_ADDR        0xFE08
+#define TMI_ADDR        0xFE0A
+#define CID_ADDR        0xFE0C
+#define NCORES_ADDR     0xFE0E
+#define PSR_ADDR        0xFFFC
+#define MCR_ADDR        0xFFFE
+
+#define DEVICE_READY    0x8000
+#define DEVICE_IE       0x4000
+#define PSR_USER        0x8000
+#define INTV_BASE       0x0100
+#define KEYBOARD_VECTOR 0x80
+#define TIMER_VECTOR    0x81
+#define DEVICE_PRIORITY 4
+#define DEVICE_SLICE    4096    /* instructions between device polls */
+#define IDLE_POLL_LIMIT 64      /* not-ready polls between idle loop checks */
+#define IDLE_MAX_LENGTH 16      /* longest loop the idle check looks at */
 
 /***************************************************************/
+/* Traps.                                                      */
+/***************************************************************/
+/*
+  The host carries out GETC, OUT, PUTS, IN, PUTSP and HALT itself
+  unless TRAP_GUEST marks the vector.  A guest vector goes through
+  the trap vector table as on the LC-3: PSR and PC are pushed on the
+  supervisor stack, the machine enters supervisor mode at the
+  address in the table, and the routine returns with RTI.  --os
+  loads an OS image (os/lc3os.obj) and makes every vector a guest
+  one; --traps picks host or guest per vector.  A vector the host
+  has no routine for goes through the table whenever the table has
+  an entry for it.
+*/
+#define TRAP_VECTORS    256
+#define TRAP_HOST_FIRST 0x20    /* GETC */
+#define TRAP_HOST_LAST  0x25    /* HALT */
+
+typedef struct LC3_VM_Struct LC3_VM;
+
+typedef int (*Page_Handler)(LC3_VM *vm, int address, int value, int is_write);
 
 /***************************************************************/
+/* Predecoded instruction cache.                               */
+/***************************************************************/
+/*
+  DECODED[A] holds the word at address A decoded once into a
+  handler and pre-extracted operands.  Writes to A reset the
+  record to DECODE_ENTRY so it is decoded again on next fetch.
+  The table spans the whole 16-bit address space so the engine
+  never has to range-check the PC.
+*/
+#define DECODED_WORDS   0x10000
+
+typedef struct Decoded_Struct {
+    const void *handler;    /* threaded-code target */
+    int16_t imm;            /* sign-extended imm/offset, or trap vector */
+    uint8_t op,             /* OP_* below */
+    dr,                     /* DR/SR field, or nzp mask for BR */
+    sr1,                    /* SR1/BaseR field */
+    sr2;                    /* SR2 field */
+} Decoded;
+
+enum {
+    OP_DECODE = 0, OP_ADD_REG, OP_ADD_IMM, OP_AND_REG, OP_AND_IMM,
+    OP_NOT, OP_BR, OP_JMP, OP_RET, OP_JSR, OP_JSRR, OP_LD, OP_LDI,
+    OP_LDR, OP_LEA, OP_ST, OP_STI, OP_STR, OP_RTI, OP_TRAP, OP_NOP,
+    OP_COUNT
+};
+
+const void *DECODE_ENTRY;   /* published by the engine before any VM runs */
+
+#define invalidateDecoded(vm, address) \
+    ((vm)->DECODED[address].handler = DECODE_ENTRY, (vm)->DECODED[address].op = OP_DECODE)
 
 /***************************************************************/
 /* LC-3 State info.                                           */
 /***************************************************************/
 #define LC_3_REGS 8
 
-int RUN_BIT;	/* run bit */
-
 typedef struct System_Latches_Struct {
-    int PC,		/* program counter */
-    N,		/* n condition bit */
-    Z,		/* z condition bit */
-    P,      /* p condition bit */
-    IR,		/* instruction register */
-    PSR;    /* Priviledged register */
-    int REGS[LC_3_REGS]; /* register file. */
+    uint16_t REGS[LC_3_REGS]; /* register file. */
+    uint16_t PC,    /* program counter */
+    CC,             /* last value that set the condition codes */
+    IR,             /* instruction register */
+    PSR;            /* Priviledged register (nzp bits live in CC) */
 } System_Latches;
 
-/* Data Structure for Latch */
+/*
+  N/Z/P are not stored: they are derived from CC, the last value an
+  ADD/AND/NOT/LD/LDI/LDR wrote, when BR or rdump asks for them.
+  CCMASK gives the nzp bit (n = 4, z = 2, p = 1) matching a BR's
+  nzp field.
+*/
+#define CC_N(latches)   (((latches).CC & 0x8000) != 0)
+#define CC_Z(latches)   ((latches).CC == 0)
+#define CC_P(latches)   (!CC_N(latches) && !CC_Z(latches))
+#define CCMASK(value)   ((value) == 0 ? 2 : ((value) & 0x8000) ? 4 : 1)
+
+/* The whole machine state must stay within one 64-byte cache line */
+typedef char latches_fit_cache_line[sizeof(System_Latches) <= 64 ? 1 : -1];
+
+/***************************************************************/
+/* Symbol table.                                               */
+/***************************************************************/
+/*
+  Labels read from the lc3as .sym file next to each program file,
+  kept sorted by address.
+*/
+typedef struct Symbol_Struct {
+    char *name;
+    int address;
+} Symbol;
+
+/***************************************************************/
+/* Execution profile.                                          */
+/***************************************************************/
+/*
+  Counters kept by the interpreter while profiling is on.  Records
+  decoded then point at the engine's PROFILE label, which counts
+  the instruction and jumps on to its real handler, so the engine
+  pays nothing while profiling is off.  The JIT is bypassed while
+  profiling.
+
+  JSR/JSRR and RET also drive a shadow call stack over a calling
+  context tree: one node per distinct chain of calls, which gets
+  the instructions run in it and not in its callees.  Instructions
+  are charged by INSTRUCTION_COUNT deltas at each call and return.
+*/
+#define PROFILE_TOP     10      /* hot addresses in a report by default */
+#define PROFILE_DEPTH   1024    /* deepest tracked call chain */
+
+typedef struct Profile_Node_Struct {
+    int function;               /* entry address */
+    int parent, child, sibling; /* node indices, -1 for none */
+    uint64_t self;              /* instructions run here, not in callees */
+    uint64_t calls;
+} Profile_Node;
+
+typedef struct Profile_Struct {
+    uint64_t EXECUTED[WORDS_IN_MEM];    /* instructions run at each address */
+    uint64_t TAKEN[WORDS_IN_MEM];       /* of those, BRs that branched */
+    uint64_t OPS[OP_COUNT];             /* by Decoded op */
+    uint64_t TRAPS[256];                /* by trap vector */
+    uint64_t LOADS[PAGES], STORES[PAGES];
+
+    Profile_Node *NODES;                /* NODES[0] is where profiling started */
+    int NUM_NODES, MAX_NODES;
+    int STACK[PROFILE_DEPTH];           /* node of each active call */
+    int DEPTH;
+    int LOST_DEPTH;                     /* calls deeper than PROFILE_DEPTH */
+    long long CHARGED;                  /* INSTRUCTION_COUNT already charged to a node */
+} Profile;
+
+/***************************************************************/
+/* Execution history.                                          */
+/***************************************************************/
+/*
+  While history is on, records are routed through the engine's
+  HISTORY label, which logs what each instruction overwrote: an
+  undo record of the fields below that changed and of the memory
+  words stored to.  Every HISTORY_INTERVAL instructions a checkpoint
+  keeps those fields; the first store to a page after a checkpoint
+  copies the page into it first.
+
+  Going back a little pops undo records.  Going further restores the
+  nearest checkpoint before the target and replays forward, so the
+  cost is bounded by the interval, not by the length of the run.
+  Replay must see what the live run saw: keys and timer ticks read
+  during an instruction, and whatever the devices did between
+  instructions (interrupts, idle-loop sleeps), are kept as events and
+  fed back in, and console output is not printed a second time.
+
+  Under the memory budget the undo records of the oldest checkpoints
+  go first, then the oldest checkpoints themselves.
+*/
+#define HISTORY_INTERVAL    16384   /* instructions between checkpoints */
+#define HISTORY_BUDGET      64      /* megabytes by default */
+#define HISTORY_STORES      7       /* stores one undo record can hold */
+#define HISTORY_RECORD      96      /* largest undo record in bytes */
+
+/* State kept per undo record and checkpoint, besides memory */
+enum {
+    H_PC = LC_3_REGS, H_CC, H_PSR, H_TOP, H_SSP, H_USP, H_KBSR, H_KBDR,
+    H_DSR, H_TMR, H_TMI, H_MCR, H_EOF, HISTORY_FIELDS
+};
+
+enum { HISTORY_KEY, HISTORY_TIMER, HISTORY_BETWEEN };
+
+typedef struct History_Event_Struct {
+    long long COUNT;                    /* instruction it came during or before */
+    int KIND;                           /* HISTORY_* above */
+    int KEY;                            /* HISTORY_KEY: what was read, or EOF */
+    long long SKIPPED;                  /* HISTORY_BETWEEN: idle turns slept through */
+    uint16_t STATE[HISTORY_FIELDS];     /* HISTORY_BETWEEN: the state afterwards */
+    int NUM_STORES;
+    uint16_t ADDRESS[HISTORY_STORES], VALUE[HISTORY_STORES];
+} History_Event;
+
+typedef struct Checkpoint_Struct {
+    long long COUNT;                    /* INSTRUCTION_COUNT when taken */
+    uint16_t STATE[HISTORY_FIELDS];
+    uint16_t *SAVED[PAGES];             /* pages as they were, if stored to before the next one */
+    int NUM_PAGES;
+    unsigned char *UNDO;                /* undo records from COUNT on, NULL once dropped */
+    size_t UNDO_LENGTH, UNDO_SIZE;
+} Checkpoint;
+
+typedef struct History_Struct {
+    Checkpoint *CHECKPOINTS;            /* oldest first */
+    int NUM_CHECKPOINTS, MAX_CHECKPOINTS;
+    long long NEXT_CHECKPOINT;
+    History_Event *EVENTS;              /* in COUNT order */
+    int NUM_EVENTS, MAX_EVENTS;
+    size_t BUDGET;                      /* bytes */
+
+    long long END;                      /* recorded up to here; from here on runs live */
+    int REPLAYING;                      /* executing recorded instructions again */
+    int CURSOR;                         /* next event to replay */
+    int RUNNING;                        /* inside the engine, NOW is the instruction */
+    long long NOW;
+
+    /* The undo record being collected */
+    int PENDING;
+    long long FROM;                     /* INSTRUCTION_COUNT when it started */
+    uint16_t BEFORE[HISTORY_FIELDS];
+    int NUM_STORES;
+    uint16_t ADDRESS[HISTORY_STORES], OLD[HISTORY_STORES];
+
+    /* executeInstructions' device work, see historyBetween */
+    uint16_t BETWEEN_STATE[HISTORY_FIELDS];
+    long long BETWEEN_COUNT;
+    int BETWEEN_STORES;                 /* stores before it started */
+
+    /* Where undo records stop matching the machine: checkpoint, byte offset */
+    int UNDO_VALID, UNDO_CHECKPOINT;
+    size_t UNDO_OFFSET;
+
+    int WATCH;                          /* address being searched for, -1 for none */
+    long long WATCHED;                  /* last instruction found storing to it */
+} History;
+
+/***************************************************************/
+/* Breakpoints and watchpoints.                                */
+/***************************************************************/
+/*
+  DEBUG is NULL unless a breakpoint or watchpoint is set, and then
+  costs nothing where none is set.  FLAGS marks each address.  A
+  breakpoint's cached record is routed through the engine's DEBUG
+  label, which stops in front of it.  A page holding a watched word
+  gets watchAccess as its handler (the one it had is kept in
+  HANDLER), which notes the hit; while anything is watched every
+  record goes through DEBUG, so the run stops right after the
+  instruction that made the access.
+*/
+#define DEBUG_POINTS    64
+
+#define DEBUG_BREAK     1
+#define DEBUG_READ      2
+#define DEBUG_WRITE     4
+
+typedef struct Debug_Point_Struct {
+    int number;                         /* as listed, counting from 1 */
+    int low, high;                      /* one address for a breakpoint */
+    int flags;                          /* DEBUG_* */
+} Debug_Point;
+
+typedef struct Debug_Struct {
+    Debug_Point POINTS[DEBUG_POINTS];
+    int NUM_POINTS, NEXT_NUMBER, NUM_WATCHES;
+    uint8_t FLAGS[WORDS_IN_MEM];
+    Page_Handler HANDLER[PAGES];        /* under watchAccess */
+
+    int RESUME;                         /* breakpoint to run past once, -1 for none */
+    int STOPPED;                        /* DEBUG_* that stopped the run, 0 if none */
+    int HIT_ADDRESS, HIT_VALUE, HIT_POINT;
+
+    /* historyLastStop: note stops (at FOUND) instead of making them */
+    int SEARCHING;
+    long long NOW, FOUND;
+} Debug;
+
+/***************************************************************/
+/* Lockstep dirty words.                                       */
+/***************************************************************/
+/*
+  --lockstep notes every word a VM stores to, so that only those
+  are compared at the next check.  WORDS lists each address once,
+  in the order it was first written since the list was cleared.
+*/
+typedef struct Dirty_Struct {
+    uint8_t MARKED[WORDS_IN_MEM];
+    uint16_t WORDS[WORDS_IN_MEM];
+    int NUM_WORDS;
+} Dirty;
+
+/***************************************************************/
+/* Machine images.                                             */
+/***************************************************************/
+/*
+  save, load and --restore move the whole machine as one
+  Machine_Image: registers, the pseudo-stack pointer, the device
+  registers, then all of memory and the program map.  It is written
+  with one write() and read back through mmap.  Fields are in host
+  byte order; ORDER tells a foreign image apart, and VERSION and
+  SIZE one with another layout.  Bump IMAGE_VERSION whenever the
+  layout changes.
+*/
+#define IMAGE_MAGIC     "LC3SIMG"
+#define IMAGE_VERSION   1
+#define IMAGE_ORDER     0x0102
+
+typedef struct Machine_Image_Struct {
+    char MAGIC[8];                      /* IMAGE_MAGIC */
+    uint16_t VERSION, ORDER;
+    uint32_t SIZE;                      /* sizeof(Machine_Image) */
+    int64_t INSTRUCTION_COUNT;
+    uint16_t PC, CC, PSR, REGS[LC_3_REGS];
+    uint16_t TOP_P, RUN_BIT;
+    uint16_t KBSR, KBDR, DSR, TMR, TMI, MCR, SAVED_SSP, SAVED_USP;
+    uint16_t MEMORY[WORDS_IN_MEM];
+    uint8_t PROGRAM_MAP[WORDS_IN_MEM];
+} Machine_Image;
+
+/***************************************************************/
+/* Memory protection.                                          */
+/***************************************************************/
+/*
+  Every word belongs to one region of the table, and each region
+  has a policy for user-mode accesses; supervisor accesses are
+  always allowed.  Pages with a word that is not allowed go through
+  protectedAccess, which looks the word's region up in REGION.  An
+  access that is not allowed is tallied for its region and for the
+  PC of the instruction that made it (ACCESS_PC, which each engine
+  sets in front of its loads and stores).  A page where every word
+  is allowed has no handler and costs nothing.
+
+  A fault drops the access and raises ATTENTION; the engine stops
+  after the instruction and serviceDevices backs it out (registers
+  and CC as they were before it) and takes the ACV exception
+  through x0102.  The JIT keeps its registers in host registers
+  and could not back an instruction out, so it stays off while any
+  region faults.
+*/
+#define PROTECT_ALLOW       0       /* not checked */
+#define PROTECT_COUNT       1       /* tallied quietly */
+#define PROTECT_WARN_ONCE   2       /* tallied; the first one from each PC warns */
+#define PROTECT_WARN        3       /* tallied; every one warns */
+#define PROTECT_FAULT       4       /* tallied; dropped, and an ACV exception taken */
+
+#define PROTECT_REGIONS     32
+#define PROTECT_TOP_PCS     10      /* PCs listed in the report */
+#define ACV_VECTOR          0x02
+
+typedef struct Protect_Region_Struct {
+    char name[24];
+    int low, high, policy;
+    long long READS, WRITES;            /* user-mode accesses that were not allowed */
+} Protect_Region;
+
+typedef struct Protect_Struct {
+    Protect_Region REGIONS[PROTECT_REGIONS];
+    int NUM_REGIONS;
+    uint8_t REGION[WORDS_IN_MEM];       /* index into REGIONS of each word */
+    int FAULTS;                         /* some region faults */
+    uint32_t *BY_PC;                    /* tallies by PC, allocated at the first */
+    uint8_t *WARNED;                    /* PCs that have had their warning */
+} Protect;
+
+/***************************************************************/
+/* Run limits.                                                 */
+/***************************************************************/
+/*
+  go, run and the batch modes run the engine in RUN_SLICE pieces
+  and check the limits in between, so a check costs one clock read
+  per slice.  MAX_INSTRUCTIONS caps INSTRUCTION_COUNT, so a slice
+  never runs past it; TIMEOUT caps the host time spent running
+  (RAN_SECONDS), not the time sat at the prompt.  A SIGINT or
+  SIGTERM during go or run is picked up at the next check too.
+*/
+#define RUN_SLICE       1000000 /* instructions between limit checks */
+
+#define STOP_NONE           0
+#define STOP_INSTRUCTIONS   1       /* INSTRUCTION_COUNT reached MAX_INSTRUCTIONS */
+#define STOP_TIMEOUT        2       /* RAN_SECONDS reached TIMEOUT */
+#define STOP_SIGNAL         3       /* SIGINT or SIGTERM */
+#define STOP_DEBUG          4       /* a breakpoint or watchpoint */
+
+#define EXIT_INSTRUCTION_LIMIT  3   /* exit status after STOP_INSTRUCTIONS */
+#define EXIT_TIMEOUT            4   /* exit status after STOP_TIMEOUT */
+
+typedef struct Run_Limits_Struct {
+    long long MAX_INSTRUCTIONS;         /* 0: no limit */
+    double TIMEOUT;                     /* seconds, 0: no limit */
+} Run_Limits;
+
+/***************************************************************/
+/* Console output.                                             */
+/***************************************************************/
+/*
+  OUT/PUTS/PUTSP/DDR output and warnings are collected in a ring
+  and written to the VM's output stream in one go.  The ring is
+  flushed before the VM waits on the keyboard, on HALT, when the
+  engine hands control back (REPL, batch, exit) and whenever it
+  fills up.  With --flush-ms a flusher thread also drains it on a
+  timer, and every access to the ring then takes the lock.  So does
+  every access once --cores has the other cores print through core
+  0's ring (CONSOLE), which keeps their output in the order it was
+  written.
+*/
+#define CONSOLE_RING    8192    /* bytes, a power of two */
+
+typedef struct Console_Struct {
+    char ring[CONSOLE_RING];
+    unsigned head, tail;        /* free-running write and flush positions */
+    long long written;          /* bytes flushed so far */
+    int last;                   /* the last byte flushed, -1 before the first */
+    int timed;                  /* a flusher thread shares the ring */
+    int shared;                 /* other cores print through it too */
+    volatile int stop;          /* asks the flusher thread to exit */
+    int interval_ms;
+    pthread_mutex_t lock;
+    pthread_t flusher;
+} Console;
+
+/***************************************************************/
+/* Cores.                                                      */
+/***************************************************************/
+/*
+  --cores n runs n LC-3 cores on one MEMORY.  Each core is a VM of
+  its own (latches, device registers, decode cache, JIT, supervisor
+  stack) whose MEMORY points at core 0's; core 0 is the VM the REPL
+  works on.  All cores start at the same PC and tell themselves
+  apart by reading CID.  go and run n give every core n
+  instructions, each core on a host thread of its own, or, with
+  --round-robin q, all on one thread in turns of q instructions,
+  which makes a run repeatable.
+
+  A store checks CODE and, when some core has decoded or translated
+  that word, drops it from every other core's decode cache and JIT.
+  In parallel mode a core can still run the old word once if it was
+  fetching it at that moment; in round-robin mode the cores see
+  each other's stores at once.
+
+  Cores after the first keep the JSR/RET pseudo stack in CALL_STACK
+  instead of x2F00-x2FFF, and core n's supervisor stack starts
+  CORE_SSP_SPACING * n words below x2F00.
+*/
+#define CORES_MAX           64
+#define CORE_SSP_SPACING    0x40
+#define CORES_CHUNK         65536   /* instructions a thread runs between checks for a stop */
+
+/* Keep the --cores hook in the decode path out of the single-core
+   interpreter's way: an ordinary call there costs it registers. */
+#if defined(__GNUC__)
+#define COLD            __attribute__((cold, noinline))
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+#else
+#define COLD
+#define unlikely(x)     (x)
+#endif
+
+typedef struct Cores_Struct {
+    int NUM_CORES;
+    int QUANTUM;                        /* --round-robin turn, 0: one host thread per core */
+    LC3_VM *CORE[CORES_MAX];            /* CORE[0] is the VM the REPL works on */
+    uint8_t CODE[WORDS_IN_MEM];         /* some core decoded or translated the word */
+    pthread_mutex_t INPUT_LOCK;         /* one core at a time reads the keyboard */
+    volatile int STOP;                  /* core 0 hit a breakpoint: the others stop too */
+} Cores;
+
+/***************************************************************/
+/* VM context.                                                 */
+/***************************************************************/
+/*
+  Everything one simulated machine owns.  Every handler takes the
+  VM it runs on, so any number of machines can run side by side
+  (one per thread in --batch mode).
+
+  Every instruction completes within one step, so the state is
+  updated in place; there is no separate NEXT_LATCHES to copy.
 
-System_Latches CURRENT_LATCHES, NEXT_LATCHES;
+  A device that needs the machine to stop or take an interrupt
+  raises ATTENTION; the engines return at the next control transfer
+  and executeInstructions services the devices.
+
+  JIT_CODE_MAP[A] is nonzero while address A is part of a
+  translated block.  A store to such an address only raises
+  JIT_FLUSH_PENDING; the translations are thrown away once control
+  is back in jitExecute and no native code is on the stack.
+*/
+struct LC3_VM_Struct {
+    System_Latches CURRENT_LATCHES;     /* first: JIT code addresses it as the VM */
+    int RUN_BIT;                        /* run bit */
+    long long INSTRUCTION_COUNT;        /* a cycle counter */
+    int INPUT_EOF;                      /* GETC/IN ran out of input */
+    int top_p;                          /* pseudo system stack pointer */
+    int Instruction;                    /* word being executed by processInstruction */
+
+    uint16_t *MEMORY;                   /* WORDS_IN_MEM words */
+    Page_Handler PAGE_HANDLER[PAGES];
+    uint8_t PROGRAM_MAP[WORDS_IN_MEM];  /* nonzero if a program file loaded A */
+    Symbol *SYMBOLS;                    /* sorted by address */
+    int NUM_SYMBOLS, SYMBOL_ROOM;       /* entries used and allocated */
+    Decoded DECODED[DECODED_WORDS];
+
+    int JIT_ENABLED;
+    int JIT_FLUSH_PENDING;
+    uint8_t JIT_CODE_MAP[DECODED_WORDS];
+    struct Jit_State_Struct *jit;       /* blocks and code buffer, see jitInit */
+
+    FILE *output;                       /* console (OUT/PUTS/DDR and warnings) */
+    FILE *input;                        /* GETC/IN source, NULL for the terminal */
+    Console console;                    /* buffered writes to output */
+    Console *CONSOLE;                   /* the ring in use: console, or core 0's with --cores */
+
+    uint16_t KBSR, KBDR, DSR, TMR, TMI, MCR;    /* device registers */
+    uint16_t SAVED_SSP, SAVED_USP;      /* whichever stack pointer is not in R6 */
+    double TIMER_DEADLINE;              /* host time of the next timer tick */
+    int DEVICES_ACTIVE;                 /* an interrupt source is enabled */
+    int ATTENTION;                      /* leave the engine at the next control transfer */
+
+    Protect *PROTECT;                   /* region policies and violation tallies */
+    int ACCESS_PC;                      /* instruction making the current load or store */
+    int ACV_PENDING;                    /* an access faulted; take the exception */
+    int ACV_PC, ACV_ADDRESS, ACV_WRITE;
+    System_Latches ACV_LATCHES;         /* registers and CC before the faulting instruction */
+
+    Run_Limits LIMITS;                  /* --max-instructions and --timeout */
+    double RAN_SECONDS;                 /* host time spent in runLimited */
+    long long RAN_INSTRUCTIONS;         /* and the instructions it ran */
+    int STOPPED_BY;                     /* why runLimited stopped short, STOP_NONE if it didn't */
+
+    uint8_t TRAP_GUEST[TRAP_VECTORS];   /* nonzero: TRAP runs the routine in the vector table */
+
+    int IDLE_POLLS;                     /* not-ready KBSR/TMR reads since the last check */
+    int IDLE_HEAD;                      /* idle loop being timed, -1 for none */
+    double IDLE_SINCE;                  /* when IDLE_HEAD was first seen */
+    long long IDLE_SINCE_COUNT;         /* INSTRUCTION_COUNT when last seen spinning */
+    int IDLE_ARMED;                     /* seen in the loop, with no wait or interrupt since */
+    double IDLE_RATE;                   /* instructions/second it spins at, 0 if unknown */
+
+    Profile *PROFILE;                   /* counters, kept after profiling stops */
+    int PROFILING;                      /* records dispatch through the profiler */
+    struct Trace_Struct *TRACE;         /* --trace recorder, NULL when off */
+    History *HISTORY;                   /* reverse execution log, NULL when off */
+    Debug *DEBUG;                       /* breakpoints and watchpoints, NULL when none */
+    Dirty *DIRTY;                       /* --lockstep stores, NULL when off */
+
+    Cores *CORES;                       /* --cores machine this core belongs to, NULL for one core */
+    int CORE_ID;                        /* index in CORES->CORE */
+    uint16_t CALL_STACK[0x100];         /* cores after the first: the x2F00-x2FFF pseudo stack */
+};
+
+#define markCodeWrite(vm, address) \
+    ((vm)->JIT_CODE_MAP[address] ? ((vm)->JIT_FLUSH_PENDING = TRUE) : 0)
+
+#define markDirty(vm, address) \
+    ((vm)->DIRTY != NULL && !(vm)->DIRTY->MARKED[address] ? \
+     ((vm)->DIRTY->MARKED[address] = TRUE, \
+      (vm)->DIRTY->WORDS[(vm)->DIRTY->NUM_WORDS++] = (address)) : 0)
+
+#define markShared(vm, address) \
+    ((vm)->CORES != NULL && (vm)->CORES->CODE[address] ? coresStore(vm, address) : 0)
 
 /***************************************************************/
-/* A cycle counter.                                            */
+/* These are the functions you'll have to write.               */
 /***************************************************************/
-int INSTRUCTION_COUNT;
+
+void processInstruction(LC3_VM *vm);
+int executeInstructions(LC3_VM *vm, int num_instructions);
+long long runLimited(LC3_VM *vm, long long num_instructions);
+int jitInit(LC3_VM *vm);
+void jitRelease(LC3_VM *vm);
+void translateProgram(LC3_VM *vm, char *out_filename);
+void disassemble(int address, int instruction, char *buffer);
+const char *symbolFor(LC3_VM *vm, int address, int *offset);
+void decodeInstruction(int instruction, Decoded *rec);
+int interpretInstructions(LC3_VM *vm, int num_instructions, int stop_at_branch);
+int jitExecute(LC3_VM *vm, int num_instructions);
+int jitStep(LC3_VM *vm, int num_instructions);
+void serviceDevices(LC3_VM *vm);
+int protectedAccess(LC3_VM *vm, int address, int value, int is_write);
+int deviceAccess(LC3_VM *vm, int address, int value, int is_write);
+void consoleFlush(LC3_VM *vm);
+int traceOpen(LC3_VM *vm, char *filename);
+void traceClose(LC3_VM *vm);
+int traceDump(char *filename);
+void historyStart(LC3_VM *vm, int megabytes);
+void historyStop(LC3_VM *vm);
+void historyReport(LC3_VM *vm);
+void historyStore(LC3_VM *vm, int address);
+void historySeek(LC3_VM *vm, long long target);
+long long historyLastWrite(LC3_VM *vm, int address);
+long long historyLastStop(LC3_VM *vm);
+int imageSave(LC3_VM *vm, char *filename);
+Protect *protectCreate();
+void protectFree(Protect *p);
+int protectParse(Protect *p, char *text, const char *where);
+int protectReadFile(Protect *p, char *filename);
+void protectApply(LC3_VM *vm, const Protect *config);
+void protectReport(LC3_VM *vm, int quiet);
+int imageLoad(LC3_VM *vm, char *filename);
+int debugAdd(LC3_VM *vm, int low, int high, int flags);
+int debugDelete(LC3_VM *vm, int number);
+void debugList(LC3_VM *vm);
+void debugResume(LC3_VM *vm);
+int debugReport(LC3_VM *vm);
+int findSymbol(LC3_VM *vm, const char *name);
+int parseAddress(char *text);
+int trapParse(uint8_t *guest, char *text);
+int loadOS(LC3_VM *vm, char *os_filename);
+void consolePrintf(LC3_VM *vm, const char *format, ...);
+int consoleStartTimer(LC3_VM *vm, int interval_ms);
+void consoleStopTimer(LC3_VM *vm);
+int coresStore(LC3_VM *vm, int address);
+COLD void coresFetch(LC3_VM *vm, int address);
+int coresRunning(LC3_VM *vm);
+long long coresInstructions(LC3_VM *vm);
+long long coresMostInstructions(LC3_VM *vm);
+int coresExecute(Cores *cores, int num_instructions);
 
 /***************************************************************/
 /*                                                             */
@@ -138,7 +799,25 @@ void help() {
     printf("go               -  run program to completion         \n");
     printf("run n            -  execute program for n instructions\n");
     printf("mdump low high   -  dump memory from low to high      \n");
+    printf("mdump low high hex - the same as compact hex lines     \n");
+    printf("mdump low high bin f - write it to f as an .obj image  \n");
     printf("rdump            -  dump the register & bus values    \n");
+    printf("save f           -  write the whole machine to image f\n");
+    printf("load f           -  replace the machine with image f  \n");
+    printf("profile on|off   -  start (from zero) or stop profiling\n");
+    printf("profile [n]      -  report, with the n hottest addresses\n");
+    printf("profile calls [n] - the n subroutines with the most instructions\n");
+    printf("profile folded f  - write the call stacks to f for flamegraph.pl\n");
+    printf("protect          -  show the protection regions and violations\n");
+    printf("break [addr]     -  stop in front of addr (a label or address), or list\n");
+    printf("watch lo [hi] [r|w|rw] - stop after an access to lo..hi (w by default)\n");
+    printf("delete [n]       -  delete breakpoint/watchpoint n, or all of them\n");
+    printf("continue         -  go on after a stop                \n");
+    printf("history on [mb]  -  record history to step back through\n");
+    printf("history [off]    -  report on the history, or drop it  \n");
+    printf("rstep [n]        -  go back n instructions (default 1) \n");
+    printf("rcontinue        -  go back to the last breakpoint or watchpoint stop\n");
+    printf("rwrite addr      -  go back to the last store to addr  \n");
     printf("?                -  display this help menu            \n");
     printf("quit             -  exit the program                  \n\n");
 }
@@ -150,11 +829,132 @@ void help() {
 /* Purpose   : Execute a cycle                                 */
 /*                                                             */
 /***************************************************************/
-void cycle() {
+void cycle(LC3_VM *vm) {
+
+    processInstruction(vm);
+    vm->INSTRUCTION_COUNT++;
+}
+
+/* The next instruction to run, after a stop or a move through the history */
+void printWhere(LC3_VM *vm) {
+    char text[40];
+
+    disassemble(vm->CURRENT_LATCHES.PC, vm->MEMORY[vm->CURRENT_LATCHES.PC], text);
+    printf("At instruction %lld, PC x%04X: %s\n\n", vm->INSTRUCTION_COUNT, vm->CURRENT_LATCHES.PC, text);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : runLimited                                      */
+/*                                                             */
+/* Purpose   : Run up to num_instructions instructions (with   */
+/*             a negative count, until the machine stops) in   */
+/*             RUN_SLICE pieces, checking the limits and for   */
+/*             a signal in between.  Stops early at PC 0x0000, */
+/*             a breakpoint or watchpoint, or a limit, and     */
+/*             records which of the last two in STOPPED_BY.    */
+/*             Returns the number of instructions run.  With   */
+/*             --cores every core gets num_instructions, the   */
+/*             limit applies to each, and the return is the    */
+/*             most any core ran.                              */
+/*                                                             */
+/***************************************************************/
+static double hostSeconds();
+
+/* Set by SIGINT/SIGTERM while go or run is simulating */
+static volatile sig_atomic_t stop_signal = 0;
+
+/* What quit and the end of the commands exit with: a limit's status, or 0 */
+static int repl_exit_status = 0;
+
+/* --run and --commands: no banner, prompts, or chatter around go and run */
+static int repl_quiet = FALSE;
+
+long long runLimited(LC3_VM *vm, long long num_instructions) {
+    double start = hostSeconds();
+    long long done = 0, before = coresInstructions(vm);
+
+    vm->STOPPED_BY = STOP_NONE;
+    while (coresRunning(vm) && (vm->DEBUG == NULL || !vm->DEBUG->STOPPED)) {
+        long long slice = RUN_SLICE;
 
-    processInstruction();
-    CURRENT_LATCHES = NEXT_LATCHES;
-    INSTRUCTION_COUNT++;
+        if (num_instructions >= 0 && num_instructions - done < slice)
+            slice = num_instructions - done;
+        if (slice == 0)
+            break;
+        if (vm->LIMITS.MAX_INSTRUCTIONS > 0) {
+            long long left = vm->LIMITS.MAX_INSTRUCTIONS - coresMostInstructions(vm);
+
+            if (left <= 0) {
+                vm->STOPPED_BY = STOP_INSTRUCTIONS;
+                break;
+            }
+            if (left < slice)
+                slice = left;
+        }
+        if (vm->LIMITS.TIMEOUT > 0 && vm->RAN_SECONDS + (hostSeconds() - start) >= vm->LIMITS.TIMEOUT) {
+            vm->STOPPED_BY = STOP_TIMEOUT;
+            break;
+        }
+        if (stop_signal) {
+            vm->STOPPED_BY = STOP_SIGNAL;
+            break;
+        }
+        if (vm->CORES != NULL)
+            done += coresExecute(vm->CORES, (int) slice);
+        else
+            done += executeInstructions(vm, (int) slice);
+    }
+    if (vm->DEBUG != NULL && vm->DEBUG->STOPPED)
+        vm->STOPPED_BY = STOP_DEBUG;
+    vm->RAN_SECONDS += hostSeconds() - start;
+    vm->RAN_INSTRUCTIONS += vm->CORES != NULL ? coresInstructions(vm) - before : done;
+    return done;
+}
+
+/* A second signal, say while GETC blocks on the keyboard, does not wait for the check */
+static void stopOnSignal(int sig) {
+    if (stop_signal)
+        _exit(128 + sig);
+    stop_signal = sig;
+}
+
+/* Catch SIGINT and SIGTERM while simulating; put the defaults back after */
+static void catchSignals(int on) {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on ? stopOnSignal : SIG_DFL;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+/*
+  Report a run that a limit or a signal stopped; FALSE if none did.
+  A limit leaves the machine where it stopped for rdump/mdump and
+  sets the status quit exits with; a signal exits at once, with the
+  status the shell gives a process the signal killed.
+*/
+static int limitReport(LC3_VM *vm) {
+    switch (vm->STOPPED_BY) {
+        case STOP_INSTRUCTIONS:
+            printf("\nSimulator stopped: instruction limit of %lld reached\n", vm->LIMITS.MAX_INSTRUCTIONS);
+            repl_exit_status = EXIT_INSTRUCTION_LIMIT;
+            break;
+        case STOP_TIMEOUT:
+            printf("\nSimulator stopped: timeout after %g seconds\n", vm->LIMITS.TIMEOUT);
+            repl_exit_status = EXIT_TIMEOUT;
+            break;
+        case STOP_SIGNAL:
+            printf("\nSimulator stopped: signal %d\n", (int) stop_signal);
+            exit(128 + stop_signal);
+        default:
+            return FALSE;
+    }
+    printWhere(vm);
+    return TRUE;
 }
 
 /***************************************************************/
@@ -164,22 +964,32 @@ void cycle() {
 /* Purpose   : Simulate the LC-3 for n cycles                 */
 /*                                                             */
 /***************************************************************/
-void run(int num_cycles) {
-    int i;
+void run(LC3_VM *vm, long long num_cycles) {
+    long long done;
 
-    if (RUN_BIT == FALSE) {
+    if (vm->RUN_BIT == FALSE) {
         printf("Can't simulate, Simulator is halted\n\n");
         return;
     }
 
-    printf("Simulating for %d cycles...\n\n", num_cycles);
-    for (i = 0; i < num_cycles; i++) {
-        if (CURRENT_LATCHES.PC == 0x0000) {
-            RUN_BIT = FALSE;
+    if (!repl_quiet)
+        printf("Simulating for %lld cycles...\n\n", num_cycles);
+    debugResume(vm);
+    /* The engine only stops short at PC 0x0000, a breakpoint/watchpoint or a limit */
+    catchSignals(TRUE);
+    done = runLimited(vm, num_cycles);
+    catchSignals(FALSE);
+    consoleFlush(vm);
+    reset_terminal_mode();
+    if (debugReport(vm))
+        printWhere(vm);
+    else if (limitReport(vm))
+        ;
+    else if (done < num_cycles) {
+        vm->RUN_BIT = FALSE;
+        if (!repl_quiet)
             printf("\nSimulator halted\n\n");
-            break;
-        }
-        cycle();
+        protectReport(vm, TRUE);
     }
 }
 
@@ -190,17 +1000,30 @@ void run(int num_cycles) {
 /* Purpose   : Simulate the LC-3 until HALTed                 */
 /*                                                             */
 /***************************************************************/
-void go() {
-    if (RUN_BIT == FALSE) {
+void go(LC3_VM *vm) {
+    if (vm->RUN_BIT == FALSE) {
         printf("Can't simulate, Simulator is halted\n\n");
         return;
     }
 
-    printf("Simulating...\n");
-    while (CURRENT_LATCHES.PC != 0x0000)
-        cycle();
-    RUN_BIT = FALSE;
-    printf("\nSimulator halted\n\n");
+    if (!repl_quiet)
+        printf("Simulating...\n");
+    debugResume(vm);
+    catchSignals(TRUE);
+    runLimited(vm, -1);
+    catchSignals(FALSE);
+    consoleFlush(vm);
+    reset_terminal_mode();
+    if (debugReport(vm)) {
+        printWhere(vm);
+        return;
+    }
+    if (limitReport(vm))
+        return;
+    vm->RUN_BIT = FALSE;
+    if (!repl_quiet)
+        printf("\nSimulator halted\n\n");
+    protectReport(vm, TRUE);
 }
 
 /***************************************************************/
@@ -211,22 +1034,118 @@ void go() {
 /*             output file.                                    */
 /*                                                             */
 /***************************************************************/
-void mdump(FILE * dumpsim_file, int start, int stop) {
+void mdump(LC3_VM *vm, FILE * dumpsim_file, int start, int stop) {
     int address; /* this is a address */
 
     printf("\nMemory content [0x%.4x..0x%.4x] :\n", start, stop);
     printf("-------------------------------------\n");
     for (address = start ; address <= stop ; address++)
-        printf("  0x%.4x (%d) : 0x%.2x\n", address , address , MEMORY[address]);
+        printf("  0x%.4x (%d) : 0x%.2x\n", address , address , vm->MEMORY[address]);
     printf("\n");
 
     /* dump the memory contents into the dumpsim file */
     fprintf(dumpsim_file, "\nMemory content [0x%.4x..0x%.4x] :\n", start, stop);
     fprintf(dumpsim_file, "-------------------------------------\n");
     for (address = start ; address <= stop ; address++)
-        fprintf(dumpsim_file, " 0x%.4x (%d) : 0x%.2x\n", address , address , MEMORY[address]);
+        fprintf(dumpsim_file, " 0x%.4x (%d) : 0x%.2x\n", address , address , vm->MEMORY[address]);
+    fprintf(dumpsim_file, "\n");
+    fflush(dumpsim_file);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : mdumpHex                                        */
+/*                                                             */
+/* Purpose   : Dump memory as compact hex lines, eight words   */
+/*             to a line after the address of the first, to    */
+/*             the console and the output file.                */
+/*                                                             */
+/***************************************************************/
+/*
+  The whole dump is formatted into one buffer with a digit table
+  and written with one fwrite per stream, rather than two printf
+  calls per word; a full 64K-word dump takes milliseconds.
+*/
+#define MDUMP_LINE_WORDS    8
+
+void mdumpHex(LC3_VM *vm, FILE * dumpsim_file, int start, int stop) {
+    static const char digits[] = "0123456789ABCDEF";
+    int words = stop - start + 1;
+    int lines = (words + MDUMP_LINE_WORDS - 1) / MDUMP_LINE_WORDS;
+    char *text = malloc(lines * (6 + 5 * MDUMP_LINE_WORDS + 1)), *p = text;
+    int address;
+
+    if (text == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
+    }
+    for (address = start; address <= stop; address++) {
+        int value = vm->MEMORY[address];
+
+        if ((address - start) % MDUMP_LINE_WORDS == 0) {
+            if (address != start)
+                *p++ = '\n';
+            *p++ = 'x';
+            *p++ = digits[address >> 12];
+            *p++ = digits[(address >> 8) & 15];
+            *p++ = digits[(address >> 4) & 15];
+            *p++ = digits[address & 15];
+            *p++ = ':';
+        }
+        *p++ = ' ';
+        *p++ = digits[value >> 12];
+        *p++ = digits[(value >> 8) & 15];
+        *p++ = digits[(value >> 4) & 15];
+        *p++ = digits[value & 15];
+    }
+    *p++ = '\n';
+
+    fwrite(text, 1, p - text, stdout);
+    printf("\n");
+    fwrite(text, 1, p - text, dumpsim_file);
     fprintf(dumpsim_file, "\n");
     fflush(dumpsim_file);
+    free(text);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : mdumpBinary                                     */
+/*                                                             */
+/* Purpose   : Write memory from start to stop to filename as  */
+/*             an lc3as .obj image: the origin, then the words */
+/*             big-endian.  Returns FALSE after printing an    */
+/*             error.                                          */
+/*                                                             */
+/***************************************************************/
+int mdumpBinary(LC3_VM *vm, char *filename, int start, int stop) {
+    int words = stop - start + 1, i, fd;
+    uint8_t *image = malloc(2 * (words + 1));
+    ssize_t written;
+
+    if (image == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
+    }
+    image[0] = start >> 8;
+    image[1] = start & 0xFF;
+    for (i = 0; i < words; i++) {
+        image[2 * i + 2] = vm->MEMORY[start + i] >> 8;
+        image[2 * i + 3] = vm->MEMORY[start + i] & 0xFF;
+    }
+
+    if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        printf("Error: Can't open dump file %s\n", filename);
+        free(image);
+        return FALSE;
+    }
+    written = write(fd, image, 2 * (words + 1));
+    free(image);
+    if (close(fd) < 0 || written != 2 * (words + 1)) {
+        printf("Error: Can't write dump file %s\n", filename);
+        return FALSE;
+    }
+    return TRUE;
 }
 
 /***************************************************************/
@@ -234,661 +1153,7017 @@ void mdump(FILE * dumpsim_file, int start, int stop) {
 /* Procedure : rdump                                           */
 /*                                                             */
 /* Purpose   : Dump current register and bus values to the     */
-/*             output file.                                    */
+/*             output file; with --cores, every core's.        */
 /*                                                             */
 /***************************************************************/
-void rdump(FILE * dumpsim_file) {
+static void rdumpCore(LC3_VM *vm, FILE * dumpsim_file, const char *which) {
     int k;
 
-    printf("\nCurrent register/bus values :\n");
+    printf("\nCurrent register/bus values%s :\n", which);
     printf("-------------------------------------\n");
-    printf("Instruction Count : %d\n", INSTRUCTION_COUNT);
-    printf("PC                : 0x%.4x\n", CURRENT_LATCHES.PC);
-    printf("CCs: N = %d  Z = %d  P = %d\n", CURRENT_LATCHES.N, CURRENT_LATCHES.Z, CURRENT_LATCHES.P);
+    printf("Instruction Count : %lld\n", vm->INSTRUCTION_COUNT);
+    printf("PC                : 0x%.4x\n", vm->CURRENT_LATCHES.PC);
+    printf("CCs: N = %d  Z = %d  P = %d\n", CC_N(vm->CURRENT_LATCHES), CC_Z(vm->CURRENT_LATCHES), CC_P(vm->CURRENT_LATCHES));
     printf("Registers:\n");
     for (k = 0; k < LC_3_REGS; k++)
-        printf("%d: 0x%.4x\n", k, CURRENT_LATCHES.REGS[k]);
+        printf("%d: 0x%.4x\n", k, vm->CURRENT_LATCHES.REGS[k]);
     printf("\n");
 
     /* dump the state information into the dumpsim file */
-    fprintf(dumpsim_file, "\nCurrent register/bus values :\n");
+    fprintf(dumpsim_file, "\nCurrent register/bus values%s :\n", which);
     fprintf(dumpsim_file, "-------------------------------------\n");
-    fprintf(dumpsim_file, "Instruction Count : %d\n", INSTRUCTION_COUNT);
-    fprintf(dumpsim_file, "PC                : 0x%.4x\n", CURRENT_LATCHES.PC);
-    fprintf(dumpsim_file, "CCs: N = %d  Z = %d  P = %d\n", CURRENT_LATCHES.N, CURRENT_LATCHES.Z, CURRENT_LATCHES.P);
+    fprintf(dumpsim_file, "Instruction Count : %lld\n", vm->INSTRUCTION_COUNT);
+    fprintf(dumpsim_file, "PC                : 0x%.4x\n", vm->CURRENT_LATCHES.PC);
+    fprintf(dumpsim_file, "CCs: N = %d  Z = %d  P = %d\n", CC_N(vm->CURRENT_LATCHES), CC_Z(vm->CURRENT_LATCHES), CC_P(vm->CURRENT_LATCHES));
     fprintf(dumpsim_file, "Registers:\n");
     for (k = 0; k < LC_3_REGS; k++)
-        fprintf(dumpsim_file, "%d: 0x%.4x\n", k, CURRENT_LATCHES.REGS[k]);
+        fprintf(dumpsim_file, "%d: 0x%.4x\n", k, vm->CURRENT_LATCHES.REGS[k]);
     fprintf(dumpsim_file, "\n");
     fflush(dumpsim_file);
 }
 
+void rdump(LC3_VM *vm, FILE * dumpsim_file) {
+    char which[32];
+    int core;
+
+    if (vm->CORES == NULL) {
+        rdumpCore(vm, dumpsim_file, "");
+        return;
+    }
+    for (core = 0; core < vm->CORES->NUM_CORES; core++) {
+        sprintf(which, " (core %d of %d)", core, vm->CORES->NUM_CORES);
+        rdumpCore(vm->CORES->CORE[core], dumpsim_file, which);
+    }
+}
+
 /***************************************************************/
 /*                                                             */
-/* Procedure : getCommand                                     */
+/* Procedure : profileStart / profileStop                      */
 /*                                                             */
-/* Purpose   : Read a command from standard input.             */
+/* Purpose   : Turn counting on (from zero) or off.  Either    */
+/*             way every cached record is decoded again, so it */
+/*             is routed through the profiler or not.          */
 /*                                                             */
 /***************************************************************/
-void getCommand(FILE * dumpsim_file) {
-    char buffer[20];
-    int start, stop, cycles;
-
-    printf("LC-3-SIM> ");
+/* Drop every cached record, so each is routed afresh on its next fetch */
+void redecodeAll(LC3_VM *vm) {
+    int address;
 
-    scanf("%s", buffer);
-    printf("\n");
+    for (address = 0; address < DECODED_WORDS; address++)
+        invalidateDecoded(vm, address);
+}
 
-    switch(buffer[0]) {
-        case 'G':
-        case 'g':
-            go();
-            break;
+/* The child of parent (-1: a new root) for a call to function */
+static int profileNode(Profile *prof, int parent, int function) {
+    Profile_Node *node;
+    int i;
 
-        case 'M':
-        case 'm':
-            scanf("%i %i", &start, &stop);
-            mdump(dumpsim_file, start, stop);
-            break;
+    for (i = parent < 0 ? -1 : prof->NODES[parent].child; i >= 0; i = prof->NODES[i].sibling)
+        if (prof->NODES[i].function == function)
+            return i;
+    if (prof->NUM_NODES == prof->MAX_NODES) {
+        prof->MAX_NODES = prof->MAX_NODES ? 2 * prof->MAX_NODES : 64;
+        if ((prof->NODES = realloc(prof->NODES, prof->MAX_NODES * sizeof(Profile_Node))) == NULL) {
+            printf("Error: Out of memory\n");
+            exit(-1);
+        }
+    }
+    i = prof->NUM_NODES++;
+    node = &prof->NODES[i];
+    node->function = function;
+    node->parent = parent;
+    node->child = -1;
+    node->sibling = -1;
+    node->self = 0;
+    node->calls = 0;
+    if (parent >= 0) {
+        node->sibling = prof->NODES[parent].child;
+        prof->NODES[parent].child = i;
+    }
+    return i;
+}
 
-        case '?':
-            help();
-            break;
-        case 'Q':
-        case 'q':
-            printf("Bye.\n");
-            exit(0);
+/* Charge the instructions run since the last call or return to the current node */
+static void profileSettle(Profile *prof, long long now) {
+    prof->NODES[prof->STACK[prof->DEPTH - 1]].self += now - prof->CHARGED;
+    prof->CHARGED = now;
+}
 
-        case 'R':
-        case 'r':
-            if (buffer[1] == 'd' || buffer[1] == 'D')
-                rdump(dumpsim_file);
-            else {
-                scanf("%d", &cycles);
-                run(cycles);
-            }
-            break;
+void profileStart(LC3_VM *vm) {
+    Profile *prof = vm->PROFILE;
 
-        default:
-            printf("Invalid Command\n");
-            break;
+    if (prof == NULL && (prof = vm->PROFILE = calloc(1, sizeof(Profile))) == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
     }
+    free(prof->NODES);
+    memset(prof, 0, sizeof(Profile));
+    prof->STACK[0] = profileNode(prof, -1, vm->CURRENT_LATCHES.PC);
+    prof->DEPTH = 1;
+    prof->CHARGED = vm->INSTRUCTION_COUNT;
+    vm->PROFILING = TRUE;
+    redecodeAll(vm);
+}
+
+void profileStop(LC3_VM *vm) {
+    if (vm->PROFILING)
+        profileSettle(vm->PROFILE, vm->INSTRUCTION_COUNT);
+    vm->PROFILING = FALSE;
+    redecodeAll(vm);
+}
+
+void profileFree(LC3_VM *vm) {
+    if (vm->PROFILE == NULL)
+        return;
+    free(vm->PROFILE->NODES);
+    free(vm->PROFILE);
+    vm->PROFILE = NULL;
+}
+
+/* Display names of the Decoded ops; the two forms of ADD and AND share a row */
+static const char *const profile_op_names[OP_COUNT] = {
+    NULL, "ADD", NULL, "AND", NULL, "NOT", "BR", "JMP", "RET", "JSR", "JSRR",
+    "LD", "LDI", "LDR", "LEA", "ST", "STI", "STR", "RTI", "TRAP", "NOP"
+};
+
+static uint64_t profileOpCount(Profile *prof, int op) {
+    if (op == OP_ADD_REG || op == OP_AND_REG)
+        return prof->OPS[op] + prof->OPS[op + 1];
+    return prof->OPS[op];
+}
+
+static double percentOf(uint64_t part, uint64_t total) {
+    return total ? 100.0 * part / total : 0.0;
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : initMemory                                     */
+/* Procedure : profileReport                                   */
 /*                                                             */
-/* Purpose   : Zero out the memory array                       */
+/* Purpose   : Print the counts by opcode and trap vector, the */
+/*             top hot addresses with their disassembly and    */
+/*             the loads and stores per page.                  */
 /*                                                             */
 /***************************************************************/
-void initMemory() {
-    int i;
+void profileReport(LC3_VM *vm, int top) {
+    Profile *prof = vm->PROFILE;
+    uint64_t total = 0;
+    int hot[100], num_hot = 0, op, address, i;
+    char text[32];
+
+    if (prof == NULL) {
+        printf("No profile: use profile on first\n\n");
+        return;
+    }
+    for (op = 0; op < OP_COUNT; op++)
+        total += prof->OPS[op];
+    printf("Profile%s: %llu instructions\n\n", vm->PROFILING ? "" : " (stopped)",
+           (unsigned long long) total);
+
+    printf("%-16s %14s %7s\n", "Opcode", "count", "%");
+    for (op = 0; op < OP_COUNT; op++) {
+        uint64_t n = profileOpCount(prof, op);
+
+        if (profile_op_names[op] == NULL || n == 0)
+            continue;
+        printf("%-16s %14llu %6.2f%%\n", profile_op_names[op], (unsigned long long) n, percentOf(n, total));
+        if (op != OP_TRAP)
+            continue;
+        for (i = 0; i < 256; i++) {
+            if (prof->TRAPS[i] == 0)
+                continue;
+            disassemble(0, 0xF000 | i, text);
+            printf("  x%.2X %-10s %14llu %6.2f%%\n", i, text, (unsigned long long) prof->TRAPS[i],
+                   percentOf(prof->TRAPS[i], total));
+        }
+    }
 
-    for (i=0; i < WORDS_IN_MEM; i++) {
-        MEMORY[i] = 0;
+    /* Keep the top addresses sorted by insertion */
+    if (top > (int) (sizeof(hot) / sizeof(hot[0])))
+        top = sizeof(hot) / sizeof(hot[0]);
+    for (address = 0; address < WORDS_IN_MEM; address++) {
+        uint64_t n = prof->EXECUTED[address];
+
+        if (n == 0 || (num_hot == top && n <= prof->EXECUTED[hot[top - 1]]))
+            continue;
+        for (i = num_hot < top ? num_hot++ : top - 1; i > 0 && prof->EXECUTED[hot[i - 1]] < n; i--)
+            hot[i] = hot[i - 1];
+        hot[i] = address;
+    }
+    printf("\n%-7s %14s %7s  %s\n", "Address", "count", "%", "Instruction");
+    for (i = 0; i < num_hot; i++) {
+        uint64_t n = prof->EXECUTED[hot[i]];
+
+        disassemble(hot[i], Low16bits(vm->MEMORY[hot[i]]), text);
+        printf("x%.4X   %14llu %6.2f%%  ", hot[i], (unsigned long long) n, percentOf(n, total));
+        if ((vm->MEMORY[hot[i]] >> 12) == 0 && (vm->MEMORY[hot[i]] & 0x0E00))
+            printf("%-20s taken %6.2f%%\n", text, percentOf(prof->TAKEN[hot[i]], n));
+        else
+            printf("%s\n", text);
     }
+
+    printf("\n%-7s %14s %14s\n", "Page", "loads", "stores");
+    for (i = 0; i < PAGES; i++)
+        if (prof->LOADS[i] || prof->STORES[i])
+            printf("x%.4X   %14llu %14llu\n", i << PAGE_SHIFT,
+                   (unsigned long long) prof->LOADS[i], (unsigned long long) prof->STORES[i]);
+    printf("\n");
 }
 
+/***************************************************************/
+/*                                                             */
+/* Procedure : profileWrite                                    */
+/*                                                             */
+/* Purpose   : Write every nonzero counter as a CSV row:       */
+/*             kind,key,count,taken,instruction                */
+/*                                                             */
+/***************************************************************/
+void profileWrite(LC3_VM *vm, FILE *csv) {
+    Profile *prof = vm->PROFILE;
+    int op, i;
+    char text[32];
+
+    fprintf(csv, "kind,key,count,taken,instruction\n");
+    for (op = 0; op < OP_COUNT; op++)
+        if (profile_op_names[op] != NULL && profileOpCount(prof, op))
+            fprintf(csv, "op,%s,%llu,,\n", profile_op_names[op],
+                    (unsigned long long) profileOpCount(prof, op));
+    for (i = 0; i < 256; i++)
+        if (prof->TRAPS[i]) {
+            disassemble(0, 0xF000 | i, text);
+            fprintf(csv, "trap,x%.2X,%llu,,%s\n", i, (unsigned long long) prof->TRAPS[i], text);
+        }
+    for (i = 0; i < WORDS_IN_MEM; i++) {
+        if (prof->EXECUTED[i] == 0)
+            continue;
+        disassemble(i, Low16bits(vm->MEMORY[i]), text);
+        fprintf(csv, "pc,x%.4X,%llu,", i, (unsigned long long) prof->EXECUTED[i]);
+        if ((vm->MEMORY[i] >> 12) == 0 && (vm->MEMORY[i] & 0x0E00))
+            fprintf(csv, "%llu", (unsigned long long) prof->TAKEN[i]);
+        fprintf(csv, ",\"%s\"\n", text);
+    }
+    for (i = 0; i < PAGES; i++) {
+        if (prof->LOADS[i])
+            fprintf(csv, "load,x%.4X,%llu,,\n", i << PAGE_SHIFT, (unsigned long long) prof->LOADS[i]);
+        if (prof->STORES[i])
+            fprintf(csv, "store,x%.4X,%llu,,\n", i << PAGE_SHIFT, (unsigned long long) prof->STORES[i]);
+    }
+}
+
+/* A subroutine's label from the .sym files, label+offset, or its address */
+static const char *profileName(LC3_VM *vm, int address, char *buffer) {
+    int offset;
+    const char *name = symbolFor(vm, address, &offset);
+
+    if (name == NULL)
+        sprintf(buffer, "x%.4X", address);
+    else if (offset == 0)
+        return name;
+    else
+        snprintf(buffer, 64, "%s+%d", name, offset);
+    return buffer;
+}
+
+typedef struct Profile_Function_Struct {
+    int function;
+    uint64_t inclusive, exclusive, calls;
+} Profile_Function;
+
+static int compareInclusive(const void *a, const void *b) {
+    const Profile_Function *fa = a, *fb = b;
+
+    if (fa->inclusive != fb->inclusive)
+        return fa->inclusive < fb->inclusive ? 1 : -1;
+    return fa->function - fb->function;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : profileCalls                                    */
+/*                                                             */
+/* Purpose   : Print calls and inclusive/exclusive instruction */
+/*             counts for the top subroutines, by inclusive    */
+/*             count.                                          */
+/*                                                             */
+/***************************************************************/
+/*
+  A node's inclusive count is its whole subtree.  A subroutine's
+  inclusive count only adds up its nodes with no caller above them
+  that is the same subroutine, so recursion is not counted twice.
+*/
+void profileCalls(LC3_VM *vm, int top) {
+    Profile *prof = vm->PROFILE;
+    Profile_Function *functions;
+    uint64_t *subtree;
+    int *index, num_functions = 0, i, j;
+    char buffer[64];
+
+    if (prof == NULL) {
+        printf("No profile: use profile on first\n\n");
+        return;
+    }
+    if (vm->PROFILING)
+        profileSettle(prof, vm->INSTRUCTION_COUNT);
+
+    subtree = calloc(prof->NUM_NODES, sizeof(uint64_t));
+    functions = calloc(prof->NUM_NODES, sizeof(Profile_Function));
+    index = malloc(WORDS_IN_MEM * sizeof(int));
+    if (subtree == NULL || functions == NULL || index == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
+    }
+    /* Children always come after their parent */
+    for (i = prof->NUM_NODES - 1; i >= 0; i--) {
+        subtree[i] += prof->NODES[i].self;
+        if (prof->NODES[i].parent >= 0)
+            subtree[prof->NODES[i].parent] += subtree[i];
+    }
+    memset(index, -1, WORDS_IN_MEM * sizeof(int));
+    for (i = 0; i < prof->NUM_NODES; i++) {
+        Profile_Node *node = &prof->NODES[i];
+        Profile_Function *f;
+
+        if (index[node->function] < 0) {
+            index[node->function] = num_functions;
+            functions[num_functions++].function = node->function;
+        }
+        f = &functions[index[node->function]];
+        f->exclusive += node->self;
+        f->calls += node->calls;
+        for (j = node->parent; j >= 0 && prof->NODES[j].function != node->function; j = prof->NODES[j].parent)
+            ;
+        if (j < 0)
+            f->inclusive += subtree[i];
+    }
+    qsort(functions, num_functions, sizeof(Profile_Function), compareInclusive);
+
+    printf("%-24s %10s %14s %7s %14s %7s\n", "Subroutine", "calls", "inclusive", "%", "exclusive", "%");
+    for (i = 0; i < num_functions && i < top; i++) {
+        Profile_Function *f = &functions[i];
+
+        printf("%-24s %10llu %14llu %6.2f%% %14llu %6.2f%%\n", profileName(vm, f->function, buffer),
+               (unsigned long long) f->calls, (unsigned long long) f->inclusive, percentOf(f->inclusive, subtree[0]),
+               (unsigned long long) f->exclusive, percentOf(f->exclusive, subtree[0]));
+    }
+    printf("\n");
+    free(subtree);
+    free(functions);
+    free(index);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : profileFolded                                   */
+/*                                                             */
+/* Purpose   : Write the call tree in folded-stack format, one */
+/*             "outer;...;inner count" line per node that ran  */
+/*             instructions of its own, for flamegraph.pl.     */
+/*                                                             */
+/***************************************************************/
+void profileFolded(LC3_VM *vm, FILE *out) {
+    Profile *prof = vm->PROFILE;
+    int chain[PROFILE_DEPTH], i, j, depth;
+    char buffer[64];
+
+    if (vm->PROFILING)
+        profileSettle(prof, vm->INSTRUCTION_COUNT);
+    for (i = 0; i < prof->NUM_NODES; i++) {
+        if (prof->NODES[i].self == 0)
+            continue;
+        for (depth = 0, j = i; j >= 0; j = prof->NODES[j].parent)
+            chain[depth++] = j;
+        while (depth-- > 0)
+            fprintf(out, "%s%c", profileName(vm, prof->NODES[chain[depth]].function, buffer),
+                    depth ? ';' : ' ');
+        fprintf(out, "%llu\n", (unsigned long long) prof->NODES[i].self);
+    }
+}
+
+/* profile on | off | calls [n] | folded file | [n]: the rest of the command line is in args */
+static void profileCommand(LC3_VM *vm, char *args) {
+    char word[8], filename[64];
+    int top = PROFILE_TOP;
+    FILE *out;
+
+    if (sscanf(args, "%7s", word) == 1) {
+        if (strcmp(word, "calls") == 0) {
+            sscanf(args, "%*s %d", &top);
+            profileCalls(vm, top);
+            return;
+        }
+        if (strcmp(word, "folded") == 0) {
+            if (sscanf(args, "%*s %63s", filename) != 1)
+                printf("Error: usage: profile folded file\n\n");
+            else if (vm->PROFILE == NULL)
+                printf("No profile: use profile on first\n\n");
+            else if ((out = fopen(filename, "w")) == NULL)
+                printf("Error: Can't open %s\n\n", filename);
+            else {
+                profileFolded(vm, out);
+                fclose(out);
+                printf("Wrote %s\n\n", filename);
+            }
+            return;
+        }
+        if (strcmp(word, "on") == 0) {
+            profileStart(vm);
+            printf("Profiling on\n\n");
+            return;
+        }
+        if (strcmp(word, "off") == 0) {
+            profileStop(vm);
+            printf("Profiling off\n\n");
+            return;
+        }
+        top = atoi(word);
+    }
+    profileReport(vm, top);
+}
+
+/* history on [megabytes] | off | (report): the rest of the command line is in args */
+static void historyCommand(LC3_VM *vm, char *args) {
+    char word[8];
+    int megabytes = HISTORY_BUDGET;
+
+    if (sscanf(args, "%7s", word) != 1) {
+        historyReport(vm);
+        return;
+    }
+    if (strcmp(word, "on") == 0) {
+        sscanf(args, "%*s %d", &megabytes);
+        if (megabytes <= 0) {
+            printf("Error: usage: history on [megabytes]\n\n");
+            return;
+        }
+        historyStart(vm, megabytes);
+        printf("Recording history, up to %d MB\n\n", megabytes);
+    } else if (strcmp(word, "off") == 0) {
+        historyStop(vm);
+        printf("History off\n\n");
+    } else
+        printf("Error: usage: history [on [megabytes] | off]\n\n");
+}
+
+/* An address (x3000, #12288, ...) or a label from a .sym file; -1 if neither */
+static int parseLocation(LC3_VM *vm, char *text) {
+    int address = parseAddress(text);
+
+    return address >= 0 ? address : findSymbol(vm, text);
+}
+
+/* break [location] | watch [low [high] [r|w|rw]] | delete [n]: command is the first word, args the rest */
+static void debugCommand(LC3_VM *vm, char *command, char *args) {
+    char first[64], second[64], third[64];
+    int words = sscanf(args, "%63s %63s %63s", first, second, third);
+    int low, high, flags = DEBUG_WRITE, number;
+    char *mode = NULL;
+
+    if (command[0] == 'd' || command[0] == 'D') {
+        number = words >= 1 ? atoi(first) : 0;
+        if ((words >= 1 && number <= 0) || !debugDelete(vm, number))
+            printf("No such breakpoint or watchpoint\n\n");
+        else if (number == 0)
+            printf("Deleted all breakpoints and watchpoints\n\n");
+        else
+            printf("Deleted %d\n\n", number);
+        return;
+    }
+    if (words < 1) {
+        debugList(vm);
+        return;
+    }
+    if ((low = parseLocation(vm, first)) < 0) {
+        printf("Error: unknown address or label %s\n\n", first);
+        return;
+    }
+    high = low;
+    if (command[0] == 'b' || command[0] == 'B') {
+        flags = DEBUG_BREAK;
+    } else if (words >= 2) {
+        /* the second word is either the end of the range or the mode */
+        if (strcmp(second, "r") != 0 && strcmp(second, "w") != 0 && strcmp(second, "rw") != 0) {
+            if ((high = parseLocation(vm, second)) < low) {
+                printf("Error: bad watch range %s %s\n\n", first, second);
+                return;
+            }
+            if (words == 3)
+                mode = third;
+        } else
+            mode = second;
+        if (mode != NULL) {
+            if (strcmp(mode, "r") == 0)
+                flags = DEBUG_READ;
+            else if (strcmp(mode, "rw") == 0)
+                flags = DEBUG_READ | DEBUG_WRITE;
+            else if (strcmp(mode, "w") != 0) {
+                printf("Error: usage: watch low [high] [r|w|rw]\n\n");
+                return;
+            }
+        }
+    }
+    if ((number = debugAdd(vm, low, high, flags)) < 0)
+        printf("Error: at most %d breakpoints and watchpoints\n\n", DEBUG_POINTS);
+    else if (flags == DEBUG_BREAK)
+        printf("Breakpoint %d at x%04X\n\n", number, low);
+    else
+        printf("Watchpoint %d on x%04X-x%04X\n\n", number, low, high);
+}
+
+/* rstep [n] | rcontinue | rwrite address: command is the first word, args the rest */
+static void reverseCommand(LC3_VM *vm, char *command, char *args) {
+    char word[20];
+    long long n = 1, found;
+    int address;
+
+    if (vm->HISTORY == NULL) {
+        printf("No history: use history on (or --history) first\n\n");
+        return;
+    }
+    if (command[1] == 's' || command[1] == 'S') {
+        sscanf(args, "%lld", &n);
+        historySeek(vm, vm->INSTRUCTION_COUNT - (n > 0 ? n : 1));
+    } else if (command[1] == 'c' || command[1] == 'C') {
+        if (vm->DEBUG == NULL)
+            historySeek(vm, 0);
+        else if (historyLastStop(vm) < 0)
+            printf("No breakpoint or watchpoint stop in the history\n");
+    } else if (sscanf(args, "%19s", word) != 1 || (address = parseAddress(word)) < 0) {
+        printf("Error: usage: rwrite address\n\n");
+        return;
+    } else if ((found = historyLastWrite(vm, address)) < 0)
+        printf("No store to x%04X in the history\n", address);
+    printWhere(vm);
+}
+
+/*
+  When GETC/IN share a piped stdin with the commands, the program's
+  input starts on the line after go/run.
+*/
+static void skipCommandLine(LC3_VM *vm, FILE *commands) {
+    int c;
+
+    if (vm->input != commands)
+        return;
+    while ((c = getc(commands)) != EOF && c != '\n')
+        ;
+}
+
+/* Commands that follow one core through time: FALSE, with an error, under --cores */
+static int singleCore(LC3_VM *vm, const char *command) {
+    if (vm->CORES == NULL)
+        return TRUE;
+    printf("Error: %s does not work with --cores\n\n", command);
+    return FALSE;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : getCommand                                     */
+/*                                                             */
+/* Purpose   : Read a command from standard input, or from   */
+/*             the --run/--commands list, and carry it out.    */
+/*                                                             */
+/***************************************************************/
+void getCommand(LC3_VM *vm, FILE *commands, FILE * dumpsim_file) {
+    char buffer[20], args[256], mode[8], filename[200];
+    int start, stop, saving;
+    long long cycles;
+
+    if (!repl_quiet)
+        printf("LC-3-SIM> ");
+
+    if (fscanf(commands, "%19s", buffer) != 1) {
+        if (!repl_quiet)
+            printf("\nBye.\n");
+        exit(repl_exit_status);
+    }
+    if (!repl_quiet)
+        printf("\n");
+
+    switch(buffer[0]) {
+        case 'G':
+        case 'g':
+            skipCommandLine(vm, commands);
+            go(vm);
+            break;
+
+        case 'B':
+        case 'b':
+        case 'D':
+        case 'd':
+        case 'W':
+        case 'w':
+            if (fgets(args, sizeof(args), commands) == NULL)
+                args[0] = '\0';
+            debugCommand(vm, buffer, args);
+            break;
+
+        case 'C':
+        case 'c':
+            skipCommandLine(vm, commands);
+            go(vm);
+            break;
+
+        case 'M':
+        case 'm':
+            start = stop = -1;
+            fscanf(commands, "%i %i", &start, &stop);
+            if (fgets(args, sizeof(args), commands) == NULL)
+                args[0] = '\0';
+            mode[0] = filename[0] = '\0';
+            sscanf(args, "%7s %199s", mode, filename);
+            if (start < 0 || stop >= WORDS_IN_MEM || start > stop)
+                printf("Error: bad memory range\n\n");
+            else if (mode[0] == '\0')
+                mdump(vm, dumpsim_file, start, stop);
+            else if (strcmp(mode, "hex") == 0)
+                mdumpHex(vm, dumpsim_file, start, stop);
+            else if (strcmp(mode, "bin") == 0 && filename[0] != '\0') {
+                if (mdumpBinary(vm, filename, start, stop))
+                    printf("Wrote %d words to %s\n\n", stop - start + 1, filename);
+            } else
+                printf("Error: usage: mdump low high [hex | bin file]\n\n");
+            break;
+
+        case 'S':
+        case 's':
+        case 'L':
+        case 'l':
+            if (fgets(args, sizeof(args), commands) == NULL)
+                args[0] = '\0';
+            saving = buffer[0] == 'S' || buffer[0] == 's';
+            if (!singleCore(vm, saving ? "save" : "load"))
+                ;
+            else if (sscanf(args, "%199s", filename) != 1)
+                printf("Error: usage: %s file\n\n", saving ? "save" : "load");
+            else if (saving) {
+                consoleFlush(vm);
+                if (imageSave(vm, filename))
+                    printf("Saved the machine to %s\n\n", filename);
+            } else if (imageLoad(vm, filename)) {
+                printf("Loaded the machine from %s\n", filename);
+                printWhere(vm);
+            }
+            break;
+
+        case 'P':
+        case 'p':
+            if (fgets(args, sizeof(args), commands) == NULL)
+                args[0] = '\0';
+            if (strncasecmp(buffer, "prot", 4) == 0)
+                protectReport(vm, FALSE);
+            else if (singleCore(vm, "profile"))
+                profileCommand(vm, args);
+            break;
+
+        case 'H':
+        case 'h':
+            if (fgets(args, sizeof(args), commands) == NULL)
+                args[0] = '\0';
+            if (singleCore(vm, "history"))
+                historyCommand(vm, args);
+            break;
+
+        case '?':
+            help();
+            break;
+        case 'Q':
+        case 'q':
+            if (!repl_quiet)
+                printf("Bye.\n");
+            exit(repl_exit_status);
+
+        case 'R':
+        case 'r':
+            if (buffer[1] == 'd' || buffer[1] == 'D')
+                rdump(vm, dumpsim_file);
+            else if (strchr("sScCwW", buffer[1]) != NULL && buffer[1] != '\0') {
+                if (fgets(args, sizeof(args), commands) == NULL)
+                    args[0] = '\0';
+                if (singleCore(vm, buffer))
+                    reverseCommand(vm, buffer, args);
+            } else {
+                cycles = 0;
+                fscanf(commands, "%lld", &cycles);
+                skipCommandLine(vm, commands);
+                run(vm, cycles);
+            }
+            break;
+
+        default:
+            printf("Invalid Command\n");
+            break;
+    }
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : initMemory                                     */
+/*                                                             */
+/* Purpose   : Zero out the memory array                       */
+/*                                                             */
+/***************************************************************/
+void initMemory(LC3_VM *vm) {
+    int i;
+
+    for (i=0; i < WORDS_IN_MEM; i++) {
+        vm->MEMORY[i] = 0;
+    }
+
+    for (i = 0; i < PAGES; i++) {
+        if (i < (0x3000 >> PAGE_SHIFT) || i >= (0xFD00 >> PAGE_SHIFT))
+            vm->PAGE_HANDLER[i] = protectedAccess;
+        else
+            vm->PAGE_HANDLER[i] = NULL;
+    }
+    vm->PAGE_HANDLER[0xFE00 >> PAGE_SHIFT] = deviceAccess;
+    vm->PAGE_HANDLER[0xFF00 >> PAGE_SHIFT] = deviceAccess;
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : loadText                                       */
+/*                                                            */
+/* Purpose   : Load a text isaprogram (one hex word per line, */
+/*             origin first) into mem.                        */
+/*                                                            */
 /**************************************************************/
-/*                                                            */
-/* Procedure : loadProgram                                   */
-/*                                                            */
-/* Purpose   : Load program and service routines into mem.    */
-/*                                                            */
-/**************************************************************/
-void loadProgram(char *program_filename) {
+int loadText(LC3_VM *vm, char *program_filename) {
     FILE * prog;
     int ii, word, program_base;
 
     /* Open program file. */
     prog = fopen(program_filename, "r");
     if (prog == NULL) {
-        printf("Error: Can't open program file %s\n", program_filename);
+        fprintf(vm->output, "Error: Can't open program file %s\n", program_filename);
+        return -1;
+    }
+
+    /* Read in the program. */
+    if (fscanf(prog, "%x\n", &word) != EOF)
+        program_base = word ;
+    else {
+        fprintf(vm->output, "Error: Program file is empty\n");
+        fclose(prog);
+        return -1;
+    }
+
+    ii = 0;
+    while (fscanf(prog, "%x\n", &word) != EOF) {
+        /* Make sure it fits. */
+        if (program_base + ii >= WORDS_IN_MEM) {
+            fprintf(vm->output, "Error: Program file %s is too long to fit in memory. %x\n",
+                    program_filename, ii);
+            fclose(prog);
+            return -1;
+        }
+
+        /* Write the word to memory array. */
+        vm->MEMORY[program_base + ii] = word;
+        vm->PROGRAM_MAP[program_base + ii] = 1;
+        invalidateDecoded(vm, program_base + ii);
+        ii++;
+    }
+    fclose(prog);
+
+    if (vm->CURRENT_LATCHES.PC == 0) vm->CURRENT_LATCHES.PC = program_base;
+
+    return ii;
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : loadObject                                     */
+/*                                                            */
+/* Purpose   : Load a big-endian lc3as .obj image (origin     */
+/*             word first) into mem.                          */
+/*                                                            */
+/**************************************************************/
+/*
+  The file is mapped rather than read, copied into MEMORY in one go
+  and byte-swapped in place; the swap loop is simple enough for the
+  compiler to vectorize.
+*/
+int loadObject(LC3_VM *vm, char *program_filename) {
+    const uint8_t *image;
+    struct stat info;
+    int fd, ii, words, program_base;
+
+    fd = open(program_filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(vm->output, "Error: Can't open program file %s\n", program_filename);
+        return -1;
+    }
+    if (fstat(fd, &info) < 0 || info.st_size < 2) {
+        fprintf(vm->output, "Error: Program file is empty\n");
+        close(fd);
+        return -1;
+    }
+    if (info.st_size % 2 != 0) {
+        fprintf(vm->output, "Error: Program file %s is not a whole number of words\n",
+                program_filename);
+        close(fd);
+        return -1;
+    }
+    image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        fprintf(vm->output, "Error: Can't map program file %s\n", program_filename);
+        return -1;
+    }
+
+    program_base = (image[0] << 8) | image[1];
+    words = info.st_size / 2 - 1;
+    if (program_base + words > WORDS_IN_MEM) {
+        fprintf(vm->output, "Error: Program file %s is too long to fit in memory. %x\n",
+                program_filename, WORDS_IN_MEM - program_base);
+        munmap((void *) image, info.st_size);
+        return -1;
+    }
+
+    memcpy(vm->MEMORY + program_base, image + 2, 2 * words);
+    for (ii = program_base; ii < program_base + words; ii++)
+        vm->MEMORY[ii] = (uint16_t) ((vm->MEMORY[ii] << 8) | (vm->MEMORY[ii] >> 8));
+    memset(vm->PROGRAM_MAP + program_base, 1, words);
+    for (ii = program_base; ii < program_base + words; ii++)
+        invalidateDecoded(vm, ii);
+    munmap((void *) image, info.st_size);
+
+    if (vm->CURRENT_LATCHES.PC == 0) vm->CURRENT_LATCHES.PC = program_base;
+
+    return words;
+}
+
+static int compareSymbols(const void *a, const void *b) {
+    return ((const Symbol *) a)->address - ((const Symbol *) b)->address;
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : loadSymbols                                    */
+/*                                                            */
+/* Purpose   : Add the labels of an lc3as .sym file to the    */
+/*             symbol table.  Returns how many were read.     */
+/*                                                            */
+/**************************************************************/
+int loadSymbols(LC3_VM *vm, char *sym_filename) {
+    FILE *sym;
+    char line[256], name[128];
+    int address, count = 0;
+
+    if ((sym = fopen(sym_filename, "r")) == NULL)
+        return 0;
+
+    /* Entries look like "//\tLabel             3005" */
+    while (fgets(line, sizeof(line), sym) != NULL) {
+        if (sscanf(line, "//%127s x%x", name, &address) != 2 &&
+            sscanf(line, "//%127s %x", name, &address) != 2)
+            continue;
+        if (address < 0 || address >= WORDS_IN_MEM)
+            continue;
+        if (vm->NUM_SYMBOLS == vm->SYMBOL_ROOM) {
+            int room = vm->SYMBOL_ROOM ? 2 * vm->SYMBOL_ROOM : 64;
+            Symbol *grown = realloc(vm->SYMBOLS, room * sizeof(Symbol));
+
+            if (grown == NULL) {
+                printf("Error: Out of memory\n");
+                exit(-1);
+            }
+            vm->SYMBOLS = grown;
+            vm->SYMBOL_ROOM = room;
+        }
+        if ((vm->SYMBOLS[vm->NUM_SYMBOLS].name = strdup(name)) == NULL) {
+            printf("Error: Out of memory\n");
+            exit(-1);
+        }
+        vm->SYMBOLS[vm->NUM_SYMBOLS].address = address;
+        vm->NUM_SYMBOLS++;
+        count++;
+    }
+    fclose(sym);
+
+    qsort(vm->SYMBOLS, vm->NUM_SYMBOLS, sizeof(Symbol), compareSymbols);
+    return count;
+}
+
+/* Address of a label, or -1; exact case first, then any case */
+int findSymbol(LC3_VM *vm, const char *name) {
+    int i;
+
+    for (i = 0; i < vm->NUM_SYMBOLS; i++)
+        if (strcmp(vm->SYMBOLS[i].name, name) == 0)
+            return vm->SYMBOLS[i].address;
+    for (i = 0; i < vm->NUM_SYMBOLS; i++)
+        if (strcasecmp(vm->SYMBOLS[i].name, name) == 0)
+            return vm->SYMBOLS[i].address;
+    return -1;
+}
+
+/* The closest label at or below address (NULL if none); *offset gets the distance */
+const char *symbolFor(LC3_VM *vm, int address, int *offset) {
+    int low = 0, high = vm->NUM_SYMBOLS - 1, best = -1;
+
+    while (low <= high) {
+        int mid = (low + high) / 2;
+
+        if (vm->SYMBOLS[mid].address <= address) {
+            best = mid;
+            low = mid + 1;
+        } else
+            high = mid - 1;
+    }
+    if (best < 0)
+        return NULL;
+    if (offset != NULL)
+        *offset = address - vm->SYMBOLS[best].address;
+    return vm->SYMBOLS[best].name;
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : loadProgram                                   */
+/*                                                            */
+/* Purpose   : Load program and service routines into mem.    */
+/*             .obj files are binary lc3as images, anything   */
+/*             else is a text isaprogram; a .sym file with    */
+/*             the same base name is read if there is one.    */
+/*             Returns the number of words read, or -1 after  */
+/*             reporting an error on the VM's output.         */
+/*                                                            */
+/**************************************************************/
+int loadProgram(LC3_VM *vm, char *program_filename) {
+    char *dot = strrchr(program_filename, '.');
+    char *sym_filename;
+    int words, base;
+
+    if (dot != NULL && strchr(dot, '/') == NULL && strcasecmp(dot, ".obj") == 0)
+        words = loadObject(vm, program_filename);
+    else
+        words = loadText(vm, program_filename);
+    if (words < 0)
+        return words;
+
+    base = dot != NULL && strchr(dot, '/') == NULL ? (size_t) (dot - program_filename) : strlen(program_filename);
+    if ((sym_filename = malloc(base + 5)) == NULL) {
+        printf("Error: Out of memory\n");
         exit(-1);
     }
+    memcpy(sym_filename, program_filename, base);
+    strcpy(sym_filename + base, ".sym");
+    loadSymbols(vm, sym_filename);
+    free(sym_filename);
+
+    return words;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : loadOS                                          */
+/*                                                             */
+/* Purpose   : Load an OS image ahead of the programs, so they */
+/*             can still fill in its vector tables and the     */
+/*             first of them still sets the PC.  Returns the   */
+/*             number of words, or -1 after an error.          */
+/*                                                             */
+/***************************************************************/
+int loadOS(LC3_VM *vm, char *os_filename) {
+    int pc = vm->CURRENT_LATCHES.PC;
+    int words = loadProgram(vm, os_filename);
+
+    vm->CURRENT_LATCHES.PC = pc;
+    return words;
+}
+
+/************************************************************/
+/*                                                          */
+/* Procedure : initialize                                   */
+/*                                                          */
+/* Purpose   : Load the OS image, if any, and the machine   */
+/*             language program, and set up initial state   */
+/*             of the machine.                              */
+/*                                                          */
+/************************************************************/
+void initialize(LC3_VM *vm, char *os_filename, char *program_filenames[], int num_prog_files) {
+    int i, words, symbols;
+
+    initMemory(vm);
+    if (os_filename != NULL) {
+        if ((words = loadOS(vm, os_filename)) < 0)
+            exit(-1);
+        if (!repl_quiet)
+            printf("Read %d words from OS image %s.\n\n", words, os_filename);
+    }
+    for ( i = 0; i < num_prog_files; i++ ) {
+        symbols = vm->NUM_SYMBOLS;
+        if ((words = loadProgram(vm, program_filenames[i])) < 0)
+            exit(-1);
+        if (repl_quiet)
+            continue;
+        printf("Read %d words from program into memory.\n\n", words);
+        if (vm->NUM_SYMBOLS > symbols)
+            printf("Read %d symbols from symbol file.\n\n", vm->NUM_SYMBOLS - symbols);
+    }
+    vm->CURRENT_LATCHES.CC = 0;    /* Z = 1 */
+
+    vm->RUN_BIT = TRUE;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : vmCreate                                        */
+/*                                                             */
+/* Purpose   : Allocate a VM with zeroed memory, the default   */
+/*             page table and an empty decode cache.           */
+/*                                                             */
+/***************************************************************/
+LC3_VM *vmCreate() {
+    LC3_VM *vm;
+    int i;
+
+    /* The engine's handler addresses must be known before any VM */
+    if (DECODE_ENTRY == NULL)
+        interpretInstructions(NULL, 0, FALSE);
+
+    vm = calloc(1, sizeof(LC3_VM));
+    if (vm == NULL || (vm->MEMORY = calloc(WORDS_IN_MEM, sizeof(uint16_t))) == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
+    }
+    for (i = 0; i < DECODED_WORDS; i++)
+        vm->DECODED[i].handler = DECODE_ENTRY;
+    initMemory(vm);
+    vm->top_p = 0x2FFF;     /* System stack: 0x2F00 - 0x2FFF */
+    vm->output = stdout;
+    vm->CURRENT_LATCHES.PSR = PSR_USER;
+    vm->MCR = 0x8000;
+    vm->SAVED_SSP = 0x2F00; /* supervisor stack grows down below the pseudo stack */
+    vm->IDLE_HEAD = -1;
+    vm->console.last = -1;
+    pthread_mutex_init(&vm->console.lock, NULL);
+    vm->CONSOLE = &vm->console;
+    vm->PROTECT = protectCreate();
+    return vm;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : vmDestroy                                       */
+/*                                                             */
+/* Purpose   : Free a VM and its JIT state.  The caller owns   */
+/*             the output and input streams.                   */
+/*                                                             */
+/***************************************************************/
+void vmDestroy(LC3_VM *vm) {
+    int i;
+
+    consoleStopTimer(vm);
+    consoleFlush(vm);
+    jitRelease(vm);
+    traceClose(vm);
+    profileFree(vm);
+    historyStop(vm);
+    free(vm->DEBUG);
+    free(vm->DIRTY);
+    protectFree(vm->PROTECT);
+    for (i = 0; i < vm->NUM_SYMBOLS; i++)
+        free(vm->SYMBOLS[i].name);
+    free(vm->SYMBOLS);
+    pthread_mutex_destroy(&vm->console.lock);
+    free(vm->MEMORY);
+    free(vm);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Cores: --cores n VMs on one MEMORY.                         */
+/*                                                             */
+/***************************************************************/
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : coresCreate                                     */
+/*                                                             */
+/* Purpose   : Make the loaded VM core 0 of num_cores cores    */
+/*             sharing its MEMORY.  The others start where it  */
+/*             stands, with its traps, protection, limits,     */
+/*             streams and engine.  quantum > 0 runs them in   */
+/*             round-robin turns of that many instructions.    */
+/*                                                             */
+/***************************************************************/
+Cores *coresCreate(LC3_VM *vm, int num_cores, int quantum) {
+    Cores *cores = calloc(1, sizeof(Cores));
+    int k;
+
+    if (cores == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
+    }
+    cores->NUM_CORES = num_cores;
+    cores->QUANTUM = quantum;
+    pthread_mutex_init(&cores->INPUT_LOCK, NULL);
+    cores->CORE[0] = vm;
+    vm->CORES = cores;
+    vm->console.shared = TRUE;
+    for (k = 1; k < num_cores; k++) {
+        LC3_VM *core = vmCreate();
+
+        free(core->MEMORY);
+        core->MEMORY = vm->MEMORY;
+        core->CORES = cores;
+        core->CORE_ID = k;
+        core->CURRENT_LATCHES = vm->CURRENT_LATCHES;
+        core->RUN_BIT = vm->RUN_BIT;
+        core->SAVED_SSP = vm->SAVED_SSP - k * CORE_SSP_SPACING;
+        core->LIMITS = vm->LIMITS;
+        memcpy(core->TRAP_GUEST, vm->TRAP_GUEST, sizeof(vm->TRAP_GUEST));
+        protectApply(core, vm->PROTECT);
+        core->input = vm->input;
+        core->output = vm->output;
+        core->CONSOLE = &vm->console;
+        if (vm->JIT_ENABLED)
+            jitInit(core);
+        cores->CORE[k] = core;
+    }
+    return cores;
+}
+
+/* vm is about to decode or translate the word at address */
+void coresFetch(LC3_VM *vm, int address) {
+    vm->CORES->CODE[address] = TRUE;
+}
+
+/* A store by vm into a word some core ran: the other cores decode or translate it again */
+int coresStore(LC3_VM *vm, int address) {
+    Cores *cores = vm->CORES;
+    int k;
+
+    for (k = 0; k < cores->NUM_CORES; k++) {
+        LC3_VM *core = cores->CORE[k];
+
+        if (core == vm)
+            continue;
+        if (core->DECODED[address].op != OP_DECODE)
+            invalidateDecoded(core, address);
+        markCodeWrite(core, address);
+    }
+    return 0;
+}
+
+/* Some core has not halted (without --cores, vm has not) */
+int coresRunning(LC3_VM *vm) {
+    int k;
+
+    if (vm->CORES == NULL)
+        return vm->CURRENT_LATCHES.PC != 0x0000;
+    for (k = 0; k < vm->CORES->NUM_CORES; k++)
+        if (vm->CORES->CORE[k]->CURRENT_LATCHES.PC != 0x0000)
+            return TRUE;
+    return FALSE;
+}
+
+/* Instructions run by every core together */
+long long coresInstructions(LC3_VM *vm) {
+    long long total = 0;
+    int k;
+
+    if (vm->CORES == NULL)
+        return vm->INSTRUCTION_COUNT;
+    for (k = 0; k < vm->CORES->NUM_CORES; k++)
+        total += vm->CORES->CORE[k]->INSTRUCTION_COUNT;
+    return total;
+}
+
+/* The most instructions any one core has run, which --max-instructions caps */
+long long coresMostInstructions(LC3_VM *vm) {
+    long long most = 0;
+    int k;
+
+    if (vm->CORES == NULL)
+        return vm->INSTRUCTION_COUNT;
+    for (k = 0; k < vm->CORES->NUM_CORES; k++)
+        if (vm->CORES->CORE[k]->INSTRUCTION_COUNT > most)
+            most = vm->CORES->CORE[k]->INSTRUCTION_COUNT;
+    return most;
+}
+
+/* Run one core for up to num_instructions, in CORES_CHUNK pieces so it notices a stop */
+static int coreRun(Cores *cores, LC3_VM *vm, int num_instructions) {
+    int done = 0;
+
+    while (done < num_instructions && vm->CURRENT_LATCHES.PC != 0x0000 && !cores->STOP && !stop_signal) {
+        int chunk = num_instructions - done < CORES_CHUNK ? num_instructions - done : CORES_CHUNK;
+
+        done += executeInstructions(vm, chunk);
+        if (vm->DEBUG != NULL && vm->DEBUG->STOPPED) {
+            cores->STOP = TRUE;
+            break;
+        }
+    }
+    return done;
+}
+
+typedef struct Core_Run_Struct {
+    Cores *cores;
+    LC3_VM *vm;
+    int num_instructions, done;
+    int threaded;                       /* running on thread, to be joined */
+    pthread_t thread;
+} Core_Run;
+
+static void *coreThread(void *arg) {
+    Core_Run *run = arg;
+
+    run->done = coreRun(run->cores, run->vm, run->num_instructions);
+    return NULL;
+}
+
+/* --round-robin: every core in turn on this thread, QUANTUM instructions at a time */
+static int coresRoundRobin(Cores *cores, int num_instructions) {
+    int ran[CORES_MAX] = { 0 };
+    int k, turn, most = 0, active = TRUE;
+
+    while (active && !cores->STOP && !stop_signal) {
+        active = FALSE;
+        for (k = 0; k < cores->NUM_CORES && !cores->STOP; k++) {
+            LC3_VM *core = cores->CORE[k];
+
+            turn = num_instructions - ran[k] < cores->QUANTUM ? num_instructions - ran[k] : cores->QUANTUM;
+            if (turn == 0 || core->CURRENT_LATCHES.PC == 0x0000)
+                continue;
+            ran[k] += coreRun(cores, core, turn);
+            active = TRUE;
+        }
+    }
+    for (k = 0; k < cores->NUM_CORES; k++)
+        if (ran[k] > most)
+            most = ran[k];
+    return most;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : coresExecute                                    */
+/*                                                             */
+/* Purpose   : Give every core that has not halted up to       */
+/*             num_instructions more, core 0 on this thread    */
+/*             and the others on threads of their own (or all  */
+/*             here in round-robin turns).  A breakpoint or    */
+/*             watchpoint on core 0 stops them all.  Returns   */
+/*             the most instructions any core ran.             */
+/*                                                             */
+/***************************************************************/
+int coresExecute(Cores *cores, int num_instructions) {
+    Core_Run runs[CORES_MAX];
+    int k, most = 0;
+
+    cores->STOP = FALSE;
+    if (cores->QUANTUM > 0)
+        return coresRoundRobin(cores, num_instructions);
+
+    for (k = 0; k < cores->NUM_CORES; k++) {
+        runs[k].cores = cores;
+        runs[k].vm = cores->CORE[k];
+        runs[k].num_instructions = num_instructions;
+        runs[k].done = 0;
+        runs[k].threaded = k > 0 && cores->CORE[k]->CURRENT_LATCHES.PC != 0x0000
+                           && pthread_create(&runs[k].thread, NULL, coreThread, &runs[k]) == 0;
+    }
+    /* A core whose thread could not start runs here after core 0 */
+    for (k = 0; k < cores->NUM_CORES; k++) {
+        if (runs[k].threaded)
+            pthread_join(runs[k].thread, NULL);
+        else
+            coreThread(&runs[k]);
+        if (runs[k].done > most)
+            most = runs[k].done;
+    }
+    return most;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Batch runner: one VM per job on a work-stealing pool.       */
+/*                                                             */
+/***************************************************************/
+/*
+  Each manifest line is "program [input [output]]"; blank lines and
+  lines starting with # are skipped.  GETC/IN read from the input
+  file ("-" or none means no input: the first read stops the job).
+  Console output goes to the output file, by default the input (or,
+  without one, the program) file name with ".out" appended.
+
+  Jobs are dealt round-robin onto one deque per worker thread.  A
+  worker pops from the back of its own deque and, once that is
+  empty, steals from the front of the others'.  Jobs never create
+  jobs, so a worker that finds every deque empty is done.
+*/
+typedef struct Batch_Job_Struct {
+    char *program, *input, *output;
+    const char *status;     /* halted, no-input, limit, timeout or error */
+    long long instructions;
+    long output_bytes;
+    double seconds;
+} Batch_Job;
+
+typedef struct Batch_Queue_Struct {
+    pthread_mutex_t lock;
+    int *jobs;              /* indices into the job table */
+    int head, tail;
+} Batch_Queue;
+
+typedef struct Batch_Struct {
+    Batch_Job *jobs;
+    Batch_Queue *queues;
+    int num_jobs, num_workers, use_jit;
+    const Protect *protect;             /* --protect settings, NULL for the defaults */
+    Run_Limits limits;                  /* --max-instructions and --timeout, per job */
+    char *os_filename;                  /* --os image loaded under each job, or NULL */
+    uint8_t trap_guest[TRAP_VECTORS];   /* --traps */
+} Batch;
+
+typedef struct Batch_Worker_Struct {
+    Batch *batch;
+    int id;
+} Batch_Worker;
+
+static double elapsedSeconds(struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* One worker per online core, but never more workers than jobs */
+static int batchWorkers(int num_jobs) {
+    int workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (workers < 1)
+        workers = 1;
+    return workers < num_jobs ? workers : num_jobs;
+}
+
+/*
+  Read a job list.  Lines are "program [input [output]]", or just
+  "input [output]" when every job runs the given program.  Returns
+  the number of jobs, or -1 after reporting an error.
+*/
+static int batchReadManifest(char *manifest_filename, char *program, Batch_Job **jobs) {
+    FILE *manifest;
+    char line[1024];
+    int num_jobs = 0, capacity = 0;
+
+    if ((manifest = fopen(manifest_filename, "r")) == NULL) {
+        printf("Error: Can't open batch manifest %s\n", manifest_filename);
+        return -1;
+    }
+
+    *jobs = NULL;
+    while (fgets(line, sizeof(line), manifest) != NULL) {
+        char *first = strtok(line, " \t\r\n");
+        char *input, *output;
+        Batch_Job *job;
+
+        if (first == NULL || first[0] == '#')
+            continue;
+        if (program == NULL) {
+            input = strtok(NULL, " \t\r\n");
+        } else {
+            input = first;
+            first = program;
+        }
+        output = strtok(NULL, " \t\r\n");
+
+        if (num_jobs == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            *jobs = realloc(*jobs, capacity * sizeof(Batch_Job));
+        }
+        job = &(*jobs)[num_jobs++];
+        memset(job, 0, sizeof(*job));
+        job->status = "error";
+        job->program = strdup(first);
+        if (input != NULL && strcmp(input, "-") != 0)
+            job->input = strdup(input);
+        if (output != NULL)
+            job->output = strdup(output);
+        else {
+            const char *base = job->input != NULL ? job->input : job->program;
+            job->output = malloc(strlen(base) + 5);
+            sprintf(job->output, "%s.out", base);
+        }
+    }
+    fclose(manifest);
+
+    if (num_jobs == 0) {
+        printf("Error: Batch manifest %s lists no jobs\n", manifest_filename);
+        return -1;
+    }
+    return num_jobs;
+}
+
+/*
+  Point the VM's console at the job's files (no input file reads as
+  empty, never the terminal).  FALSE if they can't be opened.
+*/
+static int batchOpenStreams(LC3_VM *vm, Batch_Job *job) {
+    char *input = job->input != NULL ? job->input : "/dev/null";
+
+    vm->input = NULL;
+    if ((vm->output = fopen(job->output, "w")) == NULL)
+        return FALSE;
+    if ((vm->input = fopen(input, "r")) == NULL) {
+        fprintf(vm->output, "Error: Can't open input file %s\n", input);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void batchRunToHalt(LC3_VM *vm, Batch_Job *job) {
+    vm->RUN_BIT = TRUE;
+    runLimited(vm, -1);
+    if (vm->STOPPED_BY == STOP_INSTRUCTIONS)
+        job->status = "limit";
+    else if (vm->STOPPED_BY == STOP_TIMEOUT)
+        job->status = "timeout";
+    else
+        job->status = vm->INPUT_EOF ? "no-input" : "halted";
+}
+
+static void batchCloseStreams(LC3_VM *vm, Batch_Job *job) {
+    job->instructions = vm->INSTRUCTION_COUNT;
+    consoleFlush(vm);
+    if (vm->output != NULL) {
+        job->output_bytes = ftell(vm->output);
+        fclose(vm->output);
+    }
+    if (vm->input != NULL)
+        fclose(vm->input);
+}
+
+static void batchRunJob(Batch_Job *job, const Batch *batch) {
+    struct timespec start;
+    LC3_VM *vm;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    vm = vmCreate();
+    vm->LIMITS = batch->limits;
+    memcpy(vm->TRAP_GUEST, batch->trap_guest, sizeof(vm->TRAP_GUEST));
+    if (batchOpenStreams(vm, job) && (batch->os_filename == NULL || loadOS(vm, batch->os_filename) >= 0)
+        && loadProgram(vm, job->program) >= 0) {
+        if (batch->protect != NULL)
+            protectApply(vm, batch->protect);
+        if (batch->use_jit)
+            jitInit(vm);
+        batchRunToHalt(vm, job);
+    }
+    batchCloseStreams(vm, job);
+    vmDestroy(vm);
+    job->seconds = elapsedSeconds(&start);
+}
+
+/* Next job for worker id, or -1 when every deque is empty */
+static int batchTake(Batch *batch, int id) {
+    int k, job = -1;
+
+    for (k = 0; k < batch->num_workers && job < 0; k++) {
+        Batch_Queue *q = &batch->queues[(id + k) % batch->num_workers];
+
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail)
+            job = k == 0 ? q->jobs[--q->tail] : q->jobs[q->head++];
+        pthread_mutex_unlock(&q->lock);
+    }
+    return job;
+}
+
+static void *batchWorker(void *arg) {
+    Batch_Worker *worker = arg;
+    int job;
+
+    while ((job = batchTake(worker->batch, worker->id)) >= 0)
+        batchRunJob(&worker->batch->jobs[job], worker->batch);
+    return NULL;
+}
+
+/* Print the per-job table and totals; returns the exit status */
+static int batchSummary(Batch_Job *jobs, int num_jobs, int num_workers, const char *unit,
+                        double seconds) {
+    long long total = 0;
+    int halted = 0, no_input = 0, limited = 0, timed_out = 0, failed = 0, i;
+
+    printf("%-5s %-9s %12s %10s %9s  %s\n", "job", "status", "instructions",
+           "output", "seconds", "program [< input]");
+    for (i = 0; i < num_jobs; i++) {
+        Batch_Job *job = &jobs[i];
+
+        printf("%-5d %-9s %12lld %10ld %9.4f  %s%s%s\n", i + 1, job->status, job->instructions,
+               job->output_bytes, job->seconds, job->program,
+               job->input != NULL ? " < " : "", job->input != NULL ? job->input : "");
+        total += job->instructions;
+        if (strcmp(job->status, "halted") == 0)
+            halted++;
+        else if (strcmp(job->status, "no-input") == 0)
+            no_input++;
+        else if (strcmp(job->status, "limit") == 0)
+            limited++;
+        else if (strcmp(job->status, "timeout") == 0)
+            timed_out++;
+        else
+            failed++;
+    }
+    printf("\n%d jobs on %d %s in %.3f s: %d halted, %d out of input, %d at the instruction limit, "
+           "%d timed out, %d failed, %lld instructions\n", num_jobs, num_workers, unit, seconds,
+           halted, no_input, limited, timed_out, failed, total);
+
+    /* A job that failed outright outranks one stopped by a limit */
+    if (failed)
+        return 1;
+    return timed_out ? EXIT_TIMEOUT : limited ? EXIT_INSTRUCTION_LIMIT : 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : runBatch                                        */
+/*                                                             */
+/* Purpose   : Run every job in the manifest on a thread pool  */
+/*             sized to the core count and print a summary.    */
+/*             Returns the process exit status.                */
+/*                                                             */
+/***************************************************************/
+int runBatch(char *manifest_filename, int use_jit, const Protect *protect, const Run_Limits *limits,
+             char *os_filename, const uint8_t *trap_guest) {
+    Batch batch;
+    Batch_Worker *workers;
+    pthread_t *threads;
+    struct timespec start;
+    int i;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.use_jit = use_jit;
+    batch.protect = protect;
+    batch.limits = *limits;
+    batch.os_filename = os_filename;
+    memcpy(batch.trap_guest, trap_guest, sizeof(batch.trap_guest));
+    if ((batch.num_jobs = batchReadManifest(manifest_filename, NULL, &batch.jobs)) < 0)
+        return -1;
+    batch.num_workers = batchWorkers(batch.num_jobs);
+
+    batch.queues = calloc(batch.num_workers, sizeof(Batch_Queue));
+    for (i = 0; i < batch.num_workers; i++) {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].jobs = malloc(batch.num_jobs * sizeof(int));
+    }
+    for (i = 0; i < batch.num_jobs; i++) {
+        Batch_Queue *q = &batch.queues[i % batch.num_workers];
+        q->jobs[q->tail++] = i;
+    }
+
+    /* Publish DECODE_ENTRY before the workers create their VMs */
+    interpretInstructions(NULL, 0, FALSE);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    workers = calloc(batch.num_workers, sizeof(Batch_Worker));
+    threads = calloc(batch.num_workers, sizeof(pthread_t));
+    for (i = 0; i < batch.num_workers; i++) {
+        workers[i].batch = &batch;
+        workers[i].id = i;
+        pthread_create(&threads[i], NULL, batchWorker, &workers[i]);
+    }
+    for (i = 0; i < batch.num_workers; i++)
+        pthread_join(threads[i], NULL);
+
+    return batchSummary(batch.jobs, batch.num_jobs, batch.num_workers, "threads",
+                        elapsedSeconds(&start));
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : parseAddress                                    */
+/*                                                             */
+/* Purpose   : Parse x3000, 0x3000, #12288 or 12288.  Returns  */
+/*             -1 if the text is not a 16-bit address.         */
+/*                                                             */
+/***************************************************************/
+int parseAddress(char *text) {
+    char *end;
+    long value;
+
+    if (text[0] == 'x' || text[0] == 'X')
+        value = strtol(text + 1, &end, 16);
+    else if (text[0] == '#')
+        value = strtol(text + 1, &end, 10);
+    else
+        value = strtol(text, &end, 0);
+    if (end == text || *end != '\0' || value < 0 || value >= WORDS_IN_MEM)
+        return -1;
+    return (int) value;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : runToSnapshot                                   */
+/*                                                             */
+/* Purpose   : Run until the next instruction is at stop_pc    */
+/*             or, with stop_pc < 0, is a GETC or IN trap.     */
+/*             Returns FALSE if the program halts or runs into */
+/*             a limit first (see STOPPED_BY), -1 if there are */
+/*             too many GETC/IN words to stop at.              */
+/*                                                             */
+/***************************************************************/
+/*
+  The run stops at breakpoints, so it goes at the interpreter's
+  full speed and under --max-instructions and --timeout like any
+  other: one at stop_pc, or one on every word that holds a
+  GETC or IN when the run starts.  A GETC/IN the program writes
+  later is not stopped at; it finds no input and ends the run.
+*/
+static int isInputTrap(int word) {
+    return word == 0xF020 || word == 0xF023;
+}
+
+int runToSnapshot(LC3_VM *vm, int stop_pc) {
+    int pc = vm->CURRENT_LATCHES.PC, address, reached;
+
+    if (stop_pc < 0 ? isInputTrap(vm->MEMORY[pc]) : pc == stop_pc)
+        return TRUE;
+    if (stop_pc >= 0)
+        debugAdd(vm, stop_pc, stop_pc, DEBUG_BREAK);
+    else
+        for (address = 0; address < WORDS_IN_MEM; address++)
+            if (isInputTrap(vm->MEMORY[address]) && debugAdd(vm, address, address, DEBUG_BREAK) < 0) {
+                printf("Error: More than %d GETC/IN traps; pick one with --snapshot-at\n", DEBUG_POINTS);
+                debugDelete(vm, 0);
+                return -1;
+            }
+    debugResume(vm);
+    runLimited(vm, -1);
+    reached = vm->STOPPED_BY == STOP_DEBUG;
+    debugDelete(vm, 0);
+    return reached;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : runFanout                                       */
+/*                                                             */
+/* Purpose   : Run the loaded program once up to the snapshot  */
+/*             point, then finish it once per input in the     */
+/*             list, each in a forked copy of the machine.     */
+/*             Returns the process exit status.                */
+/*                                                             */
+/***************************************************************/
+/*
+  fork() shares the frozen VM (memory, decode cache and any JIT
+  code) copy-on-write, so a child only copies the pages it writes.
+  Output the prefix produced before the snapshot is replayed at the
+  top of every job's output file, and instruction counts include
+  the prefix, so each result reads as if the job ran from scratch.
+  At most one child per core runs at a time; results come back
+  through a shared mapping of the job table.
+*/
+int runFanout(LC3_VM *vm, char *program_name, char *list_filename, int stop_pc) {
+    Batch_Job *list, *jobs;
+    char *prefix = NULL;
+    size_t prefix_len = 0;
+    struct timespec start;
+    int num_jobs, workers, running = 0, reached, i;
+
+    if ((num_jobs = batchReadManifest(list_filename, program_name, &list)) < 0)
+        return -1;
+    workers = batchWorkers(num_jobs);
+
+    /* Shared so the children can report back */
+    jobs = mmap(NULL, num_jobs * sizeof(Batch_Job), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (jobs == MAP_FAILED) {
+        printf("Error: Can't map the fan-out job table\n");
+        return -1;
+    }
+    memcpy(jobs, list, num_jobs * sizeof(Batch_Job));
+    free(list);
+
+    /* The prefix gets no input: a GETC/IN before stop_pc ends it */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    vm->output = open_memstream(&prefix, &prefix_len);
+    vm->input = fopen("/dev/null", "r");
+    reached = runToSnapshot(vm, stop_pc);
+    consoleFlush(vm);
+    fclose(vm->output);
+    fclose(vm->input);
+    vm->input = NULL;
+    if (reached <= 0) {
+        int status = -1;
+
+        vm->output = stdout;
+        if (limitReport(vm))
+            status = repl_exit_status;
+        else if (!reached)
+            printf("Error: Program stopped before reaching the snapshot point\n");
+        free(prefix);
+        munmap(jobs, num_jobs * sizeof(Batch_Job));
+        return status;
+    }
+    vm->output = NULL;
+    printf("Snapshot at x%.4X after %lld instructions, %d bytes of output\n\n",
+           vm->CURRENT_LATCHES.PC, vm->INSTRUCTION_COUNT, (int) prefix_len);
+    fflush(stdout);
+
+    for (i = 0; i < num_jobs; i++) {
+        pid_t pid;
+
+        if (running == workers) {
+            wait(NULL);
+            running--;
+        }
+        if ((pid = fork()) == 0) {
+            struct timespec job_start;
+
+            clock_gettime(CLOCK_MONOTONIC, &job_start);
+            if (batchOpenStreams(vm, &jobs[i])) {
+                fwrite(prefix, 1, prefix_len, vm->output);
+                batchRunToHalt(vm, &jobs[i]);
+            }
+            batchCloseStreams(vm, &jobs[i]);
+            jobs[i].seconds = elapsedSeconds(&job_start);
+            _exit(0);
+        }
+        if (pid < 0)
+            jobs[i].status = "error";
+        else
+            running++;
+    }
+    while (running > 0) {
+        wait(NULL);
+        running--;
+    }
+
+    return batchSummary(jobs, num_jobs, workers, "processes", elapsedSeconds(&start));
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : openInput                                       */
+/*                                                             */
+/* Purpose   : Pick the GETC/IN source: --input text, an input */
+/*             file or pipe, stdin when it is not a terminal,  */
+/*             or else the keyboard.                           */
+/*                                                             */
+/***************************************************************/
+void openInput(LC3_VM *vm, char *text, char *filename) {
+    if (text != NULL) {
+        if (*text == '\0')
+            vm->input = fopen("/dev/null", "r");
+        else
+            vm->input = fmemopen(text, strlen(text), "r");
+    } else if (filename != NULL) {
+        vm->input = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    } else if (!isatty(0)) {
+        vm->input = stdin;
+    }
+    if ((text != NULL || filename != NULL) && vm->input == NULL) {
+        printf("Error: Can't open input %s\n", text != NULL ? "text" : filename);
+        exit(1);
+    }
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lockstepCompare                                 */
+/*                                                             */
+/* Purpose   : Compare the engine's machine with the reference */
+/*             one: PC, nzp, PSR, registers and every word     */
+/*             either stored to since the last check.  Returns */
+/*             how many things differ and, if verbose, lists   */
+/*             them.  The dirty lists are cleared once all     */
+/*             agree.                                          */
+/*                                                             */
+/***************************************************************/
+#define LOCKSTEP_SHOWN  16      /* memory differences listed before "... and n more" */
+
+static void lockstepWord(int verbose, const char *name, int expected, int actual) {
+    if (verbose)
+        printf("  %-6s reference x%.4X  engine x%.4X\n", name, expected, actual);
+}
+
+static int lockstepCompare(LC3_VM *vm, LC3_VM *ref, int verbose) {
+    System_Latches *a = &ref->CURRENT_LATCHES, *b = &vm->CURRENT_LATCHES;
+    int diffs = 0, words = 0, pass, i;
+    char name[8];
+
+    if (ref->INSTRUCTION_COUNT != vm->INSTRUCTION_COUNT) {
+        if (verbose)
+            printf("  count  reference %lld  engine %lld\n", ref->INSTRUCTION_COUNT, vm->INSTRUCTION_COUNT);
+        diffs++;
+    }
+    if (a->PC != b->PC) {
+        lockstepWord(verbose, "PC", a->PC, b->PC);
+        diffs++;
+    }
+    if (CCMASK(a->CC) != CCMASK(b->CC)) {
+        int x = CCMASK(a->CC), y = CCMASK(b->CC);
+
+        if (verbose)
+            printf("  nzp    reference %c%c%c    engine %c%c%c\n",
+                   x & 4 ? 'n' : '-', x & 2 ? 'z' : '-', x & 1 ? 'p' : '-',
+                   y & 4 ? 'n' : '-', y & 2 ? 'z' : '-', y & 1 ? 'p' : '-');
+        diffs++;
+    }
+    if (a->PSR != b->PSR) {
+        lockstepWord(verbose, "PSR", a->PSR, b->PSR);
+        diffs++;
+    }
+    for (i = 0; i < LC_3_REGS; i++)
+        if (a->REGS[i] != b->REGS[i]) {
+            sprintf(name, "R%d", i);
+            lockstepWord(verbose, name, a->REGS[i], b->REGS[i]);
+            diffs++;
+        }
+
+    /* The reference's stores, then the engine's that the reference did not make */
+    for (pass = 0; pass < 2; pass++) {
+        Dirty *d = pass ? vm->DIRTY : ref->DIRTY;
+
+        for (i = 0; i < d->NUM_WORDS; i++) {
+            int address = d->WORDS[i];
+
+            if (pass && ref->DIRTY->MARKED[address])
+                continue;
+            if (ref->MEMORY[address] != vm->MEMORY[address] && words++ < LOCKSTEP_SHOWN) {
+                sprintf(name, "x%.4X", address);
+                lockstepWord(verbose, name, ref->MEMORY[address], vm->MEMORY[address]);
+            }
+        }
+    }
+    if (verbose && words > LOCKSTEP_SHOWN)
+        printf("  ... and %d more memory words\n", words - LOCKSTEP_SHOWN);
+    if (diffs + words > 0)
+        return diffs + words;
+
+    for (pass = 0; pass < 2; pass++) {
+        Dirty *d = pass ? vm->DIRTY : ref->DIRTY;
+
+        for (i = 0; i < d->NUM_WORDS; i++)
+            d->MARKED[d->WORDS[i]] = FALSE;
+        d->NUM_WORDS = 0;
+    }
+    return 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : runLockstep                                     */
+/*                                                             */
+/* Purpose   : Run the loaded program on the selected engine   */
+/*             and, next to it, on processInstruction; compare */
+/*             the two machines every `every` instructions, or */
+/*             after every block when `every` is 0.  Returns   */
+/*             the process exit status: 0 if they agreed all   */
+/*             the way to the halt, 1 at the first divergence. */
+/*                                                             */
+/***************************************************************/
+/*
+  The reference machine is a copy of the engine's right after
+  loading (or --restore), with its own open of the same input and no console.
+  Both see the device service at the same instruction counts, so
+  keyboard input and HALT line up; the timer runs on host time and
+  a program that enables its interrupt may be told apart by it.
+  With --jit every chunk runs through jitStep/jitExecute, so
+  compiled blocks only run whole when a chunk can fit them: use a
+  block or a large count to check the native code.
+*/
+#define LOCKSTEP_BLOCK  DEVICE_SLICE    /* most a block check runs, for loops compiled whole */
+
+int runLockstep(LC3_VM *vm, char *input_text, char *input_filename, int every) {
+    LC3_VM *ref = vmCreate();
+    long long checks = 0;
+    int diverged = FALSE;
+    char text[40];
+
+    memcpy(ref->MEMORY, vm->MEMORY, WORDS_IN_MEM * sizeof(uint16_t));
+    memcpy(ref->PROGRAM_MAP, vm->PROGRAM_MAP, sizeof(vm->PROGRAM_MAP));
+    ref->CURRENT_LATCHES = vm->CURRENT_LATCHES;
+    ref->RUN_BIT = vm->RUN_BIT;
+    ref->INSTRUCTION_COUNT = vm->INSTRUCTION_COUNT;
+    ref->top_p = vm->top_p;
+    ref->KBSR = vm->KBSR;
+    ref->KBDR = vm->KBDR;
+    ref->DSR = vm->DSR;
+    ref->TMR = vm->TMR;
+    ref->TMI = vm->TMI;
+    ref->MCR = vm->MCR;
+    ref->SAVED_SSP = vm->SAVED_SSP;
+    ref->SAVED_USP = vm->SAVED_USP;
+    ref->DEVICES_ACTIVE = vm->DEVICES_ACTIVE;
+    memcpy(ref->TRAP_GUEST, vm->TRAP_GUEST, sizeof(vm->TRAP_GUEST));
+    protectApply(ref, vm->PROTECT);
+    ref->output = NULL;
+    openInput(ref, input_text, input_filename);
+
+    vm->DIRTY = calloc(1, sizeof(Dirty));
+    ref->DIRTY = calloc(1, sizeof(Dirty));
+    if (vm->DIRTY == NULL || ref->DIRTY == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
+    }
+
+    while (vm->CURRENT_LATCHES.PC != 0x0000 || ref->CURRENT_LATCHES.PC != 0x0000) {
+        long long from = vm->INSTRUCTION_COUNT;
+        int pc = vm->CURRENT_LATCHES.PC, word = vm->MEMORY[pc];
+        int count = 0;
+
+        if (vm->ATTENTION || vm->DEVICES_ACTIVE || ref->ATTENTION || ref->DEVICES_ACTIVE) {
+            serviceDevices(vm);
+            serviceDevices(ref);
+        }
+        if (vm->CURRENT_LATCHES.PC != 0x0000) {
+            int jit = vm->JIT_ENABLED && !vm->PROTECT->FAULTS;
+
+            if (every == 0)
+                count = jit ? jitStep(vm, LOCKSTEP_BLOCK) : interpretInstructions(vm, LOCKSTEP_BLOCK, TRUE);
+            else
+                count = jit ? jitExecute(vm, every) : interpretInstructions(vm, every, FALSE);
+        }
+        /* The engine stops right after a faulting access, and so does the reference */
+        while (count-- > 0 && ref->CURRENT_LATCHES.PC != 0x0000 && !ref->ACV_PENDING)
+            cycle(ref);
+
+        checks++;
+        consoleFlush(vm);
+        if (lockstepCompare(vm, ref, FALSE) > 0) {
+            fflush(stdout);
+            disassemble(pc, word, text);
+            printf("\nLockstep: divergence in instructions %lld-%lld, run from x%.4X: %s\n",
+                   from, vm->INSTRUCTION_COUNT - 1, pc, text);
+            lockstepCompare(vm, ref, TRUE);
+            disassemble(ref->CURRENT_LATCHES.PC, ref->MEMORY[ref->CURRENT_LATCHES.PC], text);
+            printf("  next   reference x%.4X: %s\n", ref->CURRENT_LATCHES.PC, text);
+            disassemble(vm->CURRENT_LATCHES.PC, vm->MEMORY[vm->CURRENT_LATCHES.PC], text);
+            printf("  next   engine    x%.4X: %s\n", vm->CURRENT_LATCHES.PC, text);
+            diverged = TRUE;
+            break;
+        }
+    }
+
+    if (!diverged)
+        printf("\nLockstep: %lld instructions, %lld checks, no divergence\n", vm->INSTRUCTION_COUNT, checks);
+    /* Stores stop being noted once the comparison is over */
+    free(vm->DIRTY);
+    vm->DIRTY = NULL;
+    if (ref->input != NULL && ref->input != stdin)
+        fclose(ref->input);
+    vmDestroy(ref);
+    return diverged;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : main                                            */
+/*                                                             */
+/***************************************************************/
+#ifndef LC3SIM_NO_MAIN
+/* --profile, --profile-folded and --trace: written out however the REPL exits */
+static LC3_VM *repl_vm;
+static FILE *profile_csv, *profile_folded;
+
+/* --run and --commands: print the result as JSON on the way out */
+static int repl_result = FALSE;
+
+/* Why the machine is where it is, in the batch summary's words where they apply */
+static const char *stopReason(LC3_VM *vm) {
+    if (vm->STOPPED_BY == STOP_INSTRUCTIONS)
+        return "limit";
+    if (vm->STOPPED_BY == STOP_TIMEOUT)
+        return "timeout";
+    if (vm->STOPPED_BY == STOP_SIGNAL)
+        return "signal";
+    if (vm->STOPPED_BY == STOP_DEBUG)
+        return "breakpoint";    /* or watchpoint */
+    if (vm->RUN_BIT == FALSE || !coresRunning(vm))
+        return vm->INPUT_EOF ? "no-input" : "halted";
+    return "stopped";       /* the commands ran out with the machine still going */
+}
+
+/*
+  One line of JSON after everything else on stdout, so a script can
+  take the last line.  instructions is the machine's count, which
+  includes any from a --restore image; the rate only covers what
+  this run executed.  With --cores the top-level fields are core
+  0's, instructions counts every core's, and "cores" lists each.
+*/
+static void replResult(LC3_VM *vm) {
+    int k, core;
+
+    consoleFlush(vm);
+    if (vm->CONSOLE->last >= 0 && vm->CONSOLE->last != '\n')
+        printf("\n");
+    printf("{\"reason\": \"%s\", \"exit_status\": %d, \"pc\": %d, \"psr\": %d, \"cc\": \"%s\", \"registers\": [",
+           stopReason(vm), vm->STOPPED_BY == STOP_SIGNAL ? 128 + (int) stop_signal : repl_exit_status,
+           vm->CURRENT_LATCHES.PC, vm->CURRENT_LATCHES.PSR,
+           CC_N(vm->CURRENT_LATCHES) ? "n" : CC_Z(vm->CURRENT_LATCHES) ? "z" : "p");
+    for (k = 0; k < LC_3_REGS; k++)
+        printf("%s%d", k > 0 ? ", " : "", vm->CURRENT_LATCHES.REGS[k]);
+    printf("], \"instructions\": %lld, \"seconds\": %.6f, \"instructions_per_second\": %.0f, "
+           "\"output_bytes\": %lld", coresInstructions(vm), vm->RAN_SECONDS,
+           vm->RAN_SECONDS > 0 ? vm->RAN_INSTRUCTIONS / vm->RAN_SECONDS : 0.0, vm->CONSOLE->written);
+    if (vm->CORES != NULL) {
+        printf(", \"cores\": [");
+        for (core = 0; core < vm->CORES->NUM_CORES; core++) {
+            LC3_VM *c = vm->CORES->CORE[core];
+
+            printf("%s{\"pc\": %d, \"registers\": [", core > 0 ? ", " : "", c->CURRENT_LATCHES.PC);
+            for (k = 0; k < LC_3_REGS; k++)
+                printf("%s%d", k > 0 ? ", " : "", c->CURRENT_LATCHES.REGS[k]);
+            printf("], \"instructions\": %lld}", c->INSTRUCTION_COUNT);
+        }
+        printf("]");
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void replAtExit(void) {
+    if (repl_result)
+        replResult(repl_vm);
+    if (profile_csv != NULL) {
+        profileWrite(repl_vm, profile_csv);
+        fclose(profile_csv);
+    }
+    if (profile_folded != NULL) {
+        profileFolded(repl_vm, profile_folded);
+        fclose(profile_folded);
+    }
+    traceClose(repl_vm);
+}
+
+static FILE *profileOpen(char *filename) {
+    FILE *file;
+
+    if (filename == NULL)
+        return NULL;
+    if ((file = fopen(filename, "w")) == NULL) {
+        printf("Error: Can't open profile file %s\n", filename);
+        exit(-1);
+    }
+    return file;
+}
+
+int main(int argc, char *argv[]) {
+    FILE * dumpsim_file;
+    char *profile_filename = NULL;
+    char *folded_filename = NULL;
+    char *trace_filename = NULL;
+    char *translate_filename = NULL;
+    char *batch_filename = NULL;
+    char *fanout_filename = NULL;
+    char *restore_filename = NULL;
+    Protect *protect = NULL;    /* NULL: the default regions */
+    Run_Limits limits = { 0, 0 };   /* no instruction or time limit */
+    char *commands_text = NULL;     /* --run/--commands, NULL: the interactive REPL */
+    char *os_filename = NULL;
+    char *traps_text = NULL;        /* --traps, NULL: all guest with --os, else all host */
+    uint8_t trap_guest[TRAP_VECTORS];
+    FILE *commands = stdin;
+    int use_dumpsim = TRUE;
+    char *end;
+    int snapshot_pc = -1;   /* -1: first GETC/IN */
+    int flush_ms = 0;       /* 0: no timed console flush */
+    int history_mb = 0;     /* 0: no history */
+    int lockstep = -1;      /* -1: off, 0: check every block, n: every n instructions */
+    char *input_text = NULL;
+    char *input_filename = NULL;
+    int use_jit = FALSE;
+    int num_cores = 1;
+    int quantum = 0;        /* --round-robin turn, 0: a host thread per core */
+    int first_file = 1;
+    LC3_VM *vm;
+
+    /* Options come before the program files */
+    while (first_file < argc && strncmp(argv[first_file], "--", 2) == 0) {
+        if (strcmp(argv[first_file], "--jit") == 0) {
+            use_jit = TRUE;
+        } else if (strcmp(argv[first_file], "--translate") == 0 && first_file + 1 < argc) {
+            translate_filename = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--batch") == 0 && first_file + 1 < argc) {
+            batch_filename = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--fanout") == 0 && first_file + 1 < argc) {
+            fanout_filename = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--snapshot-at") == 0 && first_file + 1 < argc) {
+            if ((snapshot_pc = parseAddress(argv[++first_file])) < 0) {
+                printf("Error: bad snapshot address %s\n", argv[first_file]);
+                exit(1);
+            }
+        } else if ((strcmp(argv[first_file], "--protect") == 0 || strcmp(argv[first_file], "--protect-file") == 0)
+                   && first_file + 1 < argc) {
+            if (protect == NULL)
+                protect = protectCreate();
+            if (strcmp(argv[first_file++], "--protect") == 0 ? !protectParse(protect, argv[first_file], "--protect")
+                                                             : !protectReadFile(protect, argv[first_file]))
+                exit(1);
+        } else if (strcmp(argv[first_file], "--max-instructions") == 0 && first_file + 1 < argc) {
+            limits.MAX_INSTRUCTIONS = strtoll(argv[++first_file], &end, 0);
+            if (end == argv[first_file] || *end != '\0' || limits.MAX_INSTRUCTIONS <= 0) {
+                printf("Error: bad instruction limit %s\n", argv[first_file]);
+                exit(1);
+            }
+        } else if (strcmp(argv[first_file], "--timeout") == 0 && first_file + 1 < argc) {
+            limits.TIMEOUT = strtod(argv[++first_file], &end);
+            if (end == argv[first_file] || *end != '\0' || !(limits.TIMEOUT > 0)) {
+                printf("Error: bad timeout %s\n", argv[first_file]);
+                exit(1);
+            }
+        } else if (strcmp(argv[first_file], "--os") == 0 && first_file + 1 < argc) {
+            os_filename = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--traps") == 0 && first_file + 1 < argc) {
+            traps_text = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--cores") == 0 && first_file + 1 < argc) {
+            num_cores = atoi(argv[++first_file]);
+            if (num_cores < 1 || num_cores > CORES_MAX) {
+                printf("Error: bad core count %s, not 1 to %d\n", argv[first_file], CORES_MAX);
+                exit(1);
+            }
+        } else if (strcmp(argv[first_file], "--round-robin") == 0 && first_file + 1 < argc) {
+            if ((quantum = atoi(argv[++first_file])) <= 0) {
+                printf("Error: bad round-robin turn %s\n", argv[first_file]);
+                exit(1);
+            }
+        } else if (strcmp(argv[first_file], "--run") == 0) {
+            commands_text = "go";
+        } else if (strcmp(argv[first_file], "--commands") == 0 && first_file + 1 < argc) {
+            commands_text = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--no-dumpsim") == 0) {
+            use_dumpsim = FALSE;
+        } else if (strcmp(argv[first_file], "--restore") == 0 && first_file + 1 < argc) {
+            restore_filename = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--input") == 0 && first_file + 1 < argc) {
+            input_text = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--input-file") == 0 && first_file + 1 < argc) {
+            input_filename = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--profile") == 0 && first_file + 1 < argc) {
+            profile_filename = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--trace") == 0 && first_file + 1 < argc) {
+            trace_filename = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--trace-dump") == 0 && first_file + 1 < argc) {
+            return traceDump(argv[first_file + 1]);
+        } else if (strcmp(argv[first_file], "--profile-folded") == 0 && first_file + 1 < argc) {
+            folded_filename = argv[++first_file];
+        } else if (strcmp(argv[first_file], "--history") == 0 && first_file + 1 < argc) {
+            if ((history_mb = atoi(argv[++first_file])) <= 0) {
+                printf("Error: bad history budget %s\n", argv[first_file]);
+                exit(1);
+            }
+        } else if (strcmp(argv[first_file], "--lockstep") == 0 && first_file + 1 < argc) {
+            first_file++;
+            if (strcmp(argv[first_file], "block") == 0)
+                lockstep = 0;
+            else if ((lockstep = atoi(argv[first_file])) <= 0) {
+                printf("Error: bad lockstep granularity %s\n", argv[first_file]);
+                exit(1);
+            }
+        } else if (strcmp(argv[first_file], "--flush-ms") == 0 && first_file + 1 < argc) {
+            if ((flush_ms = atoi(argv[++first_file])) <= 0) {
+                printf("Error: bad flush interval %s\n", argv[first_file]);
+                exit(1);
+            }
+        } else {
+            printf("Error: unknown option %s\n", argv[first_file]);
+            exit(1);
+        }
+        first_file++;
+    }
+
+    /* With an OS image every TRAP goes to it unless --traps says otherwise */
+    memset(trap_guest, os_filename != NULL, sizeof(trap_guest));
+    if (traps_text != NULL && !trapParse(trap_guest, traps_text))
+        exit(1);
+
+    /* The other modes run, record or copy one core */
+    if (num_cores > 1) {
+        const char *other = batch_filename != NULL ? "--batch" :
+                            fanout_filename != NULL ? "--fanout" :
+                            lockstep >= 0 ? "--lockstep" :
+                            translate_filename != NULL ? "--translate" :
+                            trace_filename != NULL ? "--trace" :
+                            history_mb > 0 ? "--history" :
+                            profile_filename != NULL || folded_filename != NULL ? "--profile" :
+                            restore_filename != NULL ? "--restore" : NULL;
+
+        if (other != NULL) {
+            printf("Error: --cores does not work with %s\n", other);
+            exit(1);
+        }
+    }
+
+    if (batch_filename != NULL)
+        return runBatch(batch_filename, use_jit, protect, &limits, os_filename, trap_guest);
+
+    /* Error Checking: a restored image needs no program, but may bring its symbols */
+    if (argc - first_file < 1 && (restore_filename == NULL || fanout_filename != NULL)) {
+        printf("Error: usage: %s [--jit] [--cores n [--round-robin q]] [--run | --commands \"go; rdump\"] [--no-dumpsim] [--os image.obj] [--traps settings] [--max-instructions n] [--timeout seconds] [--flush-ms n] [--profile out.csv] [--profile-folded out.folded] [--trace file[.gz]] [--history mb] [--input text | --input-file file] [--protect settings] [--protect-file file] [--restore image] [--translate out.c] <program_file_1> <program_file_2> ...\n"
+               "       %s [--jit] [--os image.obj] [--traps settings] [--max-instructions n] [--timeout seconds] [--protect settings] [--protect-file file] --batch manifest\n"
+               "       %s --trace-dump file[.gz]\n"
+               "       %s [--jit] [--max-instructions n] [--timeout seconds] [--snapshot-at addr] --fanout inputs <program_file_1> ...\n"
+               "       %s [--jit] --lockstep n|block [--input text | --input-file file] <program_file_1> ...\n",
+               argv[0], argv[0], argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+
+    /* Lockstep opens the input twice, so it cannot be a stream */
+    if (lockstep >= 0 && input_text == NULL) {
+        if (input_filename != NULL && strcmp(input_filename, "-") == 0) {
+            printf("Error: --lockstep needs the input as --input text or a file\n");
+            exit(1);
+        }
+        if (input_filename == NULL)
+            input_text = "";
+    }
+
+    /* Headless: the commands come from the list, one per ; */
+    if (commands_text != NULL) {
+        char *p;
+
+        commands_text = strdup(commands_text);
+        for (p = commands_text; *p != '\0'; p++)
+            if (*p == ';')
+                *p = '\n';
+        commands = fmemopen(commands_text, strlen(commands_text), "r");
+        repl_quiet = TRUE;
+    }
+
+    vm = vmCreate();
+    vm->LIMITS = limits;
+    if (use_jit && !jitInit(vm))
+        printf("Warning: JIT not available on this host, interpreting\n");
+
+    openInput(vm, input_text, input_filename);
+
+    if (!repl_quiet)
+        printf("LC-3 Simulator\n\n");
+
+    memcpy(vm->TRAP_GUEST, trap_guest, sizeof(trap_guest));
+    initialize(vm, os_filename, argv + first_file, argc - first_file);
+    if (restore_filename != NULL) {
+        if (!imageLoad(vm, restore_filename))
+            exit(1);
+        if (!repl_quiet)
+            printf("Restored the machine from %s\n\n", restore_filename);
+    }
+    if (protect != NULL)
+        protectApply(vm, protect);
+    if (num_cores > 1)
+        coresCreate(vm, num_cores, quantum);
+
+    if (translate_filename != NULL) {
+        translateProgram(vm, translate_filename);
+        exit(0);
+    }
+
+    if (fanout_filename != NULL)
+        return runFanout(vm, argv[first_file], fanout_filename, snapshot_pc);
+
+    if (lockstep >= 0)
+        return runLockstep(vm, input_text, input_filename, lockstep);
+
+    if ( (dumpsim_file = fopen( use_dumpsim ? "dumpsim" : "/dev/null", "w" )) == NULL ) {
+        printf("Error: Can't open dumpsim file\n");
+        exit(-1);
+    }
+
+    if (profile_filename != NULL || folded_filename != NULL) {
+        profile_csv = profileOpen(profile_filename);
+        profile_folded = profileOpen(folded_filename);
+        profileStart(vm);
+    }
+    if (trace_filename != NULL && !traceOpen(vm, trace_filename)) {
+        printf("Error: Can't open trace file %s\n", trace_filename);
+        exit(-1);
+    }
+    if (history_mb > 0)
+        historyStart(vm, history_mb);
+    repl_vm = vm;
+    repl_result = commands_text != NULL;
+    atexit(replAtExit);
+
+    /* Only the REPL gets the timer: fan-out children must not inherit its lock */
+    if (flush_ms > 0 && !consoleStartTimer(vm, flush_ms))
+        printf("Warning: Can't start the console flush timer\n");
+
+    while (1)
+        getCommand(vm, commands, dumpsim_file);
+
+}
+#endif
+
+/* System stack: 0x2F00 - 0x2FFF (CALL_STACK on cores after the first) */
+
+int isEmpty(LC3_VM *vm) {
+    return vm->top_p == 0x2FFF;
+}
+
+int POP(LC3_VM *vm) {
+    vm->top_p += 1;
+    if (vm->top_p > 0x2FFF) {
+        consolePrintf(vm, "Error: system stack segmentation fault");
+        return -1;
+    } 
+    if (vm->CORE_ID > 0)
+        return vm->CALL_STACK[vm->top_p - 1 - 0x2F00];
+    return loadWord(vm->MEMORY, vm->top_p - 1);
+}
+
+int PUSH(LC3_VM *vm, int value) {
+    vm->top_p -= 1;
+    if (vm->top_p <= 0x2F00) {
+        consolePrintf(vm, "Error: system stack overflow\n");
+        return -1;
+    }
+    if (vm->CORE_ID > 0) {
+        vm->CALL_STACK[vm->top_p - 0x2F00] = value;
+        return 0;
+    }
+    if (vm->HISTORY != NULL)
+        historyStore(vm, vm->top_p);
+    storeWord(vm->MEMORY, vm->top_p, value);
+    invalidateDecoded(vm, vm->top_p);
+    markDirty(vm, vm->top_p);
+    markShared(vm, vm->top_p);
+    return 0;
+}
+
+int SetCC (LC3_VM *vm, int value);  /* Update condition code */
+int SEXT (int num, int length);  /* Sign extension */
+
+int ADD (LC3_VM *vm, int instruction);  /* 0001 */
+int AND (LC3_VM *vm, int instruction);  /* 0101 */
+int BR (LC3_VM *vm, int instruction);   /* 0000 */
+int JMP (LC3_VM *vm, int instruction);  /* 1100 */
+int JSR (LC3_VM *vm, int instruction);  /* 0100 */
+int JSRR (LC3_VM *vm, int instruction); /* 0100 */
+int LD (LC3_VM *vm, int instruction);   /* 0010 */
+int LDI (LC3_VM *vm, int instruction);  /* 1010 */
+int LDR (LC3_VM *vm, int instruction);  /* 0110 */
+int LEA (LC3_VM *vm, int instruction);  /* 1110 */
+int NOT (LC3_VM *vm, int instruction);  /* 1001 */
+// RET has same opcode with JMP
+int RTI (LC3_VM *vm, int instruction);  /* 1000 */
+int ST (LC3_VM *vm, int instruction);   /* 0011 */
+int STI (LC3_VM *vm, int instruction);  /* 1011 */
+int STR (LC3_VM *vm, int instruction);  /* 0111 */
+int TRAP (LC3_VM *vm, int instruction); /* 1111 */
+
+/***************************************************************/
+/*                                                             */
+/* Console ring.  Only consoleLock/consoleUnlock callers touch */
+/* the ring directly; the flusher thread runs consoleDrain.    */
+/*                                                             */
+/***************************************************************/
+static void consoleLock(LC3_VM *vm) {
+    if (vm->CONSOLE->timed || vm->CONSOLE->shared)
+        pthread_mutex_lock(&vm->CONSOLE->lock);
+}
+
+static void consoleUnlock(LC3_VM *vm) {
+    if (vm->CONSOLE->timed || vm->CONSOLE->shared)
+        pthread_mutex_unlock(&vm->CONSOLE->lock);
+}
+
+/* Write out everything in the ring, at most two pieces; lock held */
+static void consoleDrain(LC3_VM *vm) {
+    Console *console = vm->CONSOLE;
+    unsigned start = console->tail % CONSOLE_RING;
+    unsigned length = console->head - console->tail;
+
+    if (length == 0)
+        return;
+    console->written += length;
+    console->last = console->ring[(console->head - 1) % CONSOLE_RING];
+    if (vm->output != NULL) {
+        if (start + length > CONSOLE_RING) {
+            fwrite(console->ring + start, 1, CONSOLE_RING - start, vm->output);
+            fwrite(console->ring, 1, length - (CONSOLE_RING - start), vm->output);
+        } else {
+            fwrite(console->ring + start, 1, length, vm->output);
+        }
+        fflush(vm->output);
+    }
+    console->tail = console->head;
+}
+
+/* Append one byte, draining first if the ring is full; lock held */
+static inline void consoleByte(LC3_VM *vm, int c) {
+    Console *console = vm->CONSOLE;
+
+    if (console->head - console->tail == CONSOLE_RING)
+        consoleDrain(vm);
+    console->ring[console->head++ % CONSOLE_RING] = c;
+}
+
+/* One LC-3 character: a CR prints as CR LF, anything else as its low byte */
+static inline void consoleChar(LC3_VM *vm, int asc) {
+    if (asc == 13) {
+        consoleByte(vm, '\r');
+        consoleByte(vm, '\n');
+    } else {
+        consoleByte(vm, asc);
+    }
+}
+
+void consoleFlush(LC3_VM *vm) {
+    consoleLock(vm);
+    consoleDrain(vm);
+    consoleUnlock(vm);
+}
+
+void consolePrintf(LC3_VM *vm, const char *format, ...) {
+    char text[256];
+    va_list args;
+    int length, i;
+
+    va_start(args, format);
+    length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (length >= (int) sizeof(text))
+        length = sizeof(text) - 1;
+    consoleLock(vm);
+    for (i = 0; i < length; i++)
+        consoleByte(vm, text[i]);
+    consoleUnlock(vm);
+}
+
+/* Copy a run of string words, one or two characters per word (PUTSP) */
+static void consoleWords(LC3_VM *vm, const uint16_t *words, int count, int packed) {
+    int i;
+
+    consoleLock(vm);
+    for (i = 0; i < count; i++) {
+        if (packed) {
+            consoleChar(vm, words[i] & 0x00FF);
+            consoleChar(vm, words[i] >> 8);
+        } else {
+            consoleChar(vm, words[i]);
+        }
+    }
+    consoleUnlock(vm);
+}
+
+static void *consoleFlusher(void *arg) {
+    LC3_VM *vm = arg;
+    struct timespec interval;
+
+    interval.tv_sec = vm->console.interval_ms / 1000;
+    interval.tv_nsec = (vm->console.interval_ms % 1000) * 1000000L;
+    while (!vm->console.stop) {
+        nanosleep(&interval, NULL);
+        consoleFlush(vm);
+    }
+    return NULL;
+}
+
+/* Also flush every interval_ms milliseconds from a background thread */
+int consoleStartTimer(LC3_VM *vm, int interval_ms) {
+    vm->console.interval_ms = interval_ms;
+    vm->console.timed = TRUE;
+    if (pthread_create(&vm->console.flusher, NULL, consoleFlusher, vm) != 0) {
+        vm->console.timed = FALSE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void consoleStopTimer(LC3_VM *vm) {
+    if (!vm->console.timed)
+        return;
+    vm->console.stop = TRUE;
+    pthread_join(vm->console.flusher, NULL);
+    vm->console.timed = FALSE;
+}
+
+void printASCII (LC3_VM *vm, int asc) {
+    consoleLock(vm);
+    consoleChar(vm, asc);
+    consoleUnlock(vm);
+}
+
+/* First address at or after address that is not plain RAM */
+static int plainRAMEnd(LC3_VM *vm, int address) {
+    int page = address >> PAGE_SHIFT;
+
+    while (page < PAGES && vm->PAGE_HANDLER[page] == NULL)
+        page++;
+    return page << PAGE_SHIFT;
+}
+
+/*
+  Words before the first zero in MEMORY[address..limit).  Four
+  words are tested at a time: (x - 0x0001...) & ~x & 0x8000...
+  is nonzero exactly when one of the 16-bit lanes of x is zero.
+*/
+static int stringLength(const uint16_t *memory, int address, int limit) {
+    int end = address;
+    uint64_t lanes;
+
+    while (end + 4 <= limit) {
+        memcpy(&lanes, memory + end, sizeof(lanes));
+        if ((lanes - 0x0001000100010001ULL) & ~lanes & 0x8000800080008000ULL)
+            break;
+        end += 4;
+    }
+    while (end < limit && memory[end] != 0)
+        end++;
+    return end - address;
+}
+
+/* Tally a user-mode access that region policy does not allow; FALSE if it faulted and must be dropped */
+static int protectViolation (LC3_VM *vm, int address, int is_write, int policy) {
+    Protect *p = vm->PROTECT;
+    Protect_Region *region = &p->REGIONS[p->REGION[address]];
+    int pc = vm->ACCESS_PC;
+
+    /* A replay repeats what was tallied and reported the first time */
+    if (vm->HISTORY != NULL && vm->HISTORY->REPLAYING)
+        return policy != PROTECT_FAULT;
+
+    if (is_write)
+        region->WRITES++;
+    else
+        region->READS++;
+    if (p->BY_PC == NULL) {
+        p->BY_PC = calloc(WORDS_IN_MEM, sizeof(uint32_t));
+        p->WARNED = calloc(WORDS_IN_MEM, sizeof(uint8_t));
+        if (p->BY_PC == NULL || p->WARNED == NULL) {
+            printf("Error: Out of memory\n");
+            exit(-1);
+        }
+    }
+    p->BY_PC[pc]++;
+
+    switch (policy) {
+        case PROTECT_WARN_ONCE:
+            if (p->WARNED[pc])
+                break;
+            p->WARNED[pc] = TRUE;
+            /* fall through */
+        case PROTECT_WARN:
+            if (is_write)
+                consolePrintf(vm, "\nWarning: attempt to write to address %x\n", address);
+            else
+                consolePrintf(vm, "\nWarning: attempt to read address %x\n", address);
+            break;
+        case PROTECT_FAULT:
+            if (!vm->ACV_PENDING) {
+                vm->ACV_PENDING = TRUE;
+                vm->ACV_PC = pc;
+                vm->ACV_ADDRESS = address;
+                vm->ACV_WRITE = is_write;
+                vm->ACV_LATCHES = vm->CURRENT_LATCHES;
+                vm->ATTENTION = TRUE;
+            }
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Handler for pages with protected words; supervisor accesses are always allowed */
+int protectedAccess (LC3_VM *vm, int address, int value, int is_write) {
+    Protect *p = vm->PROTECT;
+    int policy = p->REGIONS[p->REGION[address]].policy;
+
+    if (policy != PROTECT_ALLOW && (vm->CURRENT_LATCHES.PSR & PSR_USER)
+        && !protectViolation(vm, address, is_write, policy))
+        return 0;
+    if (is_write) {
+        if (vm->HISTORY != NULL)
+            historyStore(vm, address);
+        storeWord(vm->MEMORY, address, value);
+        invalidateDecoded(vm, address);
+        markCodeWrite(vm, address);
+        markDirty(vm, address);
+        markShared(vm, address);
+        return 0;
+    }
+    return loadWord(vm->MEMORY, address);
+}
+
+static const char *const protect_policies[] = { "allow", "count", "warn-once", "warn", "fault" };
+
+static int protectAddRegion(Protect *p, const char *name, int low, int high, int policy) {
+    Protect_Region *region;
+    int address;
+
+    if (p->NUM_REGIONS == PROTECT_REGIONS)
+        return FALSE;
+    region = &p->REGIONS[p->NUM_REGIONS];
+    memset(region, 0, sizeof(Protect_Region));
+    snprintf(region->name, sizeof(region->name), "%s", name);
+    region->low = low;
+    region->high = high;
+    region->policy = policy;
+    for (address = low; address <= high; address++)
+        p->REGION[address] = p->NUM_REGIONS;
+    p->NUM_REGIONS++;
+    return TRUE;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : protectCreate                                   */
+/*                                                             */
+/* Purpose   : A table with the default regions: the vector    */
+/*             tables, the rest of system space and the I/O    */
+/*             page warn once per PC; user space is allowed.   */
+/*                                                             */
+/***************************************************************/
+Protect *protectCreate() {
+    Protect *p = calloc(1, sizeof(Protect));
+
+    if (p == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
+    }
+    protectAddRegion(p, "vectors", 0x0000, 0x01FF, PROTECT_WARN_ONCE);
+    protectAddRegion(p, "system", 0x0200, 0x2FFF, PROTECT_WARN_ONCE);
+    protectAddRegion(p, "user", 0x3000, 0xFCFF, PROTECT_ALLOW);
+    protectAddRegion(p, "io", 0xFD00, 0xFFFF, PROTECT_WARN_ONCE);
+    return p;
+}
+
+void protectFree(Protect *p) {
+    if (p == NULL)
+        return;
+    free(p->BY_PC);
+    free(p->WARNED);
+    free(p);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : protectItem                                     */
+/*                                                             */
+/* Purpose   : Apply one setting to the table: "policy" for    */
+/*             vectors, system and io, "name=policy" for a     */
+/*             region by name, or "low-high=policy" for a new  */
+/*             region over those words.  Returns FALSE if it   */
+/*             is malformed or the table is full.              */
+/*                                                             */
+/***************************************************************/
+int protectItem(Protect *p, char *item) {
+    char *equals = strchr(item, '='), *dash, range[24];
+    int policy = -1, low, high, i, found = FALSE;
+
+    for (i = 0; i < (int) (sizeof(protect_policies) / sizeof(protect_policies[0])); i++)
+        if (strcasecmp(equals != NULL ? equals + 1 : item, protect_policies[i]) == 0)
+            policy = i;
+    if (policy < 0)
+        return FALSE;
+
+    if (equals == NULL) {
+        for (i = 0; i < p->NUM_REGIONS; i++)
+            if (strcmp(p->REGIONS[i].name, "user") != 0)
+                p->REGIONS[i].policy = policy;
+    } else if (equals - item < (int) sizeof(range)) {
+        memcpy(range, item, equals - item);
+        range[equals - item] = '\0';
+        for (i = 0; i < p->NUM_REGIONS; i++)
+            if (strcasecmp(p->REGIONS[i].name, range) == 0) {
+                p->REGIONS[i].policy = policy;
+                found = TRUE;
+            }
+        if (!found) {
+            if ((dash = strchr(range, '-')) == NULL)
+                return FALSE;
+            *dash = '\0';
+            low = parseAddress(range);
+            high = parseAddress(dash + 1);
+            *dash = '-';
+            if (low < 0 || high < low || !protectAddRegion(p, range, low, high, policy))
+                return FALSE;
+        }
+    } else
+        return FALSE;
+
+    p->FAULTS = FALSE;
+    for (i = 0; i < p->NUM_REGIONS; i++)
+        if (p->REGIONS[i].policy == PROTECT_FAULT)
+            p->FAULTS = TRUE;
+    return TRUE;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : protectParse                                    */
+/*                                                             */
+/* Purpose   : Apply a list of settings separated by commas or */
+/*             white space ("#" starts a comment in a file).   */
+/*             Prints an error naming the bad item and returns */
+/*             FALSE.                                          */
+/*                                                             */
+/***************************************************************/
+int protectParse(Protect *p, char *text, const char *where) {
+    char *item, *rest;
+
+    if ((rest = strchr(text, '#')) != NULL)
+        *rest = '\0';
+    for (item = strtok_r(text, ", \t\r\n", &rest); item != NULL; item = strtok_r(NULL, ", \t\r\n", &rest))
+        if (!protectItem(p, item)) {
+            printf("Error: bad protection setting %s in %s\n", item, where);
+            return FALSE;
+        }
+    return TRUE;
+}
+
+int protectReadFile(Protect *p, char *filename) {
+    char line[256];
+    FILE *file;
+    int ok = TRUE;
+
+    if ((file = fopen(filename, "r")) == NULL) {
+        printf("Error: Can't open protection file %s\n", filename);
+        return FALSE;
+    }
+    while (ok && fgets(line, sizeof(line), file) != NULL)
+        ok = protectParse(p, line, filename);
+    fclose(file);
+    return ok;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : protectApply                                    */
+/*                                                             */
+/* Purpose   : Give the VM a copy of config's regions, with    */
+/*             its tallies cleared, and hand every page that   */
+/*             has a word that is not allowed to               */
+/*             protectedAccess.  The device pages keep         */
+/*             deviceAccess, which passes the other words on.  */
+/*                                                             */
+/***************************************************************/
+void protectApply(LC3_VM *vm, const Protect *config) {
+    Protect *p = vm->PROTECT;
+    int page, address, i;
+
+    free(p->BY_PC);
+    free(p->WARNED);
+    memcpy(p, config, sizeof(Protect));
+    p->BY_PC = NULL;
+    p->WARNED = NULL;
+    for (i = 0; i < p->NUM_REGIONS; i++)
+        p->REGIONS[i].READS = p->REGIONS[i].WRITES = 0;
+
+    for (page = 0; page < PAGES; page++) {
+        if (vm->PAGE_HANDLER[page] == deviceAccess)
+            continue;
+        vm->PAGE_HANDLER[page] = NULL;
+        for (address = page << PAGE_SHIFT; address < (page + 1) << PAGE_SHIFT; address++)
+            if (p->REGIONS[p->REGION[address]].policy != PROTECT_ALLOW) {
+                vm->PAGE_HANDLER[page] = protectedAccess;
+                break;
+            }
+    }
+    redecodeAll(vm);
+}
+
+static int compareTallies(const void *a, const void *b) {
+    const uint32_t *x = a, *y = b;
+
+    return x[1] != y[1] ? (x[1] < y[1] ? 1 : -1) : (int) x[0] - (int) y[0];
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : protectReport                                   */
+/*                                                             */
+/* Purpose   : List the regions and their tallies, then the    */
+/*             PCs with the most violations.  Quiet returns    */
+/*             without a word when there were none.            */
+/*                                                             */
+/***************************************************************/
+void protectReport(LC3_VM *vm, int quiet) {
+    Protect *p = vm->PROTECT;
+    uint32_t (*tallies)[2];
+    int count = 0, address, i;
+    char text[40];
+
+    if (quiet && p->BY_PC == NULL)
+        return;
+    printf("Region       Range        Policy         Reads     Writes\n");
+    for (i = 0; i < p->NUM_REGIONS; i++) {
+        Protect_Region *r = &p->REGIONS[i];
+
+        printf("%-12s x%.4X-x%.4X  %-9s %10lld %10lld\n", r->name, r->low, r->high,
+               protect_policies[r->policy], r->READS, r->WRITES);
+    }
+    if (p->BY_PC == NULL) {
+        printf("\nNo protection violations\n\n");
+        return;
+    }
+
+    tallies = malloc(WORDS_IN_MEM * sizeof(*tallies));
+    if (tallies == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
+    }
+    for (address = 0; address < WORDS_IN_MEM; address++)
+        if (p->BY_PC[address] != 0) {
+            tallies[count][0] = address;
+            tallies[count++][1] = p->BY_PC[address];
+        }
+    qsort(tallies, count, sizeof(*tallies), compareTallies);
+    printf("\nViolations by PC (%d PCs):\n", count);
+    for (i = 0; i < count && i < PROTECT_TOP_PCS; i++) {
+        disassemble(tallies[i][0], vm->MEMORY[tallies[i][0]], text);
+        printf("  x%.4X  %-24s %10u\n", tallies[i][0], text, tallies[i][1]);
+    }
+    printf("\n");
+    free(tallies);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Devices.  deviceAccess handles the registers; the rest runs */
+/* between instructions from executeInstructions.              */
+/*                                                             */
+/***************************************************************/
+#define NO_KEY  (-2)
+
+static int historyKey(LC3_VM *vm, int kind, int key);
+
+/* A key from the input stream or the terminal, or NO_KEY if wait is FALSE and none is ready */
+static int readInput (LC3_VM *vm, int wait) {
+    struct pollfd fds = { 0, POLLIN, 0 };
+    int x;
+
+    if (vm->input != NULL)
+        return fgetc(vm->input);
+
+    if (wait)
+        consoleFlush(vm);
+    set_conio_terminal_mode();
+    if (wait)
+        waitKey();
+    else if (poll(&fds, 1, 0) <= 0)
+        return NO_KEY;
+    x = getch();
+    if (x == 3 || x == 4) {
+        consoleFlush(vm);
+        printf("Error: keyboard interruption");
+        exit(0);
+    }
+    return x;
+}
+
+/* The same, one core at a time: each key goes to the core that reads it */
+static int inputKey (LC3_VM *vm, int wait) {
+    int x;
+
+    if (vm->CORES == NULL)
+        return readInput(vm, wait);
+    pthread_mutex_lock(&vm->CORES->INPUT_LOCK);
+    x = readInput(vm, wait);
+    pthread_mutex_unlock(&vm->CORES->INPUT_LOCK);
+    return x;
+}
+
+/* A key from the VM's input (as recorded, while replaying history) */
+static int hostKey (LC3_VM *vm, int wait) {
+    if (vm->HISTORY != NULL && vm->HISTORY->REPLAYING) {
+        int x = historyKey(vm, HISTORY_KEY, NO_KEY);
+
+        return x == NO_KEY && wait ? EOF : x;
+    }
+    if (vm->HISTORY != NULL)
+        return historyKey(vm, HISTORY_KEY, inputKey(vm, wait));
+    return inputKey(vm, wait);
+}
+
+static double hostSeconds () {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Latch a key into KBDR if one is waiting; FALSE once input has run out */
+static int keyboardPoll (LC3_VM *vm) {
+    int x;
+
+    if (vm->KBSR & DEVICE_READY)
+        return TRUE;
+    if ((x = hostKey(vm, FALSE)) == NO_KEY)
+        return TRUE;
+    if (x == EOF)
+        return FALSE;
+    vm->KBDR = x;
+    vm->KBSR |= DEVICE_READY;
+    return TRUE;
+}
+
+static void timerPoll (LC3_VM *vm) {
+    double now;
+
+    if (vm->HISTORY != NULL && vm->HISTORY->REPLAYING) {
+        if (historyKey(vm, HISTORY_TIMER, NO_KEY) != NO_KEY)
+            vm->TMR |= DEVICE_READY;
+        return;
+    }
+    if (vm->TMI == 0 || (now = hostSeconds()) < vm->TIMER_DEADLINE)
+        return;
+    vm->TMR |= DEVICE_READY;
+    vm->TIMER_DEADLINE = now + vm->TMI / 1000.0;
+    if (vm->HISTORY != NULL)
+        historyKey(vm, HISTORY_TIMER, 0);
+}
+
+/* Recompute DEVICES_ACTIVE and have the engine come back to look */
+static void devicesChanged (LC3_VM *vm) {
+    vm->DEVICES_ACTIVE = (vm->KBSR & DEVICE_IE) || ((vm->TMR & DEVICE_IE) && vm->TMI != 0);
+    vm->ATTENTION = TRUE;
+}
+
+/* PSR with the nzp bits filled in from CC */
+static int readPSR (LC3_VM *vm) {
+    return (vm->CURRENT_LATCHES.PSR & 0xFFF8) | CCMASK(vm->CURRENT_LATCHES.CC);
+}
+
+static void writePSR (LC3_VM *vm, int value) {
+    vm->CURRENT_LATCHES.PSR = value & 0x8707;
+    vm->CURRENT_LATCHES.CC = (value & 4) ? 0x8000 : (value & 2) ? 0 : 1;
+}
+
+/* Push/pop on the stack R6 points at, bypassing the page handlers */
+static void supervisorPush (LC3_VM *vm, int value) {
+    int sp = Low16bits(vm->CURRENT_LATCHES.REGS[6] - 1);
+
+    vm->CURRENT_LATCHES.REGS[6] = sp;
+    if (vm->HISTORY != NULL)
+        historyStore(vm, sp);
+    storeWord(vm->MEMORY, sp, value);
+    invalidateDecoded(vm, sp);
+    markCodeWrite(vm, sp);
+    markDirty(vm, sp);
+    markShared(vm, sp);
+}
+
+static int supervisorPop (LC3_VM *vm) {
+    int sp = vm->CURRENT_LATCHES.REGS[6];
+
+    vm->CURRENT_LATCHES.REGS[6] = Low16bits(sp + 1);
+    return loadWord(vm->MEMORY, sp);
+}
+
+/* Push PSR and PC on the supervisor stack, then continue at pc with the new PSR */
+static void supervisorEnter (LC3_VM *vm, int new_psr, int pc) {
+    int psr = readPSR(vm);
+
+    if (psr & PSR_USER) {
+        vm->SAVED_USP = vm->CURRENT_LATCHES.REGS[6];
+        vm->CURRENT_LATCHES.REGS[6] = vm->SAVED_SSP;
+    }
+    supervisorPush(vm, psr);
+    supervisorPush(vm, vm->CURRENT_LATCHES.PC);
+    writePSR(vm, new_psr);
+    vm->CURRENT_LATCHES.PC = pc;
+}
+
+/* Enter the handler in INTV entry vector at the given priority */
+static void interrupt (LC3_VM *vm, int vector, int priority) {
+    supervisorEnter(vm, (priority << 8) | 2, vm->MEMORY[INTV_BASE + vector]);
+    vm->IDLE_ARMED = FALSE;
+}
+
+/* Enter the service routine for TRAP vector, keeping the priority and CC */
+static void trapEnter (LC3_VM *vm, int vector) {
+    if (vm->MEMORY[vector] == 0x0000) {
+        consolePrintf(vm, "\nTRAP x%.2X: no service routine in the vector table\n", vector);
+        vm->CURRENT_LATCHES.PC = 0x0000;
+        return;
+    }
+    supervisorEnter(vm, readPSR(vm) & ~PSR_USER, vm->MEMORY[vector]);
+}
+
+/*
+  Back out the instruction whose access faulted and take the ACV
+  exception in its place, so the handler sees its PC.  With no
+  handler in the vector table the machine stops instead.
+*/
+static void accessViolation (LC3_VM *vm) {
+    vm->ACV_PENDING = FALSE;
+    memcpy(vm->CURRENT_LATCHES.REGS, vm->ACV_LATCHES.REGS, sizeof(vm->ACV_LATCHES.REGS));
+    vm->CURRENT_LATCHES.CC = vm->ACV_LATCHES.CC;
+    vm->CURRENT_LATCHES.PC = vm->ACV_PC;
+    if (vm->MEMORY[INTV_BASE + ACV_VECTOR] == 0x0000) {
+        consolePrintf(vm, "\nAccess violation: x%.4X %s x%.4X, no handler at x%.4X\n", vm->ACV_PC,
+                      vm->ACV_WRITE ? "wrote to" : "read", vm->ACV_ADDRESS, INTV_BASE + ACV_VECTOR);
+        vm->CURRENT_LATCHES.PC = 0x0000;
+        return;
+    }
+    interrupt(vm, ACV_VECTOR, (vm->CURRENT_LATCHES.PSR >> 8) & 7);
+}
+
+/* Every IDLE_POLL_LIMIT fruitless polls, have executeInstructions look for an idle loop */
+static void idlePoll (LC3_VM *vm) {
+    if (++vm->IDLE_POLLS == IDLE_POLL_LIMIT) {
+        vm->IDLE_POLLS = 0;
+        vm->ATTENTION = TRUE;
+    }
+}
+
+#define IDLE_KEYBOARD   1       /* the loop polls KBSR */
+#define IDLE_TIMER      2       /* the loop polls TMR */
+#define IDLE_INTERRUPT  4       /* only an interrupt handler can end the loop */
+
+/* What a read of address inside an idle loop waits on: IDLE_* bits, or -1 if it has side effects */
+static int idleRead (LC3_VM *vm, int address) {
+    Page_Handler handler = vm->PAGE_HANDLER[address >> PAGE_SHIFT];
+
+    if (handler == NULL)
+        return 0;
+    if (handler == deviceAccess) {
+        switch (address) {
+            case KBSR_ADDR: return IDLE_KEYBOARD;
+            case TMR_ADDR:  return IDLE_TIMER;
+            case TMI_ADDR:
+            case PSR_ADDR:
+            case MCR_ADDR:  return 0;
+            case KBDR_ADDR:
+            case DSR_ADDR:  return -1;
+        }
+    } else if (handler != protectedAccess)
+        return -1;
+    /* protectedAccess only has a side effect (the tally) in user mode, on a word not allowed */
+    return (vm->CURRENT_LATCHES.PSR & PSR_USER)
+           && vm->PROTECT->REGIONS[vm->PROTECT->REGION[address]].policy != PROTECT_ALLOW ? -1 : 0;
+}
+
+/* Code the idle check may look at: plain RAM, or a protected page in supervisor mode (an OS routine) */
+static int idleCode (LC3_VM *vm, int address) {
+    Page_Handler handler = vm->PAGE_HANDLER[address >> PAGE_SHIFT];
+
+    return handler == NULL || (handler == protectedAccess && !(vm->CURRENT_LATCHES.PSR & PSR_USER));
+}
+
+/*
+  If the PC is inside a loop that only a device can end, return the
+  loop's length in instructions, its first address in *head and what
+  it waits on in *wakes.  The loop must be straight-line code in plain
+  RAM (or, in supervisor mode, system space) closed by a backward BR, may leave through forward BRs, and
+  may only load, LEA and compute on registers.  No value may be
+  carried from one iteration to the next (registers and CC must be
+  written before they are read), so skipping iterations changes
+  nothing but INSTRUCTION_COUNT.
+*/
+static int idleLoop (LC3_VM *vm, int *head, int *wakes) {
+    uint16_t *R = vm->CURRENT_LATCHES.REGS;
+    int pc = vm->CURRENT_LATCHES.PC;
+    int start = -1, end, address, clobbered = 0, written = 0, cc_set = FALSE;
+    Decoded d;
+
+    /* The backward branch that closes the loop around pc */
+    for (end = pc; end < WORDS_IN_MEM && end - pc < IDLE_MAX_LENGTH; end++) {
+        if (!idleCode(vm, end))
+            return 0;
+        decodeInstruction(vm->MEMORY[end], &d);
+        if (d.op == OP_BR && end + 1 + d.imm <= pc && end + 1 + d.imm >= 0) {
+            start = end + 1 + d.imm;
+            break;
+        }
+    }
+    if (start < 0 || end - start >= IDLE_MAX_LENGTH ||
+        !idleCode(vm, start))
+        return 0;
+
+    for (address = start; address <= end; address++) {
+        decodeInstruction(vm->MEMORY[address], &d);
+        if (d.op != OP_BR && d.op != OP_NOP)
+            clobbered |= 1 << d.dr;
+    }
+
+    *wakes = 0;
+#define IDLE_SOURCE(r)  if ((clobbered & ~written) & (1 << (r))) return 0
+#define IDLE_WAITS(a)   do {                                            \
+        int wait_on = idleRead(vm, Low16bits(a));                       \
+        if (wait_on < 0) return 0;                                      \
+        *wakes |= wait_on;                                              \
+    } while (0)
+    for (address = start; address <= end; address++) {
+        int next = address + 1;
+
+        decodeInstruction(vm->MEMORY[address], &d);
+        switch (d.op) {
+            case OP_ADD_REG:
+            case OP_AND_REG:
+                IDLE_SOURCE(d.sr2);
+                /* fall through */
+            case OP_ADD_IMM:
+            case OP_AND_IMM:
+            case OP_NOT:
+                IDLE_SOURCE(d.sr1);
+                cc_set = TRUE;
+                break;
+            case OP_LEA:
+                break;
+            case OP_LD:
+                IDLE_WAITS(next + d.imm);
+                cc_set = TRUE;
+                break;
+            case OP_LDI:
+                IDLE_WAITS(next + d.imm);
+                IDLE_WAITS(vm->MEMORY[Low16bits(next + d.imm)]);
+                cc_set = TRUE;
+                break;
+            case OP_LDR:
+                if (clobbered & (1 << d.sr1))
+                    return 0;       /* the address would change */
+                IDLE_WAITS(R[d.sr1] + d.imm);
+                cc_set = TRUE;
+                break;
+            case OP_BR:
+                if (d.dr != 7 && !cc_set)
+                    return 0;
+                if (address != end && (d.dr == 7 || (next + d.imm >= start && next + d.imm <= end)))
+                    return 0;       /* only conditional forward exits inside the loop */
+                break;
+            case OP_NOP:
+                break;
+            default:
+                return 0;
+        }
+        if (d.op != OP_BR && d.op != OP_NOP)
+            written |= 1 << d.dr;
+    }
+#undef IDLE_SOURCE
+#undef IDLE_WAITS
+
+    if (vm->DEVICES_ACTIVE && ((vm->CURRENT_LATCHES.PSR >> 8) & 7) < DEVICE_PRIORITY)
+        *wakes |= IDLE_INTERRUPT;
+    if (*wakes == 0)
+        return 0;           /* nothing can ever end it: let it spin */
+    *head = start;
+    return end - start + 1;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : idleWait                                        */
+/*                                                             */
+/* Purpose   : If the machine is spinning in an idle loop,     */
+/*             block the host until the event it waits on      */
+/*             (a key, the timer) and charge the skipped       */
+/*             iterations to INSTRUCTION_COUNT.  Returns the   */
+/*             number of instructions charged, at most budget. */
+/*                                                             */
+/***************************************************************/
+/*
+  A loop is only slept on when the previous check also found the
+  machine in it and it has run since, with no interrupt or sleep in
+  between; otherwise a handler may just have changed what it waits
+  for.  The first time a loop is found, that gap also times how fast
+  this VM spins it.  Time spent blocked is converted back into whole
+  iterations at that rate.
+*/
+static inline void profileCount(LC3_VM *vm, int pc, const Decoded *rec, uint64_t times);
+static void traceSkip(LC3_VM *vm, int head, int length, uint64_t turns);
+
+/* Credit a running profile with the skipped turns of the idle loop at head */
+static void profileIdle (LC3_VM *vm, int head, int length, uint64_t turns) {
+    Profile *prof = vm->PROFILE;
+    int address, end = head + length - 1;
+    Decoded d;
+
+    for (address = head; address <= end; address++) {
+        decodeInstruction(vm->MEMORY[address], &d);
+        if (d.op != OP_BR)
+            profileCount(vm, address, &d, turns);
+        else {      /* only the branch closing the loop was taken */
+            prof->EXECUTED[address] += turns;
+            prof->OPS[OP_BR] += turns;
+            if (address == end)
+                prof->TAKEN[address] += turns;
+        }
+    }
+}
+
+int idleWait (LC3_VM *vm, int budget) {
+    struct pollfd fds = { 0, POLLIN, 0 };
+    int head = -1, length, wakes, keyboard, timer, timeout_ms;
+    double now, limit;
+    long long skipped;
+
+    if ((length = idleLoop(vm, &head, &wakes)) == 0)
+        return 0;
+    keyboard = (wakes & IDLE_KEYBOARD) || ((wakes & IDLE_INTERRUPT) && (vm->KBSR & DEVICE_IE));
+    timer = ((wakes & IDLE_TIMER) || ((wakes & IDLE_INTERRUPT) && (vm->TMR & DEVICE_IE))) && vm->TMI != 0;
+
+    /* Already due, or a key is sitting in the input file */
+    if ((keyboard && (vm->KBSR & DEVICE_READY)) || (timer && (vm->TMR & DEVICE_READY)))
+        return 0;
+    if (keyboard && vm->input != NULL) {
+        if (keyboardPoll(vm))
+            return 0;
+        keyboard = FALSE;
+        if (!timer) {       /* waiting for input that will never come */
+            vm->INPUT_EOF = TRUE;
+            vm->CURRENT_LATCHES.PC = 0x0000;
+            return 0;
+        }
+    }
+    if (!keyboard && !timer)
+        return 0;
+
+    now = hostSeconds();
+    if (head != vm->IDLE_HEAD) {
+        vm->IDLE_HEAD = head;
+        vm->IDLE_SINCE = now;
+        vm->IDLE_RATE = 0;
+        vm->IDLE_ARMED = FALSE;
+    }
+    if (!vm->IDLE_ARMED || vm->INSTRUCTION_COUNT == vm->IDLE_SINCE_COUNT) {
+        vm->IDLE_ARMED = TRUE;
+        vm->IDLE_SINCE_COUNT = vm->INSTRUCTION_COUNT;
+        return 0;
+    }
+    if (vm->IDLE_RATE == 0) {
+        if (now <= vm->IDLE_SINCE)
+            return 0;
+        vm->IDLE_RATE = (vm->INSTRUCTION_COUNT - vm->IDLE_SINCE_COUNT) / (now - vm->IDLE_SINCE);
+    }
+
+    /* Never sleep past the end of the caller's budget */
+    limit = budget / vm->IDLE_RATE;
+    if (timer && vm->TIMER_DEADLINE - now < limit)
+        limit = vm->TIMER_DEADLINE - now;
+    timeout_ms = limit <= 0 ? 0 : limit > INT_MAX / 1000 ? -1 : (int) (limit * 1000) + 1;
+    if (timeout_ms < 0 && !keyboard)
+        timeout_ms = INT_MAX;
+
+    consoleFlush(vm);
+    if (keyboard)
+        set_conio_terminal_mode();
+    while (poll(&fds, keyboard ? 1 : 0, timeout_ms) < 0 && errno == EINTR)
+        ;
+
+    skipped = (long long) ((hostSeconds() - now) * vm->IDLE_RATE) / length * length;
+    if (skipped > budget)
+        skipped = budget / length * length;
+    vm->INSTRUCTION_COUNT += skipped;
+    if (vm->PROFILING)
+        profileIdle(vm, head, length, skipped / length);
+    if (vm->TRACE != NULL && skipped > 0)
+        traceSkip(vm, head, length, skipped / length);
+    vm->IDLE_ARMED = FALSE;
+    vm->ATTENTION = TRUE;
+    return (int) skipped;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : serviceDevices                                  */
+/*                                                             */
+/* Purpose   : Between two instructions: stop the machine if   */
+/*             MCR was cleared or input ran out, take an ACV   */
+/*             exception if an access faulted, poll enabled    */
+/*             devices and take an interrupt if one is due.    */
+/*                                                             */
+/***************************************************************/
+void serviceDevices (LC3_VM *vm) {
+    int level = (vm->CURRENT_LATCHES.PSR >> 8) & 7;
+
+    if (vm->KBSR & DEVICE_IE)
+        keyboardPoll(vm);
+    timerPoll(vm);
+    vm->ATTENTION = FALSE;
+
+    if (!(vm->MCR & 0x8000) || vm->INPUT_EOF) {
+        vm->CURRENT_LATCHES.PC = 0x0000;
+        return;
+    }
+    if (vm->ACV_PENDING) {
+        accessViolation(vm);
+        if (vm->CURRENT_LATCHES.PC == 0x0000)
+            return;
+        level = (vm->CURRENT_LATCHES.PSR >> 8) & 7;
+    }
+    if (DEVICE_PRIORITY <= level)
+        return;
+    if ((vm->KBSR & (DEVICE_READY | DEVICE_IE)) == (DEVICE_READY | DEVICE_IE))
+        interrupt(vm, KEYBOARD_VECTOR, DEVICE_PRIORITY);
+    else if ((vm->TMR & (DEVICE_READY | DEVICE_IE)) == (DEVICE_READY | DEVICE_IE))
+        interrupt(vm, TIMER_VECTOR, DEVICE_PRIORITY);
+}
+
+/* Handler for the device pages xFE00 and xFF00 */
+int deviceAccess (LC3_VM *vm, int address, int value, int is_write) {
+    int status;
+
+    switch (address) {
+        case KBSR_ADDR:
+            if (is_write) {
+                vm->KBSR = (vm->KBSR & DEVICE_READY) | (value & DEVICE_IE);
+                devicesChanged(vm);
+                return 0;
+            }
+            /* Polling for input that will never come: stop as GETC would */
+            if (!keyboardPoll(vm)) {
+                vm->INPUT_EOF = TRUE;
+                vm->ATTENTION = TRUE;
+            } else if (!(vm->KBSR & DEVICE_READY))
+                idlePoll(vm);
+            return vm->KBSR;
+        case KBDR_ADDR:
+            if (is_write)
+                break;
+            vm->KBSR &= ~DEVICE_READY;
+            return vm->KBDR;
+        case DSR_ADDR:
+            if (is_write) {
+                vm->DSR = value & DEVICE_IE;
+                return 0;
+            }
+            return vm->DSR | DEVICE_READY;     /* output never blocks */
+        case DDR_ADDR:
+            if (!is_write)
+                break;
+            printASCII(vm, value);
+            return 0;
+        case TMR_ADDR:
+            if (is_write) {
+                vm->TMR = (vm->TMR & DEVICE_READY) | (value & DEVICE_IE);
+                devicesChanged(vm);
+                return 0;
+            }
+            timerPoll(vm);
+            status = vm->TMR;
+            vm->TMR &= ~DEVICE_READY;
+            if (!(status & DEVICE_READY))
+                idlePoll(vm);
+            return status;
+        case TMI_ADDR:
+            if (is_write) {
+                vm->TMI = value;
+                vm->TIMER_DEADLINE = hostSeconds() + value / 1000.0;
+                devicesChanged(vm);
+                return 0;
+            }
+            return vm->TMI;
+        case CID_ADDR:
+            if (is_write)
+                break;
+            return vm->CORE_ID;
+        case NCORES_ADDR:
+            if (is_write)
+                break;
+            return vm->CORES != NULL ? vm->CORES->NUM_CORES : 1;
+        case PSR_ADDR:
+            if (is_write) {
+                writePSR(vm, value);
+                vm->ATTENTION = TRUE;
+                return 0;
+            }
+            return readPSR(vm);
+        case MCR_ADDR:
+            if (is_write) {
+                vm->MCR = value;
+                vm->ATTENTION = TRUE;
+                return 0;
+            }
+            return vm->MCR;
+    }
+    return protectedAccess(vm, address, value, is_write);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : imageSave                                       */
+/*                                                             */
+/* Purpose   : Write the machine to filename as a              */
+/*             Machine_Image.  Returns FALSE after printing    */
+/*             an error.                                       */
+/*                                                             */
+/***************************************************************/
+int imageSave(LC3_VM *vm, char *filename) {
+    Machine_Image *image = calloc(1, sizeof(Machine_Image));
+    ssize_t written;
+    int fd;
+
+    if (image == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
+    }
+    memcpy(image->MAGIC, IMAGE_MAGIC, sizeof(image->MAGIC));
+    image->VERSION = IMAGE_VERSION;
+    image->ORDER = IMAGE_ORDER;
+    image->SIZE = sizeof(Machine_Image);
+    image->INSTRUCTION_COUNT = vm->INSTRUCTION_COUNT;
+    image->PC = vm->CURRENT_LATCHES.PC;
+    image->CC = vm->CURRENT_LATCHES.CC;
+    image->PSR = vm->CURRENT_LATCHES.PSR;
+    memcpy(image->REGS, vm->CURRENT_LATCHES.REGS, sizeof(image->REGS));
+    image->TOP_P = vm->top_p;
+    image->RUN_BIT = vm->RUN_BIT;
+    image->KBSR = vm->KBSR;
+    image->KBDR = vm->KBDR;
+    image->DSR = vm->DSR;
+    image->TMR = vm->TMR;
+    image->TMI = vm->TMI;
+    image->MCR = vm->MCR;
+    image->SAVED_SSP = vm->SAVED_SSP;
+    image->SAVED_USP = vm->SAVED_USP;
+    memcpy(image->MEMORY, vm->MEMORY, sizeof(image->MEMORY));
+    memcpy(image->PROGRAM_MAP, vm->PROGRAM_MAP, sizeof(image->PROGRAM_MAP));
+
+    if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        printf("Error: Can't open image file %s\n", filename);
+        free(image);
+        return FALSE;
+    }
+    written = write(fd, image, sizeof(Machine_Image));
+    free(image);
+    if (close(fd) < 0 || written != sizeof(Machine_Image)) {
+        printf("Error: Can't write image file %s\n", filename);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : imageLoad                                       */
+/*                                                             */
+/* Purpose   : Replace the machine with the Machine_Image in   */
+/*             filename.  Returns FALSE, with the machine left */
+/*             alone, after printing an error.                 */
+/*                                                             */
+/***************************************************************/
+/*
+  The symbol table, breakpoints and profile counters are kept.  The
+  decode cache and any translations are dropped, and a history
+  starts over from the loaded state, since nothing before it can be
+  replayed.
+*/
+int imageLoad(LC3_VM *vm, char *filename) {
+    const Machine_Image *image;
+    struct stat info;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        printf("Error: Can't open image file %s\n", filename);
+        return FALSE;
+    }
+    if (fstat(fd, &info) < 0 || info.st_size != sizeof(Machine_Image)) {
+        printf("Error: %s is not a machine image of this version\n", filename);
+        close(fd);
+        return FALSE;
+    }
+    image = mmap(NULL, sizeof(Machine_Image), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        printf("Error: Can't map image file %s\n", filename);
+        return FALSE;
+    }
+    if (memcmp(image->MAGIC, IMAGE_MAGIC, sizeof(image->MAGIC)) != 0 || image->ORDER != IMAGE_ORDER
+        || image->VERSION != IMAGE_VERSION || image->SIZE != sizeof(Machine_Image)) {
+        printf("Error: %s is not a machine image of this version\n", filename);
+        munmap((void *) image, sizeof(Machine_Image));
+        return FALSE;
+    }
+
+    vm->INSTRUCTION_COUNT = image->INSTRUCTION_COUNT;
+    vm->CURRENT_LATCHES.PC = image->PC;
+    vm->CURRENT_LATCHES.CC = image->CC;
+    vm->CURRENT_LATCHES.PSR = image->PSR;
+    memcpy(vm->CURRENT_LATCHES.REGS, image->REGS, sizeof(image->REGS));
+    vm->top_p = image->TOP_P;
+    vm->RUN_BIT = image->RUN_BIT;
+    vm->KBSR = image->KBSR;
+    vm->KBDR = image->KBDR;
+    vm->DSR = image->DSR;
+    vm->TMR = image->TMR;
+    vm->TMI = image->TMI;
+    vm->MCR = image->MCR;
+    vm->SAVED_SSP = image->SAVED_SSP;
+    vm->SAVED_USP = image->SAVED_USP;
+    memcpy(vm->MEMORY, image->MEMORY, sizeof(image->MEMORY));
+    memcpy(vm->PROGRAM_MAP, image->PROGRAM_MAP, sizeof(image->PROGRAM_MAP));
+    munmap((void *) image, sizeof(Machine_Image));
+
+    /* Host-side state starts afresh */
+    vm->INPUT_EOF = FALSE;
+    vm->ACV_PENDING = FALSE;
+    vm->TIMER_DEADLINE = 0;
+    vm->IDLE_POLLS = 0;
+    vm->IDLE_HEAD = -1;
+    vm->IDLE_ARMED = FALSE;
+    devicesChanged(vm);
+
+    redecodeAll(vm);
+    if (vm->jit != NULL)
+        vm->JIT_FLUSH_PENDING = TRUE;
+    if (vm->HISTORY != NULL)
+        historyStart(vm, (int) (vm->HISTORY->BUDGET >> 20));
+    return TRUE;
+}
+
+static inline int getMemory (LC3_VM *vm, int address) {
+    Page_Handler handler = vm->PAGE_HANDLER[address >> PAGE_SHIFT];
+
+    if (handler == NULL)
+        return loadWord(vm->MEMORY, address);
+    return handler(vm, address, 0, FALSE);
+}
+
+void setMemory (LC3_VM *vm, int address, int value) {
+    Page_Handler handler = vm->PAGE_HANDLER[address >> PAGE_SHIFT];
+
+    if (handler == NULL) {
+        if (vm->HISTORY != NULL)
+            historyStore(vm, address);
+        storeWord(vm->MEMORY, address, value);
+        invalidateDecoded(vm, address);
+        markCodeWrite(vm, address);
+        markDirty(vm, address);
+        markShared(vm, address);
+    } else
+        handler(vm, address, value, TRUE);
+}
+
+/*
+  PUTS/PUTSP: the part of the string in plain RAM is measured and
+  copied in one run; whatever lies in handled pages goes through
+  getMemory a word at a time so warnings and devices still fire.
+*/
+static void putString(LC3_VM *vm, int packed) {
+    int address = Low16bits(vm->CURRENT_LATCHES.REGS[0]);
+    int value;
+
+    while (TRUE) {
+        if (vm->PAGE_HANDLER[address >> PAGE_SHIFT] == NULL) {
+            int limit = plainRAMEnd(vm, address);
+            int length = stringLength(vm->MEMORY, address, limit);
+
+            consoleWords(vm, vm->MEMORY + address, length, packed);
+            if (address + length < limit)
+                return;
+            address = Low16bits(address + length);
+            continue;
+        }
+        if ((value = getMemory(vm, address)) == 0)
+            return;
+        if (packed) {
+            printASCII(vm, value & 0x00FF);
+            printASCII(vm, value >> 8);
+        } else {
+            printASCII(vm, value);
+        }
+        address = Low16bits(address + 1);
+    }
+}
+
+void processInstruction(LC3_VM *vm) {
+
+    vm->ACCESS_PC = vm->CURRENT_LATCHES.PC;
+    vm->Instruction = getMemory(vm, vm->CURRENT_LATCHES.PC);
+    vm->CURRENT_LATCHES.PC += 1;
+    vm->Instruction = Low16bits(vm->Instruction);
+    
+    int operation = vm->Instruction & 0xF000;  /* vm->Instruction[15:12] */
+    operation = operation >> 12;
+
+    /* Execute */
+    switch (operation) {
+        case 0b0001:    /* 0001 */
+            ADD(vm, vm->Instruction);
+            break;
+
+        case 0b0101:    /* 0101 */
+            AND(vm, vm->Instruction);
+            break;
+
+        case 0b0000:    /* 0000 */
+            BR(vm, vm->Instruction);
+            break;
+
+        case 0b1100:    /* 1100 */
+            JMP(vm, vm->Instruction);
+            break;
+
+        case 0b0100:    /* 0100 */
+            if ((vm->Instruction & 0x0800) >> 11)
+                JSR(vm, vm->Instruction);
+            else
+                JSRR(vm, vm->Instruction);
+            break;
+
+        case 0b0010:    /* 0010 */
+            LD(vm, vm->Instruction);
+            break;
+
+        case 0b1010:    /* 1010 */
+            LDI(vm, vm->Instruction);
+            break;
+
+        case 0b0110:    /* 0110 */
+            LDR(vm, vm->Instruction);
+            break;
+
+        case 0b1110:    /* 1110 */
+            LEA(vm, vm->Instruction);
+            break;
+
+        case 0b1001:    /* 1001 */
+            NOT(vm, vm->Instruction);
+            break;
+
+        case 0b1000:    /* 1000 */
+            RTI(vm, vm->Instruction);
+            break;
+
+        case 0b0011:    /* 0011 */
+            ST(vm, vm->Instruction);
+            break;
+
+        case 0b1011:    /* 1011 */
+            STI(vm, vm->Instruction);
+            break;
+
+        case 0b0111:    /* 0111 */
+            STR(vm, vm->Instruction);
+            break;
+
+        case 0b1111:    /* 1111 */
+            TRAP(vm, vm->Instruction);
+            break;
+
+        default:
+            break;
+    }
+}
+
+int SetCC (LC3_VM *vm, int value) {
+    vm->CURRENT_LATCHES.CC = Low16bits(value);  /* N/Z/P derived on demand */
+    return 0;
+}
+
+int SEXT (int num, int length) {  /* Sign extension */
+    int Sign;
+    switch (length) {
+        case 5:     /* imm5 */
+            Sign = (num & 0x0010) >> 4;
+            if(Sign)        /* Negative */
+                num += 0xFFE0;  /* Extend with 1 */
+            break;
+
+        case 6:     /* PCoffset6 */
+            Sign = (num & 0x0020) >> 5;
+            if(Sign)
+                num += 0xFFC0;
+            break;
+
+        case 9:     /* PCoffset9 */
+            Sign = (num & 0x0100) >> 8;
+            if(Sign)
+                num += 0xFE00;
+            break;
+
+        case 11:    /* PCoffset11 */
+            Sign = (num & 0x0400) >> 10;
+            if(Sign)
+                num += 0xF800;
+            break;
+
+        default:
+            break;
+    }
+    num = Low16bits(num);
+    return num;
+}
+
+int ADD (LC3_VM *vm, int instruction) {
+    int DR = (instruction & 0x0E00) >> 9;
+    int SR1 = (instruction & 0x01C0) >> 6;
+
+    if((instruction & 0x0020) == 0) {      /* Instruction[5] = 0 */
+        int SR2 = (instruction & 0x0007);
+        vm->CURRENT_LATCHES.REGS[DR]
+                = vm->CURRENT_LATCHES.REGS[SR1] + vm->CURRENT_LATCHES.REGS[SR2];
+    }
+
+    else{      /* Instruction[5] = 1 */
+        int imm5 = (instruction & 0x001F);
+        vm->CURRENT_LATCHES.REGS[DR] = vm->CURRENT_LATCHES.REGS[SR1] + SEXT(imm5, 5);
+    }
+
+    vm->CURRENT_LATCHES.REGS[DR] = Low16bits(vm->CURRENT_LATCHES.REGS[DR]);
+    SetCC(vm, vm->CURRENT_LATCHES.REGS[DR]);
+    return 0;
+}
+
+int AND (LC3_VM *vm, int instruction) {
+    int DR = (instruction & 0x0E00) >> 9;
+    int SR1 = (instruction & 0x01C0) >> 6;
+
+    if((instruction & 0x0020) == 0) {            /* Instruction[5] = 0 */
+        int SR2 = (instruction & 0x0007);
+        vm->CURRENT_LATCHES.REGS[DR] = vm->CURRENT_LATCHES.REGS[SR1] & vm->CURRENT_LATCHES.REGS[SR2];
+    }
+
+    else{       /* Instruction[5] = 1 */
+        int imm5 = (instruction & 0x001F);
+        vm->CURRENT_LATCHES.REGS[DR] = vm->CURRENT_LATCHES.REGS[SR1] & SEXT(imm5, 5);
+    }
+
+    vm->CURRENT_LATCHES.REGS[DR] = Low16bits(vm->CURRENT_LATCHES.REGS[DR]);
+    SetCC(vm, vm->CURRENT_LATCHES.REGS[DR]);
+    return 0;
+}
+
+int BR (LC3_VM *vm, int instruction) {
+    int PCoffset9 = instruction & 0x01FF;
+    int n = (instruction & 0x0800) >> 11;
+    int z = (instruction & 0x0400) >> 10;
+    int p = (instruction & 0x0200) >> 9;
+    int flag = n && CC_N(vm->CURRENT_LATCHES) || z && CC_Z(vm->CURRENT_LATCHES) || p && CC_P(vm->CURRENT_LATCHES);  /* Condition */
+
+    if (flag) {
+        vm->CURRENT_LATCHES.PC += SEXT(PCoffset9, 9);
+        vm->CURRENT_LATCHES.PC = Low16bits(vm->CURRENT_LATCHES.PC);
+    }
+
+    return 0;
+}
+
+int JMP (LC3_VM *vm, int instruction) {
+    int BaseR = (instruction & 0x01C0) >> 6;
+    if (BaseR == 7) {        // RET
+        if (isEmpty(vm)) {
+            consolePrintf(vm, "Error: RET called when stack is empty");
+        } else {
+            vm->CURRENT_LATCHES.REGS[7] = POP(vm);
+        }
+    }
+
+    vm->CURRENT_LATCHES.PC = Low16bits(vm->CURRENT_LATCHES.REGS[BaseR]);
+    return 0;
+}
+
+int JSR (LC3_VM *vm, int instruction) {
+    vm->CURRENT_LATCHES.REGS[7] = vm->CURRENT_LATCHES.PC;  /* Save R7 first */
+    PUSH(vm, vm->CURRENT_LATCHES.REGS[7]);
+
+    int PCoffset11 = instruction & 0x07FF;
+    vm->CURRENT_LATCHES.PC += SEXT(PCoffset11, 11);
+    vm->CURRENT_LATCHES.PC = Low16bits(vm->CURRENT_LATCHES.PC);
+    return 0;
+}
+
+int JSRR (LC3_VM *vm, int instruction) {
+    vm->CURRENT_LATCHES.REGS[7] = vm->CURRENT_LATCHES.PC;   /* Save R7 first */
+    PUSH(vm, vm->CURRENT_LATCHES.REGS[7]);
+
+    int BaseR = (instruction & 0x01C0) >> 6;
+    vm->CURRENT_LATCHES.PC = Low16bits(vm->CURRENT_LATCHES.REGS[BaseR]);
+    return 0;
+}
+
+int LD (LC3_VM *vm, int instruction) {
+    int DR = (instruction & 0x0E00) >> 9;
+    int PCoffset9 = instruction & 0x01FF;
+    int address = Low16bits((vm->CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
+    vm->CURRENT_LATCHES.REGS[DR] = Low16bits(getMemory(vm, address));
+
+    SetCC(vm, vm->CURRENT_LATCHES.REGS[DR]);
+    return 0;
+}
+
+int LDI (LC3_VM *vm, int instruction) {
+    int DR = (instruction & 0x0E00) >> 9;
+    int PCoffset9 = instruction & 0x01FF;
+
+    int address = Low16bits((vm->CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
+    vm->CURRENT_LATCHES.REGS[DR] = Low16bits(getMemory(vm, getMemory(vm, address)));
+
+    SetCC(vm, vm->CURRENT_LATCHES.REGS[DR]);
+    return 0;
+}
+
+int LDR (LC3_VM *vm, int instruction) {
+    int DR = (instruction & 0x0E00) >> 9;
+    int BaseR = (instruction & 0x01C0) >> 6;
+    int PCoffset6 = instruction & 0x003F;
+
+    int address = Low16bits((vm->CURRENT_LATCHES.REGS[BaseR] + SEXT(PCoffset6, 6)));
+    vm->CURRENT_LATCHES.REGS[DR] = Low16bits(getMemory(vm, address));
+
+    SetCC(vm, vm->CURRENT_LATCHES.REGS[DR]);
+    return 0;
+}
+
+int LEA (LC3_VM *vm, int instruction) {
+    int DR = (instruction & 0x0E00) >> 9;
+    int PCoffset9 = instruction & 0x01FF;
+    vm->CURRENT_LATCHES.REGS[DR] = Low16bits(vm->CURRENT_LATCHES.PC + SEXT(PCoffset9, 9));
+    return 0;
+}
+
+int NOT (LC3_VM *vm, int instruction) {
+    int DR = (instruction & 0x0E00) >> 9;
+    int SR = (instruction & 0x01C0) >> 6;
+    vm->CURRENT_LATCHES.REGS[DR] = Low16bits(~ vm->CURRENT_LATCHES.REGS[SR]);
+
+    SetCC(vm, vm->CURRENT_LATCHES.REGS[DR]);
+    return 0;
+}
+
+/*
+  In supervisor mode RTI pops PC and PSR off the supervisor stack
+  and switches back to the user stack if it returns to user mode.
+  In user mode there is no exception handler to go to, so it keeps
+  the old behaviour of returning through the pseudo stack.
+*/
+int RTI (LC3_VM *vm, int instruction) {
+    if (!(vm->CURRENT_LATCHES.PSR & PSR_USER)) {
+        int pc = supervisorPop(vm);
+        int psr = supervisorPop(vm);
+
+        vm->CURRENT_LATCHES.PC = Low16bits(pc);
+        writePSR(vm, psr);
+        if (psr & PSR_USER) {
+            vm->SAVED_SSP = vm->CURRENT_LATCHES.REGS[6];
+            vm->CURRENT_LATCHES.REGS[6] = vm->SAVED_USP;
+        }
+        vm->ATTENTION = TRUE;   /* a masked interrupt may be due now */
+    } else if (isEmpty(vm)) {
+        consolePrintf(vm, "Error: RTI called when stack is empty");
+    } else {
+        vm->CURRENT_LATCHES.PC = Low16bits(POP(vm));
+    }
+    return 0;
+}
+
+int ST (LC3_VM *vm, int instruction) {
+    int SR = (instruction & 0x0E00) >> 9;
+    int PCoffset9 = instruction & 0x01FF;
+    int address = Low16bits((vm->CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
+    setMemory(vm, address, Low16bits(vm->CURRENT_LATCHES.REGS[SR]));
+    return 0;
+}
+
+int STI (LC3_VM *vm, int instruction) {
+    int SR = (instruction & 0x0E00) >> 9;
+    int PCoffset9 = instruction & 0x01FF;
+    int address = Low16bits((vm->CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
+    setMemory(vm, getMemory(vm, address), Low16bits(vm->CURRENT_LATCHES.REGS[SR]));
+    return 0;
+}
+
+int STR (LC3_VM *vm, int instruction) {
+    int SR = (instruction & 0x0E00) >> 9;
+    int BaseR = (instruction & 0x01C0) >> 6;
+    int PCoffset6 = instruction & 0x003F;
+    int address = Low16bits((vm->CURRENT_LATCHES.REGS[BaseR] + SEXT(PCoffset6, 6)));
+    setMemory(vm, address, Low16bits(vm->CURRENT_LATCHES.REGS[SR]));
+    return 0;
+}
+
+/*
+  Next character for GETC/IN: a key already latched in KBDR, then
+  the VM's input stream if it has one, otherwise a key from the
+  terminal.  Either way EOF stops the VM as if HALTed.
+*/
+int readKey (LC3_VM *vm) {
+    int x;
+
+    if (vm->KBSR & DEVICE_READY) {
+        vm->KBSR &= ~DEVICE_READY;
+        return vm->KBDR;
+    }
+    if ((x = hostKey(vm, TRUE)) == EOF) {
+        vm->INPUT_EOF = TRUE;
+        vm->CURRENT_LATCHES.PC = 0x0000;
+    }
+    return x;
+}
+
+static const char *trap_names[] = { "GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT" };
+
+int TRAP(LC3_VM *vm, int instruction) {
+    int trapVect = (instruction & 0x00FF);
+
+    if (vm->TRAP_GUEST[trapVect] ||
+        ((trapVect < TRAP_HOST_FIRST || trapVect > TRAP_HOST_LAST) && vm->MEMORY[trapVect] != 0x0000)) {
+        trapEnter(vm, trapVect);
+        return 0;
+    }
+    switch (trapVect)
+    {
+        case 0x20: { // GETC
+            int x = readKey(vm);
+            if (x != EOF)
+                vm->CURRENT_LATCHES.REGS[0] = x;
+            break;
+        }
+        case 0x21: { // OUT
+            printASCII(vm, vm->CURRENT_LATCHES.REGS[0]);
+            break;
+        }
+        case 0x22: { // PUTS
+            putString(vm, FALSE);
+            break;
+        }
+        case 0x23: { // IN
+            consolePrintf(vm, "Input a character: ");
+            int x = readKey(vm);
+            if (x != EOF) {
+                consolePrintf(vm, "%c", x);
+                vm->CURRENT_LATCHES.REGS[0] = x;
+            }
+            break;
+        }
+        case 0x24: { // PUTSP
+            putString(vm, TRUE);
+            break;
+        }
+        case 0x25: { // HALT
+            vm->CURRENT_LATCHES.PC = 0x0000;
+            consoleFlush(vm);
+            // RUN_BIT = FALSE; // Already handled
+        }
+    }
+    return 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : trapParse                                       */
+/*                                                             */
+/* Purpose   : Apply --traps settings to guest, one flag per   */
+/*             vector: "host" or "guest" for every vector, or  */
+/*             "vector=host" / "vector=guest", where vector    */
+/*             is GETC..HALT or a number such as x21, split    */
+/*             by commas.  FALSE after printing an error.      */
+/*                                                             */
+/***************************************************************/
+int trapParse(uint8_t *guest, char *text) {
+    char *copy = strdup(text), *item, *rest;
+    int ok = TRUE;
+
+    for (item = strtok_r(copy, ",", &rest); item != NULL; item = strtok_r(NULL, ",", &rest)) {
+        char *mode = strchr(item, '=');
+        int vector = -1, is_guest, i;
+
+        if (mode != NULL)
+            *mode++ = '\0';
+        else {
+            mode = item;
+            item = NULL;
+        }
+        if (strcasecmp(mode, "host") != 0 && strcasecmp(mode, "guest") != 0) {
+            printf("Error: bad --traps mode %s, not host or guest\n", mode);
+            ok = FALSE;
+            break;
+        }
+        is_guest = strcasecmp(mode, "guest") == 0;
+        if (item == NULL) {
+            memset(guest, is_guest, TRAP_VECTORS);
+            continue;
+        }
+        for (i = 0; i <= TRAP_HOST_LAST - TRAP_HOST_FIRST; i++)
+            if (strcasecmp(item, trap_names[i]) == 0)
+                vector = TRAP_HOST_FIRST + i;
+        if (vector < 0 && ((vector = parseAddress(item)) < 0 || vector >= TRAP_VECTORS)) {
+            printf("Error: bad --traps vector %s\n", item);
+            ok = FALSE;
+            break;
+        }
+        guest[vector] = is_guest;
+    }
+    free(copy);
+    return ok;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : decodeInstruction                               */
+/*                                                             */
+/* Purpose   : Split an instruction word into a Decoded record */
+/*             (everything except the handler address).        */
+/*                                                             */
+/***************************************************************/
+void decodeInstruction(int instruction, Decoded *rec) {
+    int DR = (instruction & 0x0E00) >> 9;
+    int SR1 = (instruction & 0x01C0) >> 6;
+
+    rec->dr = DR;
+    rec->sr1 = SR1;
+    rec->sr2 = instruction & 0x0007;
+    rec->imm = 0;
+
+    switch (instruction >> 12) {
+        case 0b0001:    /* ADD */
+        case 0b0101:    /* AND */
+            if (instruction & 0x0020) {
+                rec->op = (instruction >> 12) == 0b0001 ? OP_ADD_IMM : OP_AND_IMM;
+                rec->imm = (int16_t) SEXT(instruction & 0x001F, 5);
+            } else
+                rec->op = (instruction >> 12) == 0b0001 ? OP_ADD_REG : OP_AND_REG;
+            break;
+
+        case 0b0000:    /* BR, nzp kept in dr as a mask */
+            rec->op = DR ? OP_BR : OP_NOP;
+            rec->imm = (int16_t) SEXT(instruction & 0x01FF, 9);
+            break;
+
+        case 0b1100:
+            rec->op = SR1 == 7 ? OP_RET : OP_JMP;
+            break;
+
+        case 0b0100:
+            if (instruction & 0x0800) {
+                rec->op = OP_JSR;
+                rec->imm = (int16_t) SEXT(instruction & 0x07FF, 11);
+            } else
+                rec->op = OP_JSRR;
+            break;
+
+        case 0b0010: rec->op = OP_LD;  rec->imm = (int16_t) SEXT(instruction & 0x01FF, 9); break;
+        case 0b1010: rec->op = OP_LDI; rec->imm = (int16_t) SEXT(instruction & 0x01FF, 9); break;
+        case 0b1110: rec->op = OP_LEA; rec->imm = (int16_t) SEXT(instruction & 0x01FF, 9); break;
+        case 0b0011: rec->op = OP_ST;  rec->imm = (int16_t) SEXT(instruction & 0x01FF, 9); break;
+        case 0b1011: rec->op = OP_STI; rec->imm = (int16_t) SEXT(instruction & 0x01FF, 9); break;
+        case 0b0110: rec->op = OP_LDR; rec->imm = (int16_t) SEXT(instruction & 0x003F, 6); break;
+        case 0b0111: rec->op = OP_STR; rec->imm = (int16_t) SEXT(instruction & 0x003F, 6); break;
+        case 0b1001: rec->op = OP_NOT; break;
+        case 0b1000: rec->op = OP_RTI; break;
+        case 0b1111: rec->op = OP_TRAP; rec->imm = instruction & 0x00FF; break;
+        default:     rec->op = OP_NOP; break;   /* 1101 is reserved */
+    }
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : disassemble                                     */
+/*                                                             */
+/* Purpose   : Write the assembly text of the instruction at   */
+/*             address into buffer (at least 32 bytes).        */
+/*                                                             */
+/***************************************************************/
+void disassemble(int address, int instruction, char *buffer) {
+    int next = Low16bits(address + 1);
+    Decoded d;
+
+    decodeInstruction(instruction, &d);
+    switch (d.op) {
+        case OP_ADD_REG: sprintf(buffer, "ADD R%d, R%d, R%d", d.dr, d.sr1, d.sr2); break;
+        case OP_ADD_IMM: sprintf(buffer, "ADD R%d, R%d, #%d", d.dr, d.sr1, d.imm); break;
+        case OP_AND_REG: sprintf(buffer, "AND R%d, R%d, R%d", d.dr, d.sr1, d.sr2); break;
+        case OP_AND_IMM: sprintf(buffer, "AND R%d, R%d, #%d", d.dr, d.sr1, d.imm); break;
+        case OP_NOT:     sprintf(buffer, "NOT R%d, R%d", d.dr, d.sr1); break;
+        case OP_BR:
+            sprintf(buffer, "BR%s%s%s x%.4X", d.dr & 4 ? "n" : "", d.dr & 2 ? "z" : "",
+                    d.dr & 1 ? "p" : "", Low16bits(next + d.imm));
+            break;
+        case OP_JMP:     sprintf(buffer, "JMP R%d", d.sr1); break;
+        case OP_RET:     sprintf(buffer, "RET"); break;
+        case OP_JSR:     sprintf(buffer, "JSR x%.4X", Low16bits(next + d.imm)); break;
+        case OP_JSRR:    sprintf(buffer, "JSRR R%d", d.sr1); break;
+        case OP_LD:      sprintf(buffer, "LD R%d, x%.4X", d.dr, Low16bits(next + d.imm)); break;
+        case OP_LDI:     sprintf(buffer, "LDI R%d, x%.4X", d.dr, Low16bits(next + d.imm)); break;
+        case OP_LDR:     sprintf(buffer, "LDR R%d, R%d, #%d", d.dr, d.sr1, d.imm); break;
+        case OP_LEA:     sprintf(buffer, "LEA R%d, x%.4X", d.dr, Low16bits(next + d.imm)); break;
+        case OP_ST:      sprintf(buffer, "ST R%d, x%.4X", d.dr, Low16bits(next + d.imm)); break;
+        case OP_STI:     sprintf(buffer, "STI R%d, x%.4X", d.dr, Low16bits(next + d.imm)); break;
+        case OP_STR:     sprintf(buffer, "STR R%d, R%d, #%d", d.dr, d.sr1, d.imm); break;
+        case OP_RTI:     sprintf(buffer, "RTI"); break;
+        case OP_TRAP:
+            if (d.imm >= TRAP_HOST_FIRST && d.imm <= TRAP_HOST_LAST)
+                sprintf(buffer, "%s", trap_names[d.imm - TRAP_HOST_FIRST]);
+            else
+                sprintf(buffer, "TRAP x%.2X", d.imm);
+            break;
+        default:
+            if ((instruction >> 12) == 0)
+                sprintf(buffer, "NOP");
+            else
+                sprintf(buffer, ".FILL x%.4X", instruction);
+            break;
+    }
+}
+
+/*
+  Follow a JSR/JSRR/RET at pc in the shadow call stack.  now is
+  INSTRUCTION_COUNT including this instruction, so a call is
+  charged to the caller and a return to the callee.
+*/
+static void profileCall(LC3_VM *vm, int pc, const Decoded *rec, long long now) {
+    Profile *prof = vm->PROFILE;
+    int target, node;
+
+    profileSettle(prof, now);
+    if (rec->op == OP_RET) {
+        if (prof->LOST_DEPTH > 0)
+            prof->LOST_DEPTH--;
+        else if (prof->DEPTH > 1)
+            prof->DEPTH--;
+        return;
+    }
+    if (prof->DEPTH == PROFILE_DEPTH) {
+        prof->LOST_DEPTH++;
+        return;
+    }
+    if (rec->op == OP_JSR)
+        target = Low16bits(pc + 1 + rec->imm);
+    else
+        target = vm->CURRENT_LATCHES.REGS[rec->sr1];
+    node = profileNode(prof, prof->STACK[prof->DEPTH - 1], target);
+    prof->NODES[node].calls++;
+    prof->STACK[prof->DEPTH++] = node;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Execution trace (--trace file, --trace-dump file).          */
+/*                                                             */
+/***************************************************************/
+/*
+  While a trace is open every record is routed through the engine's
+  TRACE label, which calls traceStep before the instruction runs;
+  its record is written by traceFinish once it has run (at the next
+  instruction or when the engine returns).  The file is a header
+  (TRACE_MAGIC, start PC, registers, nzp and INSTRUCTION_COUNT)
+  followed by one record per instruction:
+
+    tag                 bits 6-4 nzp after the instruction, and
+                          0x01 PC follows (it was not predicted)
+                          0x02 word follows (first run at this PC,
+                               or the word changed)
+                          0x04 changed registers follow
+                          0x08 a memory access follows
+                          0x80 special record, kind byte follows
+    [pc]                2 bytes, little endian
+    [word]              2 bytes
+    [mask, deltas]      a bit per register, then each new value as
+                        a zigzag varint of new - old
+    [address, value]    zigzag varint of address - last address,
+                        then the 2-byte value loaded or stored
+
+  The PC is predicted as the next word, or the target of a JSR or
+  a BR that the nzp says is taken.  Special records carry register
+  changes made outside any instruction (interrupts) and skipped
+  idle loop turns.  Encoder and decoder keep the same shadow state,
+  so a loop mostly costs 1-3 bytes per instruction.
+
+  The engine fills TRACE_CHUNK-byte chunks of a ring; the writer
+  thread writes full ones out, so the simulation only waits when
+  all TRACE_CHUNKS are queued.  A name ending in .gz is written
+  through gzip.
+*/
+#define TRACE_MAGIC     "LC3T"
+#define TRACE_VERSION   1
+#define TRACE_CHUNK     65536
+#define TRACE_CHUNKS    32
+#define TRACE_RECORD    32      /* largest record in bytes */
+#define TRACE_HEADER    32
+
+#define TRACE_PC        0x01
+#define TRACE_WORD      0x02
+#define TRACE_REGS      0x04
+#define TRACE_MEMORY    0x08
+#define TRACE_SPECIAL   0x80
+#define TRACE_SYNC      1       /* special: mask, deltas and pc */
+#define TRACE_SKIP      2       /* special: varint turns, head pc, length */
+
+typedef struct Trace_Struct {
+    FILE *file;
+    int piped;                  /* file is a gzip pipe */
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t filled, drained;
+    unsigned char *chunks[TRACE_CHUNKS];
+    size_t lengths[TRACE_CHUNKS];
+    unsigned head, tail;        /* free-running chunk numbers */
+    int closing;
+    unsigned char *out;         /* write position in chunk head */
+    unsigned char *end;         /* last position with TRACE_RECORD bytes of room */
+
+    /* Shadow state, as the decoder will have it */
+    int WORDS[WORDS_IN_MEM];    /* last word traced at each PC, -1 for none */
+    uint16_t REGS[LC_3_REGS];
+    int NZP, NEXT_PC, LAST_ADDRESS;
+
+    /* The instruction in flight */
+    int PENDING, PC, WORD, ADDRESS, VALUE_REG;
+} Trace;
+
+/* nzp bits of a CC value (n = 4, z = 2, p = 1) */
+#define NZP(value)      CCMASK(value)
+
+static void *traceWriter(void *arg) {
+    Trace *t = arg;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        unsigned char *chunk;
+        size_t length;
+
+        while (t->tail == t->head && !t->closing)
+            pthread_cond_wait(&t->filled, &t->lock);
+        if (t->tail == t->head)
+            break;
+        chunk = t->chunks[t->tail % TRACE_CHUNKS];
+        length = t->lengths[t->tail % TRACE_CHUNKS];
+        pthread_mutex_unlock(&t->lock);
+        fwrite(chunk, 1, length, t->file);
+        pthread_mutex_lock(&t->lock);
+        t->tail++;
+        pthread_cond_signal(&t->drained);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+/* Queue the chunk being filled and move on to the next free one */
+static void traceHandOff(Trace *t) {
+    unsigned char *chunk = t->chunks[t->head % TRACE_CHUNKS];
+
+    pthread_mutex_lock(&t->lock);
+    t->lengths[t->head % TRACE_CHUNKS] = t->out - chunk;
+    t->head++;
+    pthread_cond_signal(&t->filled);
+    while (t->head - t->tail == TRACE_CHUNKS)
+        pthread_cond_wait(&t->drained, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+    t->out = t->chunks[t->head % TRACE_CHUNKS];
+    t->end = t->out + TRACE_CHUNK - TRACE_RECORD;
+}
+
+static inline unsigned char *putWord(unsigned char *p, int value) {
+    *p++ = value & 0xFF;
+    *p++ = (value >> 8) & 0xFF;
+    return p;
+}
+
+/* Zigzag varint of the 16-bit difference new - old */
+static inline unsigned char *putDelta(unsigned char *p, int new_value, int old_value) {
+    int16_t d = (int16_t) Low16bits(new_value - old_value);
+    unsigned z = (uint16_t) ((d << 1) ^ (d >> 15));
+
+    while (z >= 0x80) {
+        *p++ = (z & 0x7F) | 0x80;
+        z >>= 7;
+    }
+    *p++ = z;
+    return p;
+}
+
+/* Register changes against the shadow: mask byte, then one delta each */
+static unsigned char *putRegisters(Trace *t, unsigned char *p, const uint16_t *R, int mask) {
+    int r;
+
+    *p++ = mask;
+    for (r = 0; r < LC_3_REGS; r++)
+        if (mask & (1 << r)) {
+            p = putDelta(p, R[r], t->REGS[r]);
+            t->REGS[r] = R[r];
+        }
+    return p;
+}
+
+static int changedRegisters(Trace *t, const uint16_t *R) {
+    int r, mask = 0;
+
+    for (r = 0; r < LC_3_REGS; r++)
+        if (R[r] != t->REGS[r])
+            mask |= 1 << r;
+    return mask;
+}
+
+/* Where the decoder will expect the next instruction after word at pc */
+static int traceNextPC(int pc, int word, int nzp) {
+    Decoded d;
+
+    decodeInstruction(word, &d);
+    if ((d.op == OP_BR && (d.dr & nzp)) || d.op == OP_JSR)
+        return Low16bits(pc + 1 + d.imm);
+    return Low16bits(pc + 1);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : traceOpen                                       */
+/*                                                             */
+/* Purpose   : Start tracing vm into filename, from its        */
+/*             current state.  Returns FALSE on failure.       */
+/*                                                             */
+/***************************************************************/
+int traceOpen(LC3_VM *vm, char *filename) {
+    Trace *t = calloc(1, sizeof(Trace));
+    size_t length = strlen(filename);
+    unsigned char header[TRACE_HEADER], *p = header;
+    int i;
+
+    if (t == NULL)
+        return FALSE;
+    if (length > 3 && strcmp(filename + length - 3, ".gz") == 0 && strchr(filename, '\'') == NULL) {
+        char command[FILENAME_MAX + 32];
+
+        snprintf(command, sizeof(command), "gzip -c > '%s'", filename);
+        t->file = popen(command, "w");
+        t->piped = TRUE;
+    } else
+        t->file = fopen(filename, "wb");
+    for (i = 0; i < TRACE_CHUNKS; i++)
+        if ((t->chunks[i] = malloc(TRACE_CHUNK)) == NULL)
+            break;
+    if (t->file == NULL || i < TRACE_CHUNKS) {
+        if (t->file != NULL)
+            t->piped ? pclose(t->file) : fclose(t->file);
+        while (i-- > 0)
+            free(t->chunks[i]);
+        free(t);
+        return FALSE;
+    }
+
+    for (i = 0; i < WORDS_IN_MEM; i++)
+        t->WORDS[i] = -1;
+    memcpy(t->REGS, vm->CURRENT_LATCHES.REGS, sizeof(t->REGS));
+    t->NZP = NZP(vm->CURRENT_LATCHES.CC);
+    t->NEXT_PC = vm->CURRENT_LATCHES.PC;
+
+    memcpy(p, TRACE_MAGIC, 4);
+    p += 4;
+    *p++ = TRACE_VERSION;
+    *p++ = t->NZP;
+    p = putWord(p, t->NEXT_PC);
+    for (i = 0; i < LC_3_REGS; i++)
+        p = putWord(p, t->REGS[i]);
+    for (i = 0; i < 8; i++)
+        *p++ = ((unsigned long long) vm->INSTRUCTION_COUNT >> (8 * i)) & 0xFF;
+    fwrite(header, 1, p - header, t->file);
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->filled, NULL);
+    pthread_cond_init(&t->drained, NULL);
+    t->out = t->chunks[0];
+    t->end = t->out + TRACE_CHUNK - TRACE_RECORD;
+    if (pthread_create(&t->writer, NULL, traceWriter, t) != 0) {
+        t->piped ? pclose(t->file) : fclose(t->file);
+        for (i = 0; i < TRACE_CHUNKS; i++)
+            free(t->chunks[i]);
+        free(t);
+        return FALSE;
+    }
+    vm->TRACE = t;
+    redecodeAll(vm);
+    return TRUE;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : traceClose                                      */
+/*                                                             */
+/* Purpose   : Write out what is queued and stop the writer.   */
+/*                                                             */
+/***************************************************************/
+void traceClose(LC3_VM *vm) {
+    Trace *t = vm->TRACE;
+    int i;
+
+    if (t == NULL)
+        return;
+    vm->TRACE = NULL;
+    redecodeAll(vm);
+    traceHandOff(t);
+    pthread_mutex_lock(&t->lock);
+    t->closing = TRUE;
+    pthread_cond_signal(&t->filled);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->writer, NULL);
+    t->piped ? pclose(t->file) : fclose(t->file);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->filled);
+    pthread_cond_destroy(&t->drained);
+    for (i = 0; i < TRACE_CHUNKS; i++)
+        free(t->chunks[i]);
+    free(t);
+}
+
+/* Emit the record of the instruction in flight, now that it has run */
+static void traceFinish(LC3_VM *vm) {
+    Trace *t = vm->TRACE;
+    const uint16_t *R = vm->CURRENT_LATCHES.REGS;
+    unsigned char *p, *tag;
+    int mask, nzp_before = t->NZP;
+
+    if (!t->PENDING)
+        return;
+    t->PENDING = FALSE;
+    p = t->out;
+    tag = p++;
+    t->NZP = NZP(vm->CURRENT_LATCHES.CC);
+    *tag = t->NZP << 4;
+    if (t->PC != t->NEXT_PC) {
+        *tag |= TRACE_PC;
+        p = putWord(p, t->PC);
+    }
+    if (t->WORDS[t->PC] != t->WORD) {
+        *tag |= TRACE_WORD;
+        p = putWord(p, t->WORD);
+        t->WORDS[t->PC] = t->WORD;
+    }
+    if ((mask = changedRegisters(t, R)) != 0) {
+        *tag |= TRACE_REGS;
+        p = putRegisters(t, p, R, mask);
+    }
+    if (t->ADDRESS >= 0) {
+        *tag |= TRACE_MEMORY;
+        p = putDelta(p, t->ADDRESS, t->LAST_ADDRESS);
+        p = putWord(p, R[t->VALUE_REG]);
+        t->LAST_ADDRESS = t->ADDRESS;
+    }
+    t->NEXT_PC = traceNextPC(t->PC, t->WORD, nzp_before);
+    t->out = p;
+    if (p > t->end)
+        traceHandOff(t);
+}
+
+/* Before the instruction rec at pc runs: finish the last one and note this one */
+static void traceStep(LC3_VM *vm, int pc, const Decoded *rec) {
+    Trace *t = vm->TRACE;
+    const uint16_t *R = vm->CURRENT_LATCHES.REGS;
+    int next = Low16bits(pc + 1);
+
+    traceFinish(vm);
+    t->PENDING = TRUE;
+    t->PC = pc;
+    t->WORD = Low16bits(vm->MEMORY[pc]);
+    t->VALUE_REG = rec->dr;
+    switch (rec->op) {
+        case OP_LD:
+        case OP_ST:  t->ADDRESS = Low16bits(next + rec->imm); break;
+        case OP_LDR:
+        case OP_STR: t->ADDRESS = Low16bits(R[rec->sr1] + rec->imm); break;
+        case OP_LDI:
+        case OP_STI: t->ADDRESS = vm->MEMORY[Low16bits(next + rec->imm)]; break;
+        default:     t->ADDRESS = -1; break;
+    }
+}
+
+/* Registers or nzp changed between instructions (an interrupt): say so */
+static void traceSync(LC3_VM *vm) {
+    Trace *t = vm->TRACE;
+    const uint16_t *R = vm->CURRENT_LATCHES.REGS;
+    int mask = changedRegisters(t, R), nzp = NZP(vm->CURRENT_LATCHES.CC);
+    unsigned char *p = t->out;
+
+    if (mask == 0 && nzp == t->NZP)
+        return;
+    *p++ = TRACE_SPECIAL | (nzp << 4);
+    *p++ = TRACE_SYNC;
+    p = putRegisters(t, p, R, mask);
+    p = putWord(p, vm->CURRENT_LATCHES.PC);
+    t->NZP = nzp;
+    t->NEXT_PC = vm->CURRENT_LATCHES.PC;
+    t->out = p;
+    if (p > t->end)
+        traceHandOff(t);
+}
+
+/* turns iterations of the length-instruction idle loop at head were skipped */
+static void traceSkip(LC3_VM *vm, int head, int length, uint64_t turns) {
+    Trace *t = vm->TRACE;
+    unsigned char *p = t->out;
+
+    *p++ = TRACE_SPECIAL | (t->NZP << 4);
+    *p++ = TRACE_SKIP;
+    while (turns >= 0x80) {
+        *p++ = (turns & 0x7F) | 0x80;
+        turns >>= 7;
+    }
+    *p++ = turns;
+    p = putWord(p, head);
+    *p++ = length;
+    t->out = p;
+    if (p > t->end)
+        traceHandOff(t);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : traceDump                                       */
+/*                                                             */
+/* Purpose   : Print a trace file as text, one instruction per */
+/*             line.  Returns the exit status.                 */
+/*                                                             */
+/***************************************************************/
+static int getWord(FILE *in) {
+    int low = getc(in), high = getc(in);
+
+    return high == EOF ? -1 : low | (high << 8);
+}
+
+static long long getVarint(FILE *in) {
+    long long value = 0;
+    int shift = 0, c;
+
+    do {
+        if ((c = getc(in)) == EOF || shift > 56)
+            return -1;
+        value |= (long long) (c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return value;
+}
+
+static int getDelta(FILE *in, int old_value) {
+    long long z = getVarint(in);
+
+    if (z < 0)
+        return -1;
+    return Low16bits(old_value + (int) ((z >> 1) ^ -(z & 1)));
+}
+
+/* Read a mask and register deltas into R, adding them to effects; FALSE at a bad file */
+static int dumpRegisters(FILE *in, uint16_t *R, int dr, char *effects) {
+    int mask = getc(in), r, value;
+
+    if (mask == EOF)
+        return FALSE;
+    for (r = 0; r < LC_3_REGS; r++) {
+        if (!(mask & (1 << r)))
+            continue;
+        if ((value = getDelta(in, R[r])) < 0)
+            return FALSE;
+        R[r] = value;
+        if (r != dr)
+            sprintf(effects + strlen(effects), " R%d=x%.4X", r, value);
+    }
+    return TRUE;
+}
+
+int traceDump(char *filename) {
+    static int words[WORDS_IN_MEM];
+    size_t length = strlen(filename);
+    unsigned char header[TRACE_HEADER];
+    uint16_t R[LC_3_REGS];
+    unsigned long long count = 0;
+    int piped = FALSE, nzp, next_pc, last_address = 0, tag, i, ok = TRUE;
+    FILE *in;
+
+    if (length > 3 && strcmp(filename + length - 3, ".gz") == 0 && strchr(filename, '\'') == NULL) {
+        char command[FILENAME_MAX + 32];
+
+        snprintf(command, sizeof(command), "gzip -dc '%s'", filename);
+        in = popen(command, "r");
+        piped = TRUE;
+    } else
+        in = fopen(filename, "rb");
+    if (in == NULL) {
+        printf("Error: Can't open trace file %s\n", filename);
+        return 1;
+    }
+    if (fread(header, 1, TRACE_HEADER, in) != TRACE_HEADER || memcmp(header, TRACE_MAGIC, 4) != 0 || header[4] != TRACE_VERSION) {
+        printf("Error: %s is not a trace file\n", filename);
+        piped ? pclose(in) : fclose(in);
+        return 1;
+    }
+    nzp = header[5];
+    next_pc = header[6] | (header[7] << 8);
+    for (i = 0; i < LC_3_REGS; i++)
+        R[i] = header[8 + 2 * i] | (header[9 + 2 * i] << 8);
+    for (i = 7; i >= 0; i--)
+        count = (count << 8) | header[24 + i];
+    for (i = 0; i < WORDS_IN_MEM; i++)
+        words[i] = -1;
+
+    printf("%-12s %-6s %-6s %-22s %s\n", "count", "PC", "word", "instruction", "effects");
+    while ((tag = getc(in)) != EOF) {
+        int pc = next_pc, word, dr = -1, nzp_before = nzp;
+        char text[32], effects[160] = "";
+        Decoded d;
+
+        nzp = (tag >> 4) & 7;
+        if (tag & TRACE_SPECIAL) {
+            int kind = getc(in), head, loop_length;
+            long long turns;
+
+            if (kind == TRACE_SYNC) {
+                if (!(ok = dumpRegisters(in, R, -1, effects)) || (next_pc = getWord(in)) < 0)
+                    break;
+                printf("%-12s (between instructions)%s nzp=%c%c%c PC=x%.4X\n", "-", effects,
+                       nzp & 4 ? 'n' : '-', nzp & 2 ? 'z' : '-', nzp & 1 ? 'p' : '-', next_pc);
+            } else if (kind == TRACE_SKIP) {
+                if ((turns = getVarint(in)) < 0 || (head = getWord(in)) < 0 || (loop_length = getc(in)) == EOF) {
+                    ok = FALSE;
+                    break;
+                }
+                printf("%-12llu (idle loop at x%.4X: %lld turns of %d instructions skipped)\n",
+                       count, head, turns, loop_length);
+                count += turns * loop_length;
+            } else {
+                ok = FALSE;
+                break;
+            }
+            continue;
+        }
 
-    /* Read in the program. */
-    if (fscanf(prog, "%x\n", &word) != EOF)
-        program_base = word ;
-    else {
-        printf("Error: Program file is empty\n");
-        exit(-1);
+        if ((tag & TRACE_PC) && (pc = getWord(in)) < 0)
+            break;
+        if (tag & TRACE_WORD) {
+            if ((word = getWord(in)) < 0)
+                break;
+            words[pc] = word;
+        }
+        if ((word = words[pc]) < 0) {
+            ok = FALSE;
+            break;
+        }
+        decodeInstruction(word, &d);
+        switch (d.op) {
+            case OP_ADD_REG: case OP_ADD_IMM: case OP_AND_REG: case OP_AND_IMM:
+            case OP_NOT: case OP_LD: case OP_LDI: case OP_LDR: case OP_LEA:
+                dr = d.dr;
+                break;
+        }
+        if ((tag & TRACE_REGS) && !(ok = dumpRegisters(in, R, dr, effects)))
+            break;
+        if (dr >= 0)
+            sprintf(effects + strlen(effects), " R%d=x%.4X", dr, R[dr]);
+        if (tag & TRACE_MEMORY) {
+            int value;
+
+            if ((last_address = getDelta(in, last_address)) < 0 || (value = getWord(in)) < 0) {
+                ok = FALSE;
+                break;
+            }
+            sprintf(effects + strlen(effects), " %s x%.4X=x%.4X",
+                    d.op == OP_ST || d.op == OP_STI || d.op == OP_STR ? "store" : "load", last_address, value);
+        }
+        if (nzp != nzp_before)
+            sprintf(effects + strlen(effects), " nzp=%c%c%c",
+                    nzp & 4 ? 'n' : '-', nzp & 2 ? 'z' : '-', nzp & 1 ? 'p' : '-');
+        disassemble(pc, word, text);
+        if (effects[0] != '\0')
+            printf("%-12llu x%.4X  x%.4X  %-22s%s\n", count, pc, word, text, effects);
+        else
+            printf("%-12llu x%.4X  x%.4X  %s\n", count, pc, word, text);
+        next_pc = traceNextPC(pc, word, nzp_before);
+        count++;
+    }
+    if (tag != EOF)
+        ok = FALSE;
+    piped ? pclose(in) : fclose(in);
+    if (!ok) {
+        printf("Error: %s is cut short or corrupt\n", filename);
+        return 1;
     }
+    return 0;
+}
 
-    ii = 0;
-    while (fscanf(prog, "%x\n", &word) != EOF) {
-        /* Make sure it fits. */
-        if (program_base + ii >= WORDS_IN_MEM) {
-            printf("Error: Program file %s is too long to fit in memory. %x\n",
-                   program_filename, ii);
-            exit(-1);
+/***************************************************************/
+/*                                                             */
+/* Breakpoints and watchpoints (break, watch, delete).         */
+/*                                                             */
+/***************************************************************/
+/* Handler of a page with a watched word: note the hit, then access it as before */
+static int watchAccess(LC3_VM *vm, int address, int value, int is_write) {
+    Debug *d = vm->DEBUG;
+    Page_Handler handler = d->HANDLER[address >> PAGE_SHIFT];
+    int kind = is_write ? DEBUG_WRITE : DEBUG_READ;
+    int i;
+
+    if (d->FLAGS[address] & kind) {
+        if (d->SEARCHING)
+            d->FOUND = d->NOW;
+        else if (!d->STOPPED) {
+            for (i = 0; i < d->NUM_POINTS; i++)
+                if ((d->POINTS[i].flags & kind) && address >= d->POINTS[i].low && address <= d->POINTS[i].high)
+                    break;
+            d->STOPPED = kind;
+            d->HIT_ADDRESS = address;
+            d->HIT_POINT = d->POINTS[i].number;
+            d->HIT_VALUE = is_write ? value : handler != NULL ? -1 : vm->MEMORY[address];
         }
+    }
+    if (handler != NULL) {
+        value = handler(vm, address, value, is_write);
+        if (!is_write && d->HIT_VALUE < 0 && d->HIT_ADDRESS == address)
+            d->HIT_VALUE = Low16bits(value);
+        return value;
+    }
+    if (!is_write)
+        return loadWord(vm->MEMORY, address);
+    if (vm->HISTORY != NULL)
+        historyStore(vm, address);
+    storeWord(vm->MEMORY, address, value);
+    invalidateDecoded(vm, address);
+    markCodeWrite(vm, address);
+    markDirty(vm, address);
+    markShared(vm, address);
+    return 0;
+}
 
-        /* Write the word to memory array. */
-        MEMORY[program_base + ii] = word;
-        ii++;
+/* Redo FLAGS and the watched pages' handlers after POINTS changed; drop DEBUG when empty */
+static void debugRebuild(LC3_VM *vm) {
+    Debug *d = vm->DEBUG;
+    int i, address, page;
+
+    for (page = 0; page < PAGES; page++)
+        if (vm->PAGE_HANDLER[page] == watchAccess)
+            vm->PAGE_HANDLER[page] = d->HANDLER[page];
+    memset(d->FLAGS, 0, sizeof(d->FLAGS));
+    d->NUM_WATCHES = 0;
+    for (i = 0; i < d->NUM_POINTS; i++) {
+        Debug_Point *p = &d->POINTS[i];
+
+        for (address = p->low; address <= p->high; address++)
+            d->FLAGS[address] |= p->flags;
+        d->NUM_WATCHES += p->flags != DEBUG_BREAK;
+    }
+    for (page = 0; page < PAGES; page++)
+        for (address = page << PAGE_SHIFT; address < (page + 1) << PAGE_SHIFT; address++)
+            if (d->FLAGS[address] & (DEBUG_READ | DEBUG_WRITE)) {
+                d->HANDLER[page] = vm->PAGE_HANDLER[page];
+                vm->PAGE_HANDLER[page] = watchAccess;
+                break;
+            }
+    if (d->NUM_POINTS == 0) {
+        free(d);
+        vm->DEBUG = NULL;
     }
+    /* reroute every record through the DEBUG label, or back */
+    redecodeAll(vm);
+}
 
-    if (CURRENT_LATCHES.PC == 0) CURRENT_LATCHES.PC = program_base;
+/* Add a breakpoint (DEBUG_BREAK) or watchpoint on low..high; returns its number, or -1 if full */
+int debugAdd(LC3_VM *vm, int low, int high, int flags) {
+    Debug *d = vm->DEBUG;
+    Debug_Point *p;
 
-    printf("Read %d words from program into memory.\n\n", ii);
+    if (d == NULL) {
+        if ((d = vm->DEBUG = calloc(1, sizeof(Debug))) == NULL) {
+            printf("Error: Out of memory\n");
+            exit(-1);
+        }
+        d->NEXT_NUMBER = 1;
+        d->RESUME = -1;
+    }
+    if (d->NUM_POINTS == DEBUG_POINTS)
+        return -1;
+    p = &d->POINTS[d->NUM_POINTS++];
+    p->number = d->NEXT_NUMBER++;
+    p->low = low;
+    p->high = high;
+    p->flags = flags;
+    debugRebuild(vm);
+    return p->number;
 }
 
-/************************************************************/
-/*                                                          */
-/* Procedure : initialize                                   */
-/*                                                          */
-/* Purpose   : Load machine language program                */
-/*             and set up initial state of the machine.     */
-/*                                                          */
-/************************************************************/
-void initialize(char *program_filename, int num_prog_files) {
+/* Delete point number, or all of them for 0; FALSE if there is no such point */
+int debugDelete(LC3_VM *vm, int number) {
+    Debug *d = vm->DEBUG;
+    int i, kept = 0;
+
+    if (d == NULL)
+        return FALSE;
+    for (i = 0; i < d->NUM_POINTS; i++)
+        if (number != 0 && d->POINTS[i].number != number)
+            d->POINTS[kept++] = d->POINTS[i];
+    if (kept == d->NUM_POINTS)
+        return FALSE;
+    d->NUM_POINTS = kept;
+    debugRebuild(vm);
+    return TRUE;
+}
+
+void debugList(LC3_VM *vm) {
+    Debug *d = vm->DEBUG;
     int i;
 
-    initMemory();
-    for ( i = 0; i < num_prog_files; i++ ) {
-        loadProgram(program_filename);
-        while(*program_filename++ != '\0');
+    if (d == NULL) {
+        printf("No breakpoints or watchpoints\n\n");
+        return;
+    }
+    for (i = 0; i < d->NUM_POINTS; i++) {
+        Debug_Point *p = &d->POINTS[i];
+
+        if (p->flags == DEBUG_BREAK)
+            printf("%-3d break  x%04X\n", p->number, p->low);
+        else
+            printf("%-3d watch  x%04X-x%04X %s\n", p->number, p->low, p->high,
+                   p->flags == DEBUG_READ ? "r" : p->flags == DEBUG_WRITE ? "w" : "rw");
+    }
+    printf("\n");
+}
+
+/*
+  Called by the engine before the instruction at pc, number now, runs
+  if it is at a breakpoint or anything is watched.  TRUE stops the
+  run in front of it.  The instruction a run starts at is never
+  stopped at, so a run can go on from a breakpoint.
+*/
+static int debugCheck(LC3_VM *vm, int pc, long long now) {
+    Debug *d = vm->DEBUG;
+    int resume = d->RESUME;
+
+    if (d->SEARCHING) {
+        d->NOW = now;
+        if (d->FLAGS[pc] & DEBUG_BREAK)
+            d->FOUND = now;
+        return FALSE;
     }
-    CURRENT_LATCHES.Z = 1;
-    NEXT_LATCHES = CURRENT_LATCHES;
+    if (d->STOPPED)         /* the last instruction made a watched access */
+        return TRUE;
+    d->RESUME = -1;
+    if (!(d->FLAGS[pc] & DEBUG_BREAK) || pc == resume)
+        return FALSE;
+    d->STOPPED = DEBUG_BREAK;
+    d->HIT_ADDRESS = pc;
+    return TRUE;
+}
+
+/* Before go/run/continue: forget the last stop, and run past a breakpoint at the PC */
+void debugResume(LC3_VM *vm) {
+    if (vm->DEBUG == NULL)
+        return;
+    vm->DEBUG->STOPPED = 0;
+    vm->DEBUG->RESUME = vm->CURRENT_LATCHES.PC;
+}
+
+/* If the run stopped at a breakpoint or watchpoint, say which and return TRUE */
+int debugReport(LC3_VM *vm) {
+    Debug *d = vm->DEBUG;
+    int i;
 
-    RUN_BIT = TRUE;
+    if (d == NULL || !d->STOPPED)
+        return FALSE;
+    if (d->STOPPED == DEBUG_BREAK) {
+        for (i = 0; i < d->NUM_POINTS; i++)
+            if (d->POINTS[i].flags == DEBUG_BREAK && d->POINTS[i].low == d->HIT_ADDRESS)
+                break;
+        printf("\nBreakpoint %d at x%04X\n", i < d->NUM_POINTS ? d->POINTS[i].number : 0, d->HIT_ADDRESS);
+    } else
+        printf("\nWatchpoint %d: %s x%04X %s x%04X\n", d->HIT_POINT,
+               d->STOPPED == DEBUG_WRITE ? "wrote" : "read", Low16bits(d->HIT_VALUE),
+               d->STOPPED == DEBUG_WRITE ? "to" : "from", d->HIT_ADDRESS);
+    d->STOPPED = 0;
+    return TRUE;
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : main                                            */
+/* Execution history (history, rstep, rcontinue, rwrite).      */
 /*                                                             */
 /***************************************************************/
-int main(int argc, char *argv[]) {
-    FILE * dumpsim_file;
+/*
+  Undo records are appended to the newest checkpoint's UNDO buffer
+  and can be read from either end:
+
+    length              1 byte, of the whole record
+    mask                3 bytes: bits 0-20 the fields that changed,
+                        bits 21-23 the number of stores
+    delta               varint, instructions the record spans (1, more
+                        after an idle sleep, 0 for device work done
+                        before the first instruction after a replay)
+    [address, old]      2 + 2 bytes per store, in store order
+    [old]               2 bytes per changed field
+    length              1 byte again
+
+  A record opens when its instruction starts and takes in everything
+  up to the next one, so what an interrupt changed is undone along
+  with the instruction before it.  Each record starts at the count
+  the one before it ended at.
+
+  A checkpoint's page copies hold each page as it was at the
+  checkpoint, so memory is taken back to checkpoint j by copying in
+  the pages of every checkpoint from the newest one (not past the
+  present) down to j.
+*/
+#define PAGE_BYTES      (PAGE_WORDS * sizeof(uint16_t))
 
-    /* Error Checking */
-    if (argc < 2) {
-        printf("Error: usage: %s <program_file_1> <program_file_2> ...\n",
-               argv[0]);
-        exit(1);
+static void *historyAlloc(void *block, size_t size) {
+    if ((block = realloc(block, size)) == NULL) {
+        printf("Error: Out of memory\n");
+        exit(-1);
     }
+    return block;
+}
 
-    printf("LC-3 Simulator\n\n");
+static void historyCapture(LC3_VM *vm, int pc, uint16_t *state) {
+    memcpy(state, vm->CURRENT_LATCHES.REGS, LC_3_REGS * sizeof(uint16_t));
+    state[H_PC] = pc;
+    state[H_CC] = vm->CURRENT_LATCHES.CC;
+    state[H_PSR] = vm->CURRENT_LATCHES.PSR;
+    state[H_TOP] = vm->top_p;
+    state[H_SSP] = vm->SAVED_SSP;
+    state[H_USP] = vm->SAVED_USP;
+    state[H_KBSR] = vm->KBSR;
+    state[H_KBDR] = vm->KBDR;
+    state[H_DSR] = vm->DSR;
+    state[H_TMR] = vm->TMR;
+    state[H_TMI] = vm->TMI;
+    state[H_MCR] = vm->MCR;
+    state[H_EOF] = vm->INPUT_EOF;
+}
 
-    initialize(argv[1], argc - 1);
+static void historyApply(LC3_VM *vm, const uint16_t *state) {
+    memcpy(vm->CURRENT_LATCHES.REGS, state, LC_3_REGS * sizeof(uint16_t));
+    vm->CURRENT_LATCHES.PC = state[H_PC];
+    vm->CURRENT_LATCHES.CC = state[H_CC];
+    vm->CURRENT_LATCHES.PSR = state[H_PSR];
+    vm->top_p = state[H_TOP];
+    vm->SAVED_SSP = state[H_SSP];
+    vm->SAVED_USP = state[H_USP];
+    vm->KBSR = state[H_KBSR];
+    vm->KBDR = state[H_KBDR];
+    vm->DSR = state[H_DSR];
+    vm->TMR = state[H_TMR];
+    vm->TMI = state[H_TMI];
+    vm->MCR = state[H_MCR];
+    vm->INPUT_EOF = state[H_EOF];
+    vm->IDLE_ARMED = FALSE;
+    devicesChanged(vm);
+}
 
-    if ( (dumpsim_file = fopen( "dumpsim", "w" )) == NULL ) {
-        printf("Error: Can't open dumpsim file\n");
-        exit(-1);
+/* Put a word back, dropping its decoded record only if it changes */
+static void historyPoke(LC3_VM *vm, int address, int value) {
+    if (vm->MEMORY[address] == value)
+        return;
+    vm->MEMORY[address] = value;
+    invalidateDecoded(vm, address);
+    markCodeWrite(vm, address);
+}
+
+static size_t historyBytes(History *h) {
+    size_t bytes = h->NUM_CHECKPOINTS * sizeof(Checkpoint) + h->MAX_EVENTS * sizeof(History_Event);
+    int j;
+
+    for (j = 0; j < h->NUM_CHECKPOINTS; j++)
+        bytes += h->CHECKPOINTS[j].UNDO_SIZE + h->CHECKPOINTS[j].NUM_PAGES * PAGE_BYTES;
+    return bytes;
+}
+
+static void historyFreeCheckpoint(Checkpoint *c) {
+    int page;
+
+    for (page = 0; page < PAGES; page++)
+        free(c->SAVED[page]);
+    free(c->UNDO);
+}
+
+/* Over budget: drop the oldest undo records, then the oldest checkpoints */
+static void historyTrim(History *h) {
+    size_t bytes = historyBytes(h);
+    int j, drop = 0, events = 0;
+
+    for (j = 0; j < h->NUM_CHECKPOINTS - 1 && bytes > h->BUDGET; j++)
+        if (h->CHECKPOINTS[j].UNDO != NULL) {
+            bytes -= h->CHECKPOINTS[j].UNDO_SIZE;
+            free(h->CHECKPOINTS[j].UNDO);
+            h->CHECKPOINTS[j].UNDO = NULL;
+            h->CHECKPOINTS[j].UNDO_LENGTH = h->CHECKPOINTS[j].UNDO_SIZE = 0;
+        }
+    while (drop < h->NUM_CHECKPOINTS - 1 && bytes > h->BUDGET) {
+        bytes -= sizeof(Checkpoint) + h->CHECKPOINTS[drop].NUM_PAGES * PAGE_BYTES;
+        historyFreeCheckpoint(&h->CHECKPOINTS[drop++]);
     }
+    if (drop == 0)
+        return;
+    h->NUM_CHECKPOINTS -= drop;
+    memmove(h->CHECKPOINTS, h->CHECKPOINTS + drop, h->NUM_CHECKPOINTS * sizeof(Checkpoint));
+    while (events < h->NUM_EVENTS && h->EVENTS[events].COUNT < h->CHECKPOINTS[0].COUNT)
+        events++;
+    h->NUM_EVENTS -= events;
+    memmove(h->EVENTS, h->EVENTS + events, h->NUM_EVENTS * sizeof(History_Event));
+    h->UNDO_VALID = FALSE;
+}
 
-    while (1)
-        getCommand(dumpsim_file);
+static void historyCheckpoint(LC3_VM *vm, int pc, long long now) {
+    History *h = vm->HISTORY;
+    Checkpoint *c;
 
+    if (h->NUM_CHECKPOINTS == h->MAX_CHECKPOINTS) {
+        h->MAX_CHECKPOINTS = h->MAX_CHECKPOINTS ? 2 * h->MAX_CHECKPOINTS : 16;
+        h->CHECKPOINTS = historyAlloc(h->CHECKPOINTS, h->MAX_CHECKPOINTS * sizeof(Checkpoint));
+    }
+    c = &h->CHECKPOINTS[h->NUM_CHECKPOINTS++];
+    memset(c, 0, sizeof(Checkpoint));
+    c->COUNT = now;
+    historyCapture(vm, pc, c->STATE);
+    c->UNDO_SIZE = 4096;
+    c->UNDO = historyAlloc(NULL, c->UNDO_SIZE);
+    h->NEXT_CHECKPOINT = now + HISTORY_INTERVAL;
+    historyTrim(h);
 }
 
-int Instruction;
+static History_Event *historyEvent(History *h, int kind, long long count) {
+    History_Event *e;
 
-/* System stack: 0x2F00 - 0x2FFF */ 
+    if (h->NUM_EVENTS == h->MAX_EVENTS) {
+        h->MAX_EVENTS = h->MAX_EVENTS ? 2 * h->MAX_EVENTS : 64;
+        h->EVENTS = historyAlloc(h->EVENTS, h->MAX_EVENTS * sizeof(History_Event));
+    }
+    e = &h->EVENTS[h->NUM_EVENTS++];
+    memset(e, 0, sizeof(History_Event));
+    e->COUNT = count;
+    e->KIND = kind;
+    return e;
+}
 
-int top_p = 0x2FFF;
+/* Start an undo record for the machine at instruction now, PC pc */
+static void historyBegin(LC3_VM *vm, int pc, long long now) {
+    History *h = vm->HISTORY;
 
-int isEmpty() {
-    return top_p == 0x2FFF;
+    h->PENDING = TRUE;
+    h->FROM = now;
+    h->NUM_STORES = 0;
+    historyCapture(vm, pc, h->BEFORE);
 }
 
-int POP () {
-    top_p += 1;
-    if (top_p > 0x2FFF) {
-        printf("Error: system stack segmentation fault");
-        return -1;
-    } 
-    return MEMORY[top_p - 1];
+/* Close the undo record in progress; the machine is now at instruction now, PC pc */
+static void historyFinish(LC3_VM *vm, int pc, long long now) {
+    History *h = vm->HISTORY;
+    Checkpoint *c = &h->CHECKPOINTS[h->NUM_CHECKPOINTS - 1];
+    uint16_t after[HISTORY_FIELDS];
+    unsigned char record[HISTORY_RECORD], *p = record + 4;
+    unsigned long long delta = now - h->FROM;
+    int mask = 0, length, f, i;
+
+    h->PENDING = FALSE;
+    historyCapture(vm, pc, after);
+    while (delta >= 0x80) {
+        *p++ = (delta & 0x7F) | 0x80;
+        delta >>= 7;
+    }
+    *p++ = delta;
+    for (i = 0; i < h->NUM_STORES; i++) {
+        p = putWord(p, h->ADDRESS[i]);
+        p = putWord(p, h->OLD[i]);
+    }
+    for (f = 0; f < HISTORY_FIELDS; f++)
+        if (after[f] != h->BEFORE[f]) {
+            mask |= 1 << f;
+            p = putWord(p, h->BEFORE[f]);
+        }
+    if (mask == 0 && h->NUM_STORES == 0 && now == h->FROM)
+        return;
+    mask |= h->NUM_STORES << 21;
+    length = p - record + 1;
+    record[0] = *p = length;
+    record[1] = mask & 0xFF;
+    record[2] = (mask >> 8) & 0xFF;
+    record[3] = mask >> 16;
+
+    if (c->UNDO_LENGTH + length > c->UNDO_SIZE) {
+        c->UNDO_SIZE *= 2;
+        c->UNDO = historyAlloc(c->UNDO, c->UNDO_SIZE);
+    }
+    memcpy(c->UNDO + c->UNDO_LENGTH, record, length);
+    c->UNDO_LENGTH += length;
 }
 
-int PUSH(int value) {
-    top_p -= 1;
-    if (top_p <= 0x2F00) {
-        printf("Error: system stack overflow\n");
-        return -1;
+/* Before instruction now at pc runs: close the last record and open one for it */
+static void historyStep(LC3_VM *vm, int pc, long long now) {
+    History *h = vm->HISTORY;
+
+    h->RUNNING = TRUE;
+    h->NOW = now;
+    if (h->REPLAYING)
+        return;
+    if (h->PENDING)
+        historyFinish(vm, pc, now);
+    if (now >= h->NEXT_CHECKPOINT)
+        historyCheckpoint(vm, pc, now);
+    historyBegin(vm, pc, now);
+}
+
+/* Before a store to address: keep the old word, and its page if it is the first since the checkpoint */
+void historyStore(LC3_VM *vm, int address) {
+    History *h = vm->HISTORY;
+    Checkpoint *c = &h->CHECKPOINTS[h->NUM_CHECKPOINTS - 1];
+    int page = address >> PAGE_SHIFT;
+
+    if (address == h->WATCH)
+        h->WATCHED = h->RUNNING ? h->NOW : vm->INSTRUCTION_COUNT - 1;
+    if (h->REPLAYING || !h->PENDING)
+        return;
+    if (c->SAVED[page] == NULL) {
+        c->SAVED[page] = historyAlloc(NULL, PAGE_BYTES);
+        memcpy(c->SAVED[page], vm->MEMORY + (page << PAGE_SHIFT), PAGE_BYTES);
+        c->NUM_PAGES++;
+    }
+    /* never more than three: one store and the two words an interrupt pushes */
+    if (h->NUM_STORES < HISTORY_STORES) {
+        h->ADDRESS[h->NUM_STORES] = address;
+        h->OLD[h->NUM_STORES++] = vm->MEMORY[address];
     }
-    MEMORY[top_p] = value;
-    return 0;
 }
 
-int SetCC (int value);  /* Update condition code */
-int SEXT (int num, int length);  /* Sign extension */
+/*
+  A key (HISTORY_KEY) or timer tick (HISTORY_TIMER) that arrived
+  during an instruction.  Live, it is logged and key is passed back;
+  replaying, the logged one is returned once it is due, else NO_KEY.
+  Anything that arrives between instructions is in a HISTORY_BETWEEN
+  event instead.
+*/
+static int historyKey(LC3_VM *vm, int kind, int key) {
+    History *h = vm->HISTORY;
+    History_Event *e = h->CURSOR < h->NUM_EVENTS ? &h->EVENTS[h->CURSOR] : NULL;
+
+    if (h->REPLAYING) {
+        if (!h->RUNNING || e == NULL || e->KIND != kind || e->COUNT > h->NOW)
+            return NO_KEY;
+        h->CURSOR++;
+        return e->KEY;
+    }
+    if (h->RUNNING && h->PENDING && key != NO_KEY)
+        historyEvent(h, kind, h->NOW)->KEY = key;
+    return key;
+}
 
-int ADD (int instruction);  /* 0001 */
-int AND (int instruction);  /* 0101 */
-int BR (int instruction);   /* 0000 */
-int JMP (int instruction);  /* 1100 */
-int JSR (int instruction);  /* 0100 */
-int JSRR (int instruction); /* 0100 */
-int LD (int instruction);   /* 0010 */
-int LDI (int instruction);  /* 1010 */
-int LDR (int instruction);  /* 0110 */
-int LEA (int instruction);  /* 1110 */
-int NOT (int instruction);  /* 1001 */
-// RET has same opcode with JMP
-int RTI (int instruction);  /* 1000 */ /* FLAWED */
-int ST (int instruction);   /* 0011 */
-int STI (int instruction);  /* 1011 */
-int STR (int instruction);  /* 0111 */
-int TRAP (int instruction); /* 1111 */
-
-void printASCII (int asc) {
-    // reset_terminal_mode();
-    if (asc == 13) {
-        printf("\r\n");
-    } else {
-        printf("%c", asc, asc);
+/*
+  Around the device work executeInstructions does between two
+  instructions (starting, then not): whatever it changed is logged as
+  one HISTORY_BETWEEN event, so a replay redoes it without asking the
+  devices or the clock again.
+*/
+static void historyBetween(LC3_VM *vm, int starting) {
+    History *h = vm->HISTORY;
+    uint16_t after[HISTORY_FIELDS];
+    History_Event *e;
+    int i;
+
+    if (!h->PENDING)
+        return;
+    if (starting) {
+        historyCapture(vm, vm->CURRENT_LATCHES.PC, h->BETWEEN_STATE);
+        h->BETWEEN_COUNT = vm->INSTRUCTION_COUNT;
+        h->BETWEEN_STORES = h->NUM_STORES;
+        return;
+    }
+    historyCapture(vm, vm->CURRENT_LATCHES.PC, after);
+    if (memcmp(after, h->BETWEEN_STATE, sizeof(after)) == 0 && h->NUM_STORES == h->BETWEEN_STORES &&
+        vm->INSTRUCTION_COUNT == h->BETWEEN_COUNT)
+        return;
+    e = historyEvent(h, HISTORY_BETWEEN, h->BETWEEN_COUNT);
+    e->SKIPPED = vm->INSTRUCTION_COUNT - h->BETWEEN_COUNT;
+    memcpy(e->STATE, after, sizeof(after));
+    for (i = h->BETWEEN_STORES; i < h->NUM_STORES; i++) {
+        e->ADDRESS[e->NUM_STORES] = h->ADDRESS[i];
+        e->VALUE[e->NUM_STORES++] = vm->MEMORY[h->ADDRESS[i]];
     }
-    fflush(stdout);
 }
 
-int getMemory (int address) {
-    if (address == 0xFE04) { // DSR
-        return 0x0000;
-    } else if (address >= 0xFD00 || address < 0x3000) {
-        printf("\nWarning: attempt to read address %x\n", address);
-        return MEMORY[address];
-    } else {
-        return MEMORY[address];
+/* First event not yet part of the machine at instruction count */
+static int historyCursor(History *h, long long count) {
+    int low = 0, high = h->NUM_EVENTS;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+        History_Event *e = &h->EVENTS[middle];
+
+        if (e->COUNT < count || (e->COUNT == count && e->KIND == HISTORY_BETWEEN))
+            low = middle + 1;
+        else
+            high = middle;
     }
+    return low;
 }
 
-void setMemory (int address, int value) {
-    if (address == 0xFE06) { // DDR
-        printASCII(value);
-    } else if (address >= 0xFD00 || address < 0x3000) {
-        printf("\nWarning: attempt to write to address %x\n", address);
-        MEMORY[address] = value;
-    } else {
-        MEMORY[address] = value;
+/* Redo the device work logged before the next instruction */
+static void historyRedo(LC3_VM *vm) {
+    History *h = vm->HISTORY;
+    int i;
+
+    while (h->CURSOR < h->NUM_EVENTS) {
+        History_Event *e = &h->EVENTS[h->CURSOR];
+
+        if (e->COUNT > vm->INSTRUCTION_COUNT ||
+            (e->COUNT == vm->INSTRUCTION_COUNT && e->KIND != HISTORY_BETWEEN))
+            return;
+        h->CURSOR++;
+        if (e->KIND != HISTORY_BETWEEN)
+            continue;
+        for (i = 0; i < e->NUM_STORES; i++) {
+            historyPoke(vm, e->ADDRESS[i], e->VALUE[i]);
+            if (e->ADDRESS[i] == h->WATCH)
+                h->WATCHED = e->COUNT - 1;
+        }
+        historyApply(vm, e->STATE);
+        vm->INSTRUCTION_COUNT += e->SKIPPED;
     }
 }
 
-void processInstruction() {
+/*
+  Run up to num_instructions recorded instructions again, and no
+  further than the end of the history, where recording picks up
+  again.  With before_skip an idle sleep that would carry past the
+  end of the run is not replayed: the run stops before the
+  instruction that led into it.  Returns the instructions counted.
+*/
+static int historyReplay(LC3_VM *vm, int num_instructions, int before_skip) {
+    History *h = vm->HISTORY;
+    long long start = vm->INSTRUCTION_COUNT, stop = start + num_instructions;
+    FILE *output = vm->output;
+
+    if (stop > h->END)
+        stop = h->END;
+    consoleFlush(vm);
+    consoleLock(vm);
+    vm->output = NULL;      /* it was printed the first time */
+    consoleUnlock(vm);
+    h->REPLAYING = TRUE;
+    h->UNDO_VALID = FALSE;
+    h->CURSOR = historyCursor(h, start);
+    for (;;) {
+        long long next = stop;
+        int i;
+
+        historyRedo(vm);
+        if (vm->INSTRUCTION_COUNT >= stop || vm->CURRENT_LATCHES.PC == 0x0000)
+            break;
+        for (i = h->CURSOR; i < h->NUM_EVENTS; i++) {
+            History_Event *e = &h->EVENTS[i];
+
+            if (e->KIND != HISTORY_BETWEEN)
+                continue;
+            if (before_skip && e->COUNT + e->SKIPPED > stop && e->COUNT <= stop)
+                next = stop = e->COUNT - 1;
+            else if (e->COUNT < next)
+                next = e->COUNT;
+            break;
+        }
+        if (next <= vm->INSTRUCTION_COUNT)
+            break;
+        vm->ATTENTION = FALSE;
+        interpretInstructions(vm, (int) (next - vm->INSTRUCTION_COUNT), FALSE);
+        if (vm->DEBUG != NULL && vm->DEBUG->STOPPED)
+            break;
+    }
+    consoleFlush(vm);
+    consoleLock(vm);
+    vm->output = output;
+    consoleUnlock(vm);
+    h->REPLAYING = FALSE;
+    if (vm->INSTRUCTION_COUNT >= h->END)
+        historyBegin(vm, vm->CURRENT_LATCHES.PC, vm->INSTRUCTION_COUNT);
+    return (int) (vm->INSTRUCTION_COUNT - start);
+}
 
-    Instruction = getMemory(CURRENT_LATCHES.PC);
-    CURRENT_LATCHES.PC += 1;
-    Instruction = Low16bits(Instruction);
-    
-    int operation = Instruction & 0xF000;  /* Instruction[15:12] */
-    operation = operation >> 12;
+/* Stop recording at the present, so the machine can be taken back */
+static void historyPause(LC3_VM *vm) {
+    History *h = vm->HISTORY;
 
-    /* Execute */
-    switch (operation) {
-        case 0b0001:    /* 0001 */
-            ADD(Instruction);
+    if (!h->PENDING)
+        return;
+    historyFinish(vm, vm->CURRENT_LATCHES.PC, vm->INSTRUCTION_COUNT);
+    h->END = vm->INSTRUCTION_COUNT;
+    h->UNDO_VALID = TRUE;
+    h->UNDO_CHECKPOINT = h->NUM_CHECKPOINTS - 1;
+    h->UNDO_OFFSET = h->CHECKPOINTS[h->UNDO_CHECKPOINT].UNDO_LENGTH;
+}
+
+static long long recordDelta(const unsigned char *record, const unsigned char **fields) {
+    const unsigned char *p = record + 4;
+    long long delta = 0;
+    int shift = 0;
+
+    do {
+        delta |= (long long) (*p & 0x7F) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    *fields = p;
+    return delta;
+}
+
+/* Find the undo record the machine is at; FALSE if it was dropped */
+static int historyLocate(LC3_VM *vm) {
+    History *h = vm->HISTORY;
+    const unsigned char *fields;
+    Checkpoint *c;
+    long long count;
+    size_t offset = 0;
+    int j;
+
+    if (h->UNDO_VALID)
+        return TRUE;
+    for (j = h->NUM_CHECKPOINTS - 1; j > 0 && h->CHECKPOINTS[j].COUNT > vm->INSTRUCTION_COUNT; j--)
+        ;
+    c = &h->CHECKPOINTS[j];
+    if (c->UNDO == NULL)
+        return FALSE;
+    for (count = c->COUNT; offset < c->UNDO_LENGTH; offset += c->UNDO[offset]) {
+        long long delta = recordDelta(c->UNDO + offset, &fields);
+
+        if (count + delta > vm->INSTRUCTION_COUNT)
             break;
+        count += delta;
+    }
+    if (count != vm->INSTRUCTION_COUNT)
+        return FALSE;
+    h->UNDO_VALID = TRUE;
+    h->UNDO_CHECKPOINT = j;
+    h->UNDO_OFFSET = offset;
+    return TRUE;
+}
 
-        case 0b0101:    /* 0101 */
-            AND(Instruction);
+/* The undo record before checkpoint *j, byte *offset, moving them back to it; NULL at the start */
+static unsigned char *historyPrevious(History *h, int *j, size_t *offset) {
+    Checkpoint *c;
+
+    while (*offset == 0) {
+        if (*j == 0 || h->CHECKPOINTS[*j - 1].UNDO == NULL)
+            return NULL;
+        *offset = h->CHECKPOINTS[--*j].UNDO_LENGTH;
+    }
+    c = &h->CHECKPOINTS[*j];
+    *offset -= c->UNDO[*offset - 1];
+    return c->UNDO + *offset;
+}
+
+/* Take the machine back over one undo record; FALSE if there is none */
+static int historyUndo(LC3_VM *vm) {
+    History *h = vm->HISTORY;
+    uint16_t state[HISTORY_FIELDS];
+    unsigned char *record = historyPrevious(h, &h->UNDO_CHECKPOINT, &h->UNDO_OFFSET);
+    const unsigned char *p;
+    long long delta;
+    int mask, stores, f, i;
+
+    if (record == NULL)
+        return FALSE;
+    mask = record[1] | (record[2] << 8) | (record[3] << 16);
+    stores = mask >> 21;
+    delta = recordDelta(record, &p);
+    historyCapture(vm, vm->CURRENT_LATCHES.PC, state);
+    for (f = 0; f < HISTORY_FIELDS; f++)
+        if (mask & (1 << f)) {
+            const unsigned char *old = p + 4 * stores + 2 * __builtin_popcount(mask & ((1 << f) - 1));
+
+            state[f] = old[0] | (old[1] << 8);
+        }
+    for (i = stores - 1; i >= 0; i--)
+        historyPoke(vm, p[4 * i] | (p[4 * i + 1] << 8), p[4 * i + 2] | (p[4 * i + 3] << 8));
+    historyApply(vm, state);
+    vm->INSTRUCTION_COUNT -= delta;
+    return TRUE;
+}
+
+/* Put the machine back to checkpoint j */
+static void historyRestore(LC3_VM *vm, int j) {
+    History *h = vm->HISTORY;
+    int k, page, i;
+
+    for (k = h->NUM_CHECKPOINTS - 1; k > j && h->CHECKPOINTS[k].COUNT > vm->INSTRUCTION_COUNT; k--)
+        ;
+    for (; k >= j; k--)
+        for (page = 0; page < PAGES; page++)
+            if (h->CHECKPOINTS[k].SAVED[page] != NULL)
+                for (i = 0; i < PAGE_WORDS; i++)
+                    historyPoke(vm, (page << PAGE_SHIFT) + i, h->CHECKPOINTS[k].SAVED[page][i]);
+    historyApply(vm, h->CHECKPOINTS[j].STATE);
+    vm->INSTRUCTION_COUNT = h->CHECKPOINTS[j].COUNT;
+    h->UNDO_VALID = h->CHECKPOINTS[j].UNDO != NULL;
+    h->UNDO_CHECKPOINT = j;
+    h->UNDO_OFFSET = 0;
+}
+
+/*
+  Replay from wherever the machine is up to target (or just short of
+  it).  Breakpoints and watchpoints only note where they would have
+  stopped.
+*/
+static void historyForward(LC3_VM *vm, long long target) {
+    Debug *d = vm->DEBUG;
+    int searching = d != NULL && d->SEARCHING;
+
+    if (d != NULL)
+        d->SEARCHING = TRUE;
+    while (vm->INSTRUCTION_COUNT < target && vm->CURRENT_LATCHES.PC != 0x0000) {
+        long long left = target - vm->INSTRUCTION_COUNT;
+
+        if (historyReplay(vm, left > INT_MAX ? INT_MAX : (int) left, TRUE) == 0)
             break;
+    }
+    if (d != NULL)
+        d->SEARCHING = searching;
+}
 
-        case 0b0000:    /* 0000 */
-            BR(Instruction);
+/***************************************************************/
+/*                                                             */
+/* Procedure : historySeek                                     */
+/*                                                             */
+/* Purpose   : Take the machine to instruction target, or the  */
+/*             closest point before it the history can reach.  */
+/*             Close enough, undo records are popped; further  */
+/*             back, the checkpoint before target is restored  */
+/*             and replayed forward.                           */
+/*                                                             */
+/***************************************************************/
+void historySeek(LC3_VM *vm, long long target) {
+    History *h = vm->HISTORY;
+    int j;
+
+    historyPause(vm);
+    if (target < h->CHECKPOINTS[0].COUNT)
+        target = h->CHECKPOINTS[0].COUNT;
+    if (target > h->END)
+        target = h->END;
+    if (target < vm->INSTRUCTION_COUNT) {
+        if (vm->INSTRUCTION_COUNT - target <= HISTORY_INTERVAL && historyLocate(vm))
+            while (vm->INSTRUCTION_COUNT > target && historyUndo(vm))
+                ;
+        if (vm->INSTRUCTION_COUNT > target) {
+            for (j = h->NUM_CHECKPOINTS - 1; j > 0 && h->CHECKPOINTS[j].COUNT > target; j--)
+                ;
+            historyRestore(vm, j);
+        }
+    }
+    historyForward(vm, target);
+    vm->RUN_BIT = vm->CURRENT_LATCHES.PC != 0x0000;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : historyLastWrite                                */
+/*                                                             */
+/* Purpose   : Go back to the last instruction that stored to  */
+/*             address and return its count, or return -1 and  */
+/*             stay put if the history holds no such store.    */
+/*                                                             */
+/***************************************************************/
+long long historyLastWrite(LC3_VM *vm, int address) {
+    History *h = vm->HISTORY;
+    long long now, count;
+    unsigned char *record;
+    const unsigned char *p;
+    size_t offset;
+    int j, i, oldest;
+
+    historyPause(vm);
+    now = vm->INSTRUCTION_COUNT;
+
+    /* Recent stores are in the undo records */
+    for (j = h->NUM_CHECKPOINTS - 1; j > 0 && h->CHECKPOINTS[j].COUNT > now; j--)
+        ;
+    oldest = j + 1;
+    if (historyLocate(vm)) {
+        j = h->UNDO_CHECKPOINT;
+        offset = h->UNDO_OFFSET;
+        count = now;
+        while ((record = historyPrevious(h, &j, &offset)) != NULL) {
+            int stores = record[3] >> 5;
+
+            count -= recordDelta(record, &p);
+            for (i = stores - 1; i >= 0; i--)
+                if ((p[4 * i] | (p[4 * i + 1] << 8)) == address) {
+                    historySeek(vm, count);
+                    return count;
+                }
+        }
+        oldest = j;
+    }
+
+    /* Before that, replay each interval whose checkpoint kept the page */
+    h->WATCH = address;
+    for (j = oldest - 1; j >= 0; j--) {
+        long long end = j + 1 < h->NUM_CHECKPOINTS && h->CHECKPOINTS[j + 1].COUNT < now ?
+                        h->CHECKPOINTS[j + 1].COUNT : now;
+
+        if (h->CHECKPOINTS[j].SAVED[address >> PAGE_SHIFT] == NULL)
+            continue;
+        h->WATCHED = -1;
+        historyRestore(vm, j);
+        historyForward(vm, end);
+        if (h->WATCHED >= 0)
+            break;
+    }
+    h->WATCH = -1;
+    count = j >= 0 ? h->WATCHED : -1;
+    if (vm->INSTRUCTION_COUNT != (count >= 0 ? count : now))
+        historySeek(vm, count >= 0 ? count : now);
+    return count;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : historyLastStop                                 */
+/*                                                             */
+/* Purpose   : Go back to the last place a breakpoint or       */
+/*             watchpoint would have stopped the run, and      */
+/*             return its count.  With none in the history,    */
+/*             go back to its start and return -1.             */
+/*                                                             */
+/***************************************************************/
+long long historyLastStop(LC3_VM *vm) {
+    History *h = vm->HISTORY;
+    Debug *d = vm->DEBUG;
+    long long now, found = -1;
+    int j;
+
+    historyPause(vm);
+    now = vm->INSTRUCTION_COUNT;
+    if (d != NULL) {
+        /* Replay each interval, newest first, noting the last stop in it */
+        for (j = h->NUM_CHECKPOINTS - 1; j > 0 && h->CHECKPOINTS[j].COUNT >= now; j--)
+            ;
+        for (; j >= 0 && found < 0; j--) {
+            long long end = j + 1 < h->NUM_CHECKPOINTS && h->CHECKPOINTS[j + 1].COUNT < now ?
+                            h->CHECKPOINTS[j + 1].COUNT : now;
+
+            d->FOUND = -1;
+            historyRestore(vm, j);
+            historyForward(vm, end);
+            found = d->FOUND;
+        }
+    }
+    historySeek(vm, found >= 0 ? found : 0);
+    return found;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : historyStart / historyStop                      */
+/*                                                             */
+/* Purpose   : Start recording from here, keeping up to        */
+/*             megabytes of history, or drop the history.      */
+/*             Either way every cached record is decoded again */
+/*             so it is routed through the recorder or not.    */
+/*                                                             */
+/***************************************************************/
+void historyStop(LC3_VM *vm) {
+    History *h = vm->HISTORY;
+    int j;
+
+    if (h == NULL)
+        return;
+    for (j = 0; j < h->NUM_CHECKPOINTS; j++)
+        historyFreeCheckpoint(&h->CHECKPOINTS[j]);
+    free(h->CHECKPOINTS);
+    free(h->EVENTS);
+    free(h);
+    vm->HISTORY = NULL;
+    redecodeAll(vm);
+}
+
+void historyStart(LC3_VM *vm, int megabytes) {
+    History *h;
+
+    historyStop(vm);
+    h = historyAlloc(NULL, sizeof(History));
+    memset(h, 0, sizeof(History));
+    h->BUDGET = (size_t) megabytes << 20;
+    h->WATCH = -1;
+    h->END = vm->INSTRUCTION_COUNT;
+    vm->HISTORY = h;
+    historyCheckpoint(vm, vm->CURRENT_LATCHES.PC, vm->INSTRUCTION_COUNT);
+    historyBegin(vm, vm->CURRENT_LATCHES.PC, vm->INSTRUCTION_COUNT);
+    redecodeAll(vm);
+}
+
+void historyReport(LC3_VM *vm) {
+    History *h = vm->HISTORY;
+    int j, undone = 0;
+
+    if (h == NULL) {
+        printf("History is off\n\n");
+        return;
+    }
+    historyPause(vm);
+    for (j = 0; j < h->NUM_CHECKPOINTS; j++)
+        undone += h->CHECKPOINTS[j].UNDO == NULL;
+    printf("History from instruction %lld to %lld, now at %lld\n",
+           h->CHECKPOINTS[0].COUNT, h->END, vm->INSTRUCTION_COUNT);
+    printf("%d checkpoints (%d without undo records), %d events, %.1f of %zu MB\n\n",
+           h->NUM_CHECKPOINTS, undone, h->NUM_EVENTS, historyBytes(h) / 1048576.0, h->BUDGET >> 20);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : interpretInstructions                           */
+/*                                                             */
+/* Purpose   : Execute up to num_instructions instructions     */
+/*             from the predecoded cache, stopping early when  */
+/*             the PC reaches 0x0000 or, if stop_at_branch is  */
+/*             set, after the first control transfer.  Returns */
+/*             the number of instructions retired;             */
+/*             INSTRUCTION_COUNT is updated accordingly.       */
+/*                                                             */
+/***************************************************************/
+/*
+  With GCC/Clang every record carries the address of its handler
+  label and the handlers jump straight to each other (direct
+  threading); other compilers fall back to a switch on rec->op.
+  Only words on plain RAM pages are cached: fetching elsewhere goes
+  through getMemory on every execution so page handlers still see it.
+  Address 0x0000 is never cached either, so reaching it always
+  lands in the decode handler, which is where the halt check lives.
+*/
+#if defined(__GNUC__) && !defined(LC3SIM_SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+/* Count times executions of rec at pc, before it runs */
+static inline void profileCount(LC3_VM *vm, int pc, const Decoded *rec, uint64_t times) {
+    Profile *prof = vm->PROFILE;
+    uint16_t *R = vm->CURRENT_LATCHES.REGS;
+    int next = Low16bits(pc + 1);
+
+    prof->EXECUTED[pc] += times;
+    prof->OPS[rec->op] += times;
+    switch (rec->op) {
+        case OP_BR:
+            if (rec->dr & CCMASK(vm->CURRENT_LATCHES.CC))
+                prof->TAKEN[pc] += times;
             break;
+        case OP_TRAP:
+            prof->TRAPS[rec->imm] += times;
+            break;
+        case OP_LD:
+            prof->LOADS[Low16bits(next + rec->imm) >> PAGE_SHIFT] += times;
+            break;
+        case OP_LDR:
+            prof->LOADS[Low16bits(R[rec->sr1] + rec->imm) >> PAGE_SHIFT] += times;
+            break;
+        case OP_ST:
+            prof->STORES[Low16bits(next + rec->imm) >> PAGE_SHIFT] += times;
+            break;
+        case OP_STR:
+            prof->STORES[Low16bits(R[rec->sr1] + rec->imm) >> PAGE_SHIFT] += times;
+            break;
+        case OP_LDI:
+        case OP_STI:
+            /* the pointer, then what it points to */
+            prof->LOADS[Low16bits(next + rec->imm) >> PAGE_SHIFT] += times;
+            if (rec->op == OP_LDI)
+                prof->LOADS[vm->MEMORY[Low16bits(next + rec->imm)] >> PAGE_SHIFT] += times;
+            else
+                prof->STORES[vm->MEMORY[Low16bits(next + rec->imm)] >> PAGE_SHIFT] += times;
+            break;
+    }
+}
+
+int interpretInstructions(LC3_VM *vm, int num_instructions, int stop_at_branch) {
+#ifdef THREADED_DISPATCH
+    static const void *const handlers[OP_COUNT] = {
+        &&TARGET_OP_DECODE, &&TARGET_OP_ADD_REG, &&TARGET_OP_ADD_IMM,
+        &&TARGET_OP_AND_REG, &&TARGET_OP_AND_IMM, &&TARGET_OP_NOT,
+        &&TARGET_OP_BR, &&TARGET_OP_JMP, &&TARGET_OP_RET, &&TARGET_OP_JSR,
+        &&TARGET_OP_JSRR, &&TARGET_OP_LD, &&TARGET_OP_LDI, &&TARGET_OP_LDR,
+        &&TARGET_OP_LEA, &&TARGET_OP_ST, &&TARGET_OP_STI, &&TARGET_OP_STR,
+        &&TARGET_OP_RTI, &&TARGET_OP_TRAP, &&TARGET_OP_NOP
+    };
+    static const void *const debug_entry = &&DEBUG;
+    static const void *const history_entry = &&HISTORY;
+    static const void *const trace_entry = &&TRACE;
+    /* Where records go while profiling: the common cases are counted inline */
+    static const void *const profilers[OP_COUNT] = {
+        &&PROFILE, &&PROFILE_PLAIN, &&PROFILE_PLAIN, &&PROFILE_PLAIN,
+        &&PROFILE_PLAIN, &&PROFILE_PLAIN, &&PROFILE_BR, &&PROFILE_PLAIN,
+        &&PROFILE_CALL, &&PROFILE_CALL, &&PROFILE_CALL, &&PROFILE,
+        &&PROFILE, &&PROFILE, &&PROFILE_PLAIN, &&PROFILE, &&PROFILE,
+        &&PROFILE, &&PROFILE_PLAIN, &&PROFILE, &&PROFILE_PLAIN
+    };
+#define TARGET(op)      TARGET_##op:
+#define JUMP()          goto *rec->handler
+#define JUMP_TO(op)     goto *handlers[op]
+#else
+#define TARGET(op)      case op:
+#define JUMP()          goto dispatch
+#define JUMP_TO(op)     goto dispatch
+#endif
+
+/* Count the next instruction and jump to its handler */
+#define DISPATCH() do {                                 \
+        if (count == num_instructions) goto leave;      \
+        count++;                                        \
+        rec = &vm->DECODED[pc];                         \
+        JUMP();                                         \
+    } while (0)
+
+/* Same, but end the run here when the caller wants one block
+   or a device wants attention */
+#define DISPATCH_BRANCH() do {                          \
+        if (stop_at_branch || vm->ATTENTION) goto leave;\
+        DISPATCH();                                     \
+    } while (0)
+
+/* After a load or store: a device register may have stopped the
+   machine, or the access faulted */
+#define DISPATCH_ACCESS() do {                          \
+        if (vm->ATTENTION) goto leave;                  \
+        DISPATCH();                                     \
+    } while (0)
+
+/* Hand the PC back to the C helpers and pick it up again */
+#define CALL_OUT(expr) do {                             \
+        vm->CURRENT_LATCHES.PC = pc;                    \
+        expr;                                           \
+        pc = vm->CURRENT_LATCHES.PC;                    \
+    } while (0)
+
+    Decoded *rec, scratch;
+    uint16_t *R;
+    int pc;
+    int count = 0;
+
+    /* vmCreate calls in once without a VM just to publish this */
+#ifdef THREADED_DISPATCH
+    if (DECODE_ENTRY == NULL)
+        DECODE_ENTRY = handlers[OP_DECODE];
+#endif
+    if (vm == NULL)
+        return 0;
+    R = vm->CURRENT_LATCHES.REGS;
+    pc = vm->CURRENT_LATCHES.PC;
+    if (vm->TRACE != NULL)
+        traceSync(vm);
+
+    DISPATCH();
+
+#ifndef THREADED_DISPATCH
+dispatch:
+    if (vm->DEBUG != NULL && rec->op != OP_DECODE &&
+        debugCheck(vm, pc, vm->INSTRUCTION_COUNT + count - 1)) {
+        count--;
+        goto leave;
+    }
+    if (vm->HISTORY != NULL && rec->op != OP_DECODE)
+        historyStep(vm, pc, vm->INSTRUCTION_COUNT + count - 1);
+    if (vm->TRACE != NULL && rec->op != OP_DECODE)
+        traceStep(vm, pc, rec);
+    if (vm->PROFILING && rec->op != OP_DECODE) {
+        if (rec->op == OP_JSR || rec->op == OP_JSRR || rec->op == OP_RET)
+            profileCall(vm, pc, rec, vm->INSTRUCTION_COUNT + count);
+        profileCount(vm, pc, rec, 1);
+    }
+    switch (rec->op) {
+#endif
+
+    TARGET(OP_DECODE) {
+        int instruction;
+
+        if (pc == 0x0000) {     /* HALTed (or jumped to 0) */
+            count--;
+            goto leave;
+        }
+        if (unlikely(vm->CORES != NULL))    /* before the fetch, so a store from another core after it drops rec */
+            coresFetch(vm, pc);
+        vm->ACCESS_PC = pc;
+        instruction = Low16bits(getMemory(vm, pc));
+        if (vm->ACV_PENDING)    /* the fetch itself faulted */
+            goto leave;
+        if (vm->PAGE_HANDLER[pc >> PAGE_SHIFT] != NULL)
+            rec = &scratch;
+        decodeInstruction(instruction, rec);
+#ifdef THREADED_DISPATCH
+        if (rec != &scratch)
+            rec->handler = vm->DEBUG != NULL && (vm->DEBUG->NUM_WATCHES || (vm->DEBUG->FLAGS[pc] & DEBUG_BREAK)) ?
+                           debug_entry :
+                           vm->HISTORY != NULL ? history_entry :
+                           vm->TRACE != NULL ? trace_entry :
+                           vm->PROFILING ? profilers[rec->op] : handlers[rec->op];
+        if (vm->DEBUG != NULL)
+            goto DEBUG;
+        if (vm->HISTORY != NULL)
+            goto HISTORY;
+        if (vm->TRACE != NULL)
+            goto TRACE;
+        if (vm->PROFILING)
+            goto *profilers[rec->op];
+#endif
+        JUMP_TO(rec->op);
+    }
+
+#ifdef THREADED_DISPATCH
+    /* ... or here at a breakpoint or while watching, then while recording history, then tracing */
+DEBUG:
+    if (debugCheck(vm, pc, vm->INSTRUCTION_COUNT + count - 1)) {
+        count--;
+        goto leave;
+    }
+    if (vm->HISTORY != NULL)
+        goto HISTORY;
+    if (vm->TRACE != NULL)
+        goto TRACE;
+    if (vm->PROFILING)
+        goto *profilers[rec->op];
+    JUMP_TO(rec->op);
+
+HISTORY:
+    historyStep(vm, pc, vm->INSTRUCTION_COUNT + count - 1);
+    if (vm->TRACE != NULL)
+        goto TRACE;
+    if (vm->PROFILING)
+        goto *profilers[rec->op];
+    JUMP_TO(rec->op);
+
+TRACE:
+    traceStep(vm, pc, rec);
+    if (vm->PROFILING)
+        goto *profilers[rec->op];
+    JUMP_TO(rec->op);
+
+    /* Records point here instead of at their handler while profiling */
+PROFILE_PLAIN:
+    vm->PROFILE->EXECUTED[pc]++;
+    vm->PROFILE->OPS[rec->op]++;
+    JUMP_TO(rec->op);
+
+PROFILE_BR:
+    vm->PROFILE->EXECUTED[pc]++;
+    vm->PROFILE->OPS[OP_BR]++;
+    vm->PROFILE->TAKEN[pc] += (rec->dr & CCMASK(vm->CURRENT_LATCHES.CC)) != 0;
+    JUMP_TO(OP_BR);
+
+PROFILE_CALL:
+    profileCall(vm, pc, rec, vm->INSTRUCTION_COUNT + count);
+    /* fall through */
+PROFILE:
+    profileCount(vm, pc, rec, 1);
+    JUMP_TO(rec->op);
+#endif
+
+    TARGET(OP_ADD_REG)
+        R[rec->dr] = Low16bits(R[rec->sr1] + R[rec->sr2]);
+        vm->CURRENT_LATCHES.CC = R[rec->dr];
+        pc = Low16bits(pc + 1);
+        DISPATCH();
+
+    TARGET(OP_ADD_IMM)
+        R[rec->dr] = Low16bits(R[rec->sr1] + rec->imm);
+        vm->CURRENT_LATCHES.CC = R[rec->dr];
+        pc = Low16bits(pc + 1);
+        DISPATCH();
+
+    TARGET(OP_AND_REG)
+        R[rec->dr] = Low16bits(R[rec->sr1] & R[rec->sr2]);
+        vm->CURRENT_LATCHES.CC = R[rec->dr];
+        pc = Low16bits(pc + 1);
+        DISPATCH();
+
+    TARGET(OP_AND_IMM)
+        R[rec->dr] = Low16bits(R[rec->sr1] & rec->imm);
+        vm->CURRENT_LATCHES.CC = R[rec->dr];
+        pc = Low16bits(pc + 1);
+        DISPATCH();
+
+    TARGET(OP_NOT)
+        R[rec->dr] = Low16bits(~R[rec->sr1]);
+        vm->CURRENT_LATCHES.CC = R[rec->dr];
+        pc = Low16bits(pc + 1);
+        DISPATCH();
+
+    TARGET(OP_BR)
+        pc = Low16bits(pc + 1);
+        if (rec->dr & CCMASK(vm->CURRENT_LATCHES.CC))
+            pc = Low16bits(pc + rec->imm);
+        DISPATCH_BRANCH();
+
+    TARGET(OP_JMP)
+        pc = R[rec->sr1];
+        DISPATCH_BRANCH();
+
+    TARGET(OP_RET)
+        if (isEmpty(vm))
+            consolePrintf(vm, "Error: RET called when stack is empty");
+        else
+            R[7] = POP(vm);
+        pc = R[7];
+        DISPATCH_BRANCH();
+
+    TARGET(OP_JSR)
+        pc = Low16bits(pc + 1);
+        R[7] = pc;
+        PUSH(vm, R[7]);
+        pc = Low16bits(pc + rec->imm);
+        DISPATCH_BRANCH();
+
+    TARGET(OP_JSRR)
+        pc = Low16bits(pc + 1);
+        R[7] = pc;
+        PUSH(vm, R[7]);
+        pc = R[rec->sr1];
+        DISPATCH_BRANCH();
+
+    TARGET(OP_LD)
+        vm->ACCESS_PC = pc;
+        pc = Low16bits(pc + 1);
+        R[rec->dr] = Low16bits(getMemory(vm, Low16bits(pc + rec->imm)));
+        vm->CURRENT_LATCHES.CC = R[rec->dr];
+        DISPATCH_ACCESS();
+
+    TARGET(OP_LDI)
+        vm->ACCESS_PC = pc;
+        pc = Low16bits(pc + 1);
+        R[rec->dr] = Low16bits(getMemory(vm, getMemory(vm, Low16bits(pc + rec->imm))));
+        vm->CURRENT_LATCHES.CC = R[rec->dr];
+        DISPATCH_ACCESS();
+
+    TARGET(OP_LDR)
+        vm->ACCESS_PC = pc;
+        R[rec->dr] = Low16bits(getMemory(vm, Low16bits(R[rec->sr1] + rec->imm)));
+        vm->CURRENT_LATCHES.CC = R[rec->dr];
+        pc = Low16bits(pc + 1);
+        DISPATCH_ACCESS();
+
+    TARGET(OP_LEA)
+        pc = Low16bits(pc + 1);
+        R[rec->dr] = Low16bits(pc + rec->imm);
+        DISPATCH();
+
+    TARGET(OP_ST)
+        vm->ACCESS_PC = pc;
+        pc = Low16bits(pc + 1);
+        setMemory(vm, Low16bits(pc + rec->imm), R[rec->dr]);
+        DISPATCH_ACCESS();
+
+    TARGET(OP_STI)
+        vm->ACCESS_PC = pc;
+        pc = Low16bits(pc + 1);
+        setMemory(vm, getMemory(vm, Low16bits(pc + rec->imm)), R[rec->dr]);
+        DISPATCH_ACCESS();
+
+    TARGET(OP_STR)
+        vm->ACCESS_PC = pc;
+        setMemory(vm, Low16bits(R[rec->sr1] + rec->imm), R[rec->dr]);
+        pc = Low16bits(pc + 1);
+        DISPATCH_ACCESS();
+
+    TARGET(OP_RTI)
+        pc = Low16bits(pc + 1);
+        CALL_OUT(RTI(vm, 0x8000));
+        DISPATCH_BRANCH();
+
+    TARGET(OP_TRAP)
+        vm->ACCESS_PC = pc;
+        pc = Low16bits(pc + 1);
+        CALL_OUT(TRAP(vm, 0xF000 | rec->imm));
+        DISPATCH_BRANCH();
+
+    TARGET(OP_NOP)
+        pc = Low16bits(pc + 1);
+        DISPATCH();
+
+#ifndef THREADED_DISPATCH
+    }
+#endif
+
+leave:
+    vm->CURRENT_LATCHES.PC = pc;
+    vm->INSTRUCTION_COUNT += count;
+    if (vm->TRACE != NULL)
+        traceFinish(vm);
+    if (vm->HISTORY != NULL)
+        vm->HISTORY->RUNNING = FALSE;
+    return count;
+
+#undef TARGET
+#undef JUMP
+#undef JUMP_TO
+#undef DISPATCH
+#undef DISPATCH_BRANCH
+#undef DISPATCH_ACCESS
+#undef CALL_OUT
+}
+
+/***************************************************************/
+/*                                                             */
+/* JIT tier: translate hot straight-line runs to x86-64.       */
+/*                                                             */
+/***************************************************************/
+/*
+  jitExecute counts how often each PC is entered as the start of a
+  block (after a branch, jump or trap).  Once a start address gets
+  JIT_THRESHOLD entries, the run from there up to the next BR, JMP,
+  JSR, JSRR or RET is compiled into the mmap'd code buffer.  The
+  calls and RET push and pop the pseudo stack through jitCall and
+  jitReturn, so call-heavy code stays native.  RTI and TRAP are
+  never compiled: a block ends in front of them and the interpreter
+  executes them.
+
+  Register use inside a block:
+    r8d..r15d  LC-3 R0..R7 (always zero-extended 16-bit values)
+    rbx        the VM (CURRENT_LATCHES is its first member)
+    ebp        remaining instruction budget
+    eax, ecx, edx, esi, edi  scratch
+  A block leaves the next PC in eax.  Condition codes are left in
+  whichever register produced them and only written back into
+  vm->CURRENT_LATCHES.CC when the block exits or the register is about
+  to be overwritten.
+
+  Every exit goes through the block's dispatch stub, which looks the
+  next PC up in BLOCKS and jumps straight past that block's prologue
+  when it is compiled, the budget covers it and neither ATTENTION nor
+  JIT_FLUSH_PENDING is raised.  Every block saves the same registers,
+  so whichever block's epilogue finally runs returns to jitStep.
+*/
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <stddef.h>
+
+#define JIT_THRESHOLD   50          /* block entries before compiling */
+#define JIT_MAX_BLOCK   64          /* instructions per block */
+#define JIT_CODE_SIZE   (4 << 20)   /* bytes of executable memory */
+#define JIT_BLOCK_ROOM  16384       /* worst-case bytes for one block */
+#define JIT_NEVER       0xFF        /* heat value for "do not compile" */
+
+/* Only plain RAM pages are compiled and accessed inline */
+#define isPlainRAM(vm, address) ((vm)->PAGE_HANDLER[(address) >> PAGE_SHIFT] == NULL)
+
+typedef int (*JitCode)(int *budget);
 
-        case 0b1100:    /* 1100 */
-            JMP(Instruction);
-            break;
+typedef struct Jit_Block_Struct {
+    JitCode code;
+    uint8_t *body;                      /* past the prologue: where other blocks chain in */
+    int start, length;
+} JitBlock;
 
-        case 0b0100:    /* 0100 */
-            if ((Instruction & 0x0800) >> 11)
-                JSR(Instruction);
-            else
-                JSRR(Instruction);
-            break;
+/* Translations belong to one VM: they have its addresses baked in */
+typedef struct Jit_State_Struct {
+    JitBlock *BLOCKS[DECODED_WORDS];    /* block starting at each PC */
+    uint8_t HEAT[DECODED_WORDS];
+    uint8_t *buffer, *ptr;              /* code buffer and its free space */
+    JitBlock *pool;                     /* one slot per possible block */
+    int pool_used;
+} Jit_State;
 
-        case 0b0010:    /* 0010 */
-            LD(Instruction);
-            break;
+void jitFlush(LC3_VM *vm);
 
-        case 0b1010:    /* 1010 */
-            LDI(Instruction);
-            break;
+/* Emit cursor of the block being compiled on this thread */
+static __thread uint8_t *jit_ptr;
 
-        case 0b0110:    /* 0110 */
-            LDR(Instruction);
-            break;
+/* x86 register numbers and condition codes used below */
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8 };
+enum { CC_E = 0x4, CC_NE = 0x5, CC_S = 0x8,
+       CC_NS = 0x9, CC_L = 0xC, CC_LE = 0xE, CC_G = 0xF };
 
-        case 0b1110:    /* 1110 */
-            LEA(Instruction);
-            break;
+#define HOST(lc3reg)    (R8 + (lc3reg))
+#define LATCH(field)    ((int) offsetof(System_Latches, field))
 
-        case 0b1001:    /* 1001 */
-            NOT(Instruction);
-            break;
+static void emitByte(int b) { *jit_ptr++ = (uint8_t) b; }
 
-        case 0b1000:    /* 1000 */
-            RTI(Instruction);
-            break;
+static void emitImm32(int v) {
+    memcpy(jit_ptr, &v, 4);
+    jit_ptr += 4;
+}
 
-        case 0b0011:    /* 0011 */
-            ST(Instruction);
-            break;
+static void emitImm64(uint64_t v) {
+    memcpy(jit_ptr, &v, 8);
+    jit_ptr += 8;
+}
 
-        case 0b1011:    /* 1011 */
-            STI(Instruction);
-            break;
+/* REX prefix for a reg/rm pair; omitted when not needed */
+static void emitRex(int w, int reg, int rm) {
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40)
+        emitByte(rex);
+}
 
-        case 0b0111:    /* 0111 */
-            STR(Instruction);
-            break;
+static void emitModRM(int mod, int reg, int rm) {
+    emitByte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
 
-        case 0b1111:    /* 1111 */
-            TRAP(Instruction);
-            break;
+/* op r/m32, r32 (mov 89, add 01, and 21, or 09, test 85) */
+static void emitRR(int opcode, int dst, int src) {
+    emitRex(0, src, dst);
+    emitByte(opcode);
+    emitModRM(3, src, dst);
+}
 
-        default:
-            break;
-    }
+/* op r/m32, imm32 (81 /ext: add 0, or 1, and 4, sub 5, cmp 7) */
+static void emitRI(int ext, int dst, int imm) {
+    emitRex(0, 0, dst);
+    emitByte(0x81);
+    emitModRM(3, ext, dst);
+    emitImm32(imm);
+}
 
-    NEXT_LATCHES = CURRENT_LATCHES;
+static void emitMovRI(int dst, int imm) {
+    emitRex(0, 0, dst);
+    emitByte(0xB8 + (dst & 7));
+    emitImm32(imm);
 }
 
-int SetCC (int value) {
+static void emitMovRI64(int dst, uint64_t imm) {
+    emitRex(1, 0, dst);
+    emitByte(0xB8 + (dst & 7));
+    emitImm64(imm);
+}
 
-    if (!value) {
-        CURRENT_LATCHES.N = 0;
-        CURRENT_LATCHES.Z = 1;
-        CURRENT_LATCHES.P = 0;
-        return 0;
-    }
+static void emitNot(int dst) {
+    emitRex(0, 0, dst);
+    emitByte(0xF7);
+    emitModRM(3, 2, dst);
+}
 
-    value = Low16bits(value) & 0x8000;  /* Sign bit */
+/* movzx dst32, src16 */
+static void emitZext16(int dst, int src) {
+    emitRex(0, dst, src);
+    emitByte(0x0F);
+    emitByte(0xB7);
+    emitModRM(3, dst, src);
+}
 
-    if (!value) {  /* Positive */
-        CURRENT_LATCHES.N = 0;
-        CURRENT_LATCHES.Z = 0;
-        CURRENT_LATCHES.P = 1;
-        return 0;
-    } else {   /* Negative */
-        CURRENT_LATCHES.N = 1;
-        CURRENT_LATCHES.Z = 0;
-        CURRENT_LATCHES.P = 0;
-        return 0;
-    }
+/* test src16, src16 */
+static void emitTest16(int reg) {
+    emitByte(0x66);
+    emitRex(0, reg, reg);
+    emitByte(0x85);
+    emitModRM(3, reg, reg);
 }
 
-int SEXT (int num, int length) {  /* Sign extension */
-    int Sign;
-    switch (length) {
-        case 5:     /* imm5 */
-            Sign = (num & 0x0010) >> 4;
-            if(Sign)        /* Negative */
-                num += 0xFFE0;  /* Extend with 1 */
-            break;
+/* movzx r32, word [rbx + disp32] */
+static void emitLoadLatch(int reg, int disp) {
+    emitRex(0, reg, RBX);
+    emitByte(0x0F);
+    emitByte(0xB7);
+    emitModRM(2, reg, RBX);
+    emitImm32(disp);
+}
 
-        case 6:     /* PCoffset6 */
-            Sign = (num & 0x0020) >> 5;
-            if(Sign)
-                num += 0xFFC0;
-            break;
+/* mov word [rbx + disp32], r16 */
+static void emitStoreLatch(int reg, int disp) {
+    emitByte(0x66);
+    emitRex(0, reg, RBX);
+    emitByte(0x89);
+    emitModRM(2, reg, RBX);
+    emitImm32(disp);
+}
 
-        case 9:     /* PCoffset9 */
-            Sign = (num & 0x0100) >> 8;
-            if(Sign)
-                num += 0xFE00;
-            break;
+/* cmp dword [rbx + disp32], 0 */
+static void emitTestVM(int disp) {
+    emitByte(0x83);
+    emitModRM(2, 7, RBX);
+    emitImm32(disp);
+    emitByte(0);
+}
 
-        case 11:    /* PCoffset11 */
-            Sign = (num & 0x0400) >> 10;
-            if(Sign)
-                num += 0xF800;
-            break;
+static void emitPush(int reg) { emitRex(0, 0, reg); emitByte(0x50 + (reg & 7)); }
+static void emitPop(int reg)  { emitRex(0, 0, reg); emitByte(0x58 + (reg & 7)); }
 
-        default:
-            break;
+/* Emit a rel32 jump/jcc and return where its displacement lives */
+static uint8_t *emitJump(int cc) {
+    if (cc < 0)
+        emitByte(0xE9);
+    else {
+        emitByte(0x0F);
+        emitByte(0x80 + cc);
     }
-    num = Low16bits(num);
-    return num;
+    emitImm32(0);
+    return jit_ptr - 4;
 }
 
-int ADD (int instruction) {
-    int DR = (instruction & 0x0E00) >> 9;
-    int SR1 = (instruction & 0x01C0) >> 6;
+static void patchJump(uint8_t *site, uint8_t *target) {
+    int rel = (int) (target - (site + 4));
+    memcpy(site, &rel, 4);
+}
 
-    if((instruction & 0x0020) == 0) {      /* Instruction[5] = 0 */
-        int SR2 = (instruction & 0x0007);
-        CURRENT_LATCHES.REGS[DR]
-                = CURRENT_LATCHES.REGS[SR1] + CURRENT_LATCHES.REGS[SR2];
-    }
+/* Call a C helper with the caller-saved LC-3 registers preserved */
+static void emitCall(void *fn) {
+    int r;
+    for (r = 0; r < 4; r++)
+        emitPush(HOST(r));
+    emitMovRI64(RAX, (uint64_t) (uintptr_t) fn);
+    emitByte(0xFF);
+    emitByte(0xD0);     /* call rax */
+    for (r = 3; r >= 0; r--)
+        emitPop(HOST(r));
+}
 
-    else{      /* Instruction[5] = 1 */
-        int imm5 = (instruction & 0x001F);
-        CURRENT_LATCHES.REGS[DR] = CURRENT_LATCHES.REGS[SR1] + SEXT(imm5, 5);
-    }
+/* Make the value in an LC-3 register the architectural CC source */
+static void emitStoreCC(int lc3reg) {
+    emitStoreLatch(HOST(lc3reg), LATCH(CC));
+}
 
-    CURRENT_LATCHES.REGS[DR] = Low16bits(CURRENT_LATCHES.REGS[DR]);
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+/* rdi = the VM, the first argument of every C helper */
+static void emitVMArg() {
+    emitRex(1, RBX, RDI);
+    emitByte(0x89);
+    emitModRM(3, RBX, RDI);
 }
 
-int AND (int instruction) {
-    int DR = (instruction & 0x0E00) >> 9;
-    int SR1 = (instruction & 0x01C0) >> 6;
+/* vm->ACCESS_PC = pc, for the protection tallies of a call out to memory */
+static void emitAccessPC(int pc) {
+    emitByte(0xC7);
+    emitModRM(2, 0, RBX);
+    emitImm32(offsetof(LC3_VM, ACCESS_PC));
+    emitImm32(pc);
+}
 
-    if((instruction & 0x0020) == 0) {            /* Instruction[5] = 0 */
-        int SR2 = (instruction & 0x0007);
-        CURRENT_LATCHES.REGS[DR] = CURRENT_LATCHES.REGS[SR1] & CURRENT_LATCHES.REGS[SR2];
-    }
+int jitLoad(LC3_VM *vm, int address) {
+    return Low16bits(getMemory(vm, address));
+}
 
-    else{       /* Instruction[5] = 1 */
-        int imm5 = (instruction & 0x001F);
-        CURRENT_LATCHES.REGS[DR] = CURRENT_LATCHES.REGS[SR1] & SEXT(imm5, 5);
+int jitStore(LC3_VM *vm, int address, int value) {
+    setMemory(vm, address, value);
+    return vm->JIT_FLUSH_PENDING || vm->ATTENTION;
+}
+
+/* JSR/JSRR: the return address goes on the pseudo stack as well as into R7 */
+void jitCall(LC3_VM *vm, int link) {
+    PUSH(vm, link);
+}
+
+/* RET: the new R7, popped as the interpreter pops it */
+int jitReturn(LC3_VM *vm, int r7) {
+    if (isEmpty(vm)) {
+        consolePrintf(vm, "Error: RET called when stack is empty");
+        return r7;
     }
+    return Low16bits(POP(vm));
+}
 
-    CURRENT_LATCHES.REGS[DR] = Low16bits(CURRENT_LATCHES.REGS[DR]);
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+/*
+  Load the word at the address in eax into an LC-3 register.  The
+  page table is consulted at run time so pages whose handler changes
+  later still take the slow path.
+*/
+static void emitLoad(LC3_VM *vm, int dst, int pc) {
+    uint8_t *slow, *done;
+
+    emitRR(0x89, RCX, RAX);
+    emitByte(0xC1); emitModRM(3, 5, RCX); emitByte(PAGE_SHIFT);    /* shr ecx, 8 */
+    emitMovRI64(RDX, (uint64_t) (uintptr_t) vm->PAGE_HANDLER);
+    emitByte(0x48); emitByte(0x83); emitModRM(0, 7, 4);             /* cmp qword [rdx+rcx*8], 0 */
+    emitByte(0xCA); emitByte(0x00);
+    slow = emitJump(CC_NE);
+    emitMovRI64(RCX, (uint64_t) (uintptr_t) vm->MEMORY);
+    emitRex(0, HOST(dst), 0);
+    emitByte(0x0F); emitByte(0xB7);             /* movzx dst, word [rcx+rax*2] */
+    emitModRM(0, HOST(dst), 4);
+    emitByte(0x41);
+    done = emitJump(-1);
+    patchJump(slow, jit_ptr);
+    emitAccessPC(pc);
+    emitRR(0x89, RSI, RAX);
+    emitVMArg();
+    emitCall((void *) jitLoad);
+    emitZext16(HOST(dst), RAX);
+    patchJump(done, jit_ptr);
 }
 
-int BR (int instruction) {
-    int PCoffset9 = instruction & 0x01FF;
-    int n = (instruction & 0x0800) >> 11;
-    int z = (instruction & 0x0400) >> 10;
-    int p = (instruction & 0x0200) >> 9;
-    int flag = n && CURRENT_LATCHES.N || z && CURRENT_LATCHES.Z || p && CURRENT_LATCHES.P;  /* Condition */
+/*
+  Leave the block: flush the lazy condition codes, give back the
+  budget of instructions that did not run, and return pc (or, if
+  pc < 0, the value already in eax).
+*/
+static void emitExit(int cc_reg, int unused, int pc, uint8_t **epilogue_jumps, int *exits) {
+    if (cc_reg >= 0)
+        emitStoreCC(cc_reg);
+    if (unused)
+        emitRI(0, RBP, unused);
+    if (pc >= 0)
+        emitMovRI(RAX, pc);
+    epilogue_jumps[(*exits)++] = emitJump(-1);
+}
 
-    if (flag) {
-        CURRENT_LATCHES.PC += SEXT(PCoffset9, 9);
-        CURRENT_LATCHES.PC = Low16bits(CURRENT_LATCHES.PC);
+/*
+  Translate the block starting at start.  Returns NULL if not even
+  the first instruction can be compiled.
+*/
+JitBlock *jitCompile(LC3_VM *vm, int start) {
+    uint8_t *epilogue_jumps[2 * JIT_MAX_BLOCK + 4];
+    uint8_t *unchained[4];
+    uint8_t *head;
+    int exits = 0;
+    int cc_reg = -1;        /* LC-3 register holding the live CCs */
+    int length = 0;
+    int pc = start;
+    int done = FALSE;
+    int r;
+    JitBlock *blk;
+    Jit_State *jit = vm->jit;
+    Decoded d;
+
+    /* Find where the block ends before emitting anything */
+    while (length < JIT_MAX_BLOCK && pc < WORDS_IN_MEM && isPlainRAM(vm, pc)) {
+        decodeInstruction(Low16bits(vm->MEMORY[pc]), &d);
+        if (d.op == OP_RTI || d.op == OP_TRAP)
+            break;
+        length++;
+        pc++;
+        if (d.op == OP_BR || d.op == OP_JMP || d.op == OP_JSR || d.op == OP_JSRR || d.op == OP_RET)
+            break;
+    }
+    if (length == 0)
+        return NULL;
+
+    if (jit->ptr + JIT_BLOCK_ROOM > jit->buffer + JIT_CODE_SIZE)
+        jitFlush(vm);
+
+    jit_ptr = jit->ptr;
+    blk = &jit->pool[jit->pool_used++];
+    blk->code = (JitCode) (void *) jit_ptr;
+    blk->start = start;
+    blk->length = length;
+
+    /* Prologue: save callee-saved registers and the budget pointer */
+    emitPush(RBX); emitPush(RBP);
+    for (r = 4; r < 8; r++)
+        emitPush(HOST(r));
+    emitPush(RDI);
+    emitMovRI64(RBX, (uint64_t) (uintptr_t) vm);
+    emitByte(0x8B); emitModRM(0, RBP, RDI);     /* mov ebp, [rdi] */
+    for (r = 0; r < LC_3_REGS; r++) {
+        emitLoadLatch(HOST(r), LATCH(REGS) + 2 * r);
     }
 
-    return 0;
-}
+    head = blk->body = jit_ptr;
+    emitRI(5, RBP, length);
 
-int JMP (int instruction) {
-    int BaseR = (instruction & 0x01C0) >> 6;
-    if (BaseR == 7) {        // RET
-        if (isEmpty()) {
-            printf("Error: RET called when stack is empty");
-        } else {
-            CURRENT_LATCHES.REGS[7] = POP();
+    for (pc = start; pc < start + length && !done; pc++) {
+        int next = pc + 1;
+        int executed = pc - start + 1;
+
+        if (vm->CORES != NULL)
+            coresFetch(vm, pc);
+        decodeInstruction(Low16bits(vm->MEMORY[pc]), &d);
+        vm->JIT_CODE_MAP[pc] = 1;
+
+        /* Instructions that overwrite the CC source without setting CCs */
+        if (cc_reg >= 0 && (d.op == OP_LEA) && d.dr == cc_reg) {
+            emitStoreCC(cc_reg);
+            cc_reg = -1;
         }
-    }
 
-    CURRENT_LATCHES.PC = Low16bits(CURRENT_LATCHES.REGS[BaseR]);
-    return 0;
-}
+        switch (d.op) {
+            case OP_ADD_REG:
+            case OP_AND_REG:
+                emitRR(0x89, RAX, HOST(d.sr1));
+                emitRR(d.op == OP_ADD_REG ? 0x01 : 0x21, RAX, HOST(d.sr2));
+                emitZext16(HOST(d.dr), RAX);
+                cc_reg = d.dr;
+                break;
+
+            case OP_ADD_IMM:
+            case OP_AND_IMM:
+                emitRR(0x89, RAX, HOST(d.sr1));
+                emitRI(d.op == OP_ADD_IMM ? 0 : 4, RAX, d.imm);
+                emitZext16(HOST(d.dr), RAX);
+                cc_reg = d.dr;
+                break;
+
+            case OP_NOT:
+                emitRR(0x89, RAX, HOST(d.sr1));
+                emitNot(RAX);
+                emitZext16(HOST(d.dr), RAX);
+                cc_reg = d.dr;
+                break;
+
+            case OP_LEA:
+                emitMovRI(HOST(d.dr), Low16bits(next + d.imm));
+                break;
+
+            case OP_LD:
+            case OP_LDI:
+                emitMovRI(RAX, Low16bits(next + d.imm));
+                if (d.op == OP_LDI) {
+                    emitLoad(vm, d.dr, pc);
+                    emitRR(0x89, RAX, HOST(d.dr));
+                }
+                emitLoad(vm, d.dr, pc);
+                cc_reg = d.dr;
+                break;
+
+            case OP_LDR:
+                emitRR(0x89, RAX, HOST(d.sr1));
+                emitRI(0, RAX, d.imm);
+                emitZext16(RAX, RAX);
+                emitLoad(vm, d.dr, pc);
+                cc_reg = d.dr;
+                break;
+
+            case OP_ST:
+            case OP_STI:
+            case OP_STR: {
+                uint8_t *ok;
+
+                emitAccessPC(pc);
+                if (d.op == OP_STR) {
+                    emitRR(0x89, RAX, HOST(d.sr1));
+                    emitRI(0, RAX, d.imm);
+                    emitZext16(RAX, RAX);
+                } else {
+                    emitMovRI(RAX, Low16bits(next + d.imm));
+                    if (d.op == OP_STI) {
+                        emitRR(0x89, RSI, RAX);
+                        emitVMArg();
+                        emitCall((void *) jitLoad);
+                    }
+                }
+                emitRR(0x89, RSI, RAX);
+                emitRR(0x89, RDX, HOST(d.dr));
+                emitVMArg();
+                emitCall((void *) jitStore);
+                /* Stored into translated code or a device register: stop right here */
+                emitRR(0x85, RAX, RAX);
+                ok = emitJump(CC_E);
+                emitExit(cc_reg, length - executed, next, epilogue_jumps, &exits);
+                patchJump(ok, jit_ptr);
+                break;
+            }
 
-int JSR (int instruction) {
-    CURRENT_LATCHES.REGS[7] = CURRENT_LATCHES.PC;  /* Save R7 first */
-    PUSH(CURRENT_LATCHES.REGS[7]);
+            case OP_BR: {
+                int target = Low16bits(next + d.imm);
+                uint8_t *taken = NULL;
+
+                if (d.dr != 7) {
+                    static const int on_cc[8] = {
+                        -1, CC_G, CC_E, CC_NS, CC_S, CC_NE, CC_LE, -1
+                    };
+
+                    if (cc_reg >= 0)
+                        emitTest16(HOST(cc_reg));
+                    else {
+                        emitLoadLatch(RAX, LATCH(CC));
+                        emitTest16(RAX);
+                    }
+                    taken = emitJump(on_cc[d.dr]);
+                    emitExit(cc_reg, 0, next, epilogue_jumps, &exits);
+                    patchJump(taken, jit_ptr);
+                }
+
+                if (target == start) {
+                    uint8_t *loop, *out, *wanted, *flush = NULL;
+
+                    /* Loop back in native code while budget lasts, no device wants attention
+                       and no other core (--cores) has stored into translated code */
+                    if (cc_reg >= 0)
+                        emitStoreCC(cc_reg);
+                    emitRI(7, RBP, length);
+                    out = emitJump(CC_L);
+                    emitTestVM((int) offsetof(LC3_VM, ATTENTION));
+                    wanted = emitJump(CC_NE);
+                    if (vm->CORES != NULL) {
+                        emitTestVM((int) offsetof(LC3_VM, JIT_FLUSH_PENDING));
+                        flush = emitJump(CC_NE);
+                    }
+                    loop = emitJump(-1);
+                    patchJump(loop, head);
+                    patchJump(out, jit_ptr);
+                    patchJump(wanted, jit_ptr);
+                    if (flush != NULL)
+                        patchJump(flush, jit_ptr);
+                    emitExit(-1, 0, target, epilogue_jumps, &exits);
+                } else
+                    emitExit(cc_reg, 0, target, epilogue_jumps, &exits);
+                done = TRUE;
+                break;
+            }
 
-    int PCoffset11 = instruction & 0x07FF;
-    CURRENT_LATCHES.PC += SEXT(PCoffset11, 11);
-    CURRENT_LATCHES.PC = Low16bits(CURRENT_LATCHES.PC);
-    return 0;
+            case OP_JMP:
+                if (cc_reg >= 0)
+                    emitStoreCC(cc_reg);
+                emitZext16(RAX, HOST(d.sr1));
+                emitExit(-1, 0, -1, epilogue_jumps, &exits);
+                done = TRUE;
+                break;
+
+            case OP_JSR:
+            case OP_JSRR:
+                /* R7 is overwritten without setting CCs, and before JSRR reads its base */
+                if (cc_reg >= 0)
+                    emitStoreCC(cc_reg);
+                emitMovRI(RSI, next);
+                emitVMArg();
+                emitCall((void *) jitCall);
+                emitMovRI(HOST(7), next);
+                if (d.op == OP_JSRR)
+                    emitZext16(RAX, HOST(d.sr1));
+                emitExit(-1, 0, d.op == OP_JSR ? Low16bits(next + d.imm) : -1, epilogue_jumps, &exits);
+                done = TRUE;
+                break;
+
+            case OP_RET:
+                if (cc_reg >= 0)
+                    emitStoreCC(cc_reg);
+                emitRR(0x89, RSI, HOST(7));
+                emitVMArg();
+                emitCall((void *) jitReturn);
+                emitZext16(RAX, RAX);       /* the dispatch stub indexes BLOCKS with all of rax */
+                emitRR(0x89, HOST(7), RAX);
+                emitExit(-1, 0, -1, epilogue_jumps, &exits);
+                done = TRUE;
+                break;
+
+            default:    /* OP_NOP */
+                break;
+        }
+    }
+
+    if (!done)
+        emitExit(cc_reg, 0, start + length, epilogue_jumps, &exits);
+
+    /* Dispatch: chain into the block at eax if there is one and nothing wants the engine */
+    for (r = 0; r < exits; r++)
+        patchJump(epilogue_jumps[r], jit_ptr);
+    emitTestVM((int) offsetof(LC3_VM, ATTENTION));
+    unchained[0] = emitJump(CC_NE);
+    emitTestVM((int) offsetof(LC3_VM, JIT_FLUSH_PENDING));
+    unchained[1] = emitJump(CC_NE);
+    emitMovRI64(RDX, (uint64_t) (uintptr_t) jit->BLOCKS);
+    emitByte(0x48); emitByte(0x8B); emitModRM(0, RCX, 4);          /* mov rcx, [rdx+rax*8] */
+    emitByte(0xC2);
+    emitByte(0x48); emitByte(0x85); emitModRM(3, RCX, RCX);         /* test rcx, rcx */
+    unchained[2] = emitJump(CC_E);
+    emitByte(0x3B); emitModRM(1, RBP, RCX);                         /* cmp ebp, [rcx + length] */
+    emitByte((int) offsetof(JitBlock, length));
+    unchained[3] = emitJump(CC_L);
+    emitByte(0xFF); emitModRM(1, 4, RCX);                           /* jmp [rcx + body] */
+    emitByte((int) offsetof(JitBlock, body));
+
+    /* Epilogue: write back registers, budget and PC */
+    for (r = 0; r < 4; r++)
+        patchJump(unchained[r], jit_ptr);
+    for (r = 0; r < LC_3_REGS; r++)
+        emitStoreLatch(HOST(r), LATCH(REGS) + 2 * r);
+    emitStoreLatch(RAX, LATCH(PC));
+    emitPop(RDI);
+    emitByte(0x89); emitModRM(0, RBP, RDI);     /* mov [rdi], ebp */
+    for (r = 7; r >= 4; r--)
+        emitPop(HOST(r));
+    emitPop(RBP); emitPop(RBX);
+    emitByte(0xC3);
+
+    jit->ptr = jit_ptr;
+    jit->BLOCKS[start] = blk;
+    return blk;
 }
 
-int JSRR (int instruction) {
-    CURRENT_LATCHES.REGS[7] = CURRENT_LATCHES.PC;   /* Save R7 first */
-    PUSH(CURRENT_LATCHES.REGS[7]);
+/***************************************************************/
+/*                                                             */
+/* Procedure : jitFlush                                        */
+/*                                                             */
+/* Purpose   : Drop every translation (after a store into      */
+/*             translated code, or when the buffer is full).   */
+/*                                                             */
+/***************************************************************/
+void jitFlush(LC3_VM *vm) {
+    Jit_State *jit = vm->jit;
+    int i;
 
-    int BaseR = (instruction & 0x01C0) >> 6;
-    CURRENT_LATCHES.PC = Low16bits(CURRENT_LATCHES.REGS[BaseR]);
-    return 0;
+    /* First, so a store another core makes meanwhile asks for one more flush */
+    vm->JIT_FLUSH_PENDING = FALSE;
+    for (i = 0; i < jit->pool_used; i++)
+        jit->BLOCKS[jit->pool[i].start] = NULL;
+    jit->pool_used = 0;
+    jit->ptr = jit->buffer;
+    memset(vm->JIT_CODE_MAP, 0, sizeof(vm->JIT_CODE_MAP));
+    memset(jit->HEAT, 0, sizeof(jit->HEAT));
 }
 
-int LD (int instruction) {
-    int DR = (instruction & 0x0E00) >> 9;
-    int PCoffset9 = instruction & 0x01FF;
-    int address = Low16bits((CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
-    CURRENT_LATCHES.REGS[DR] = Low16bits(getMemory(address));
+/***************************************************************/
+/*                                                             */
+/* Procedure : jitInit                                         */
+/*                                                             */
+/* Purpose   : Map the code buffer.  Returns FALSE if the host */
+/*             refuses executable memory.                      */
+/*                                                             */
+/***************************************************************/
+int jitInit(LC3_VM *vm) {
+    Jit_State *jit = calloc(1, sizeof(Jit_State));
+
+    if (jit == NULL)
+        return FALSE;
+    jit->buffer = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED) {
+        free(jit);
+        return FALSE;
+    }
+    if ((jit->pool = calloc(DECODED_WORDS, sizeof(JitBlock))) == NULL) {
+        munmap(jit->buffer, JIT_CODE_SIZE);
+        free(jit);
+        return FALSE;
+    }
+    jit->ptr = jit->buffer;
+    vm->jit = jit;
+    vm->JIT_ENABLED = TRUE;
+    return TRUE;
+}
 
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+/***************************************************************/
+/*                                                             */
+/* Procedure : jitRelease                                      */
+/*                                                             */
+/* Purpose   : Unmap a VM's code buffer and free its blocks.   */
+/*                                                             */
+/***************************************************************/
+void jitRelease(LC3_VM *vm) {
+    if (vm->jit == NULL)
+        return;
+    munmap(vm->jit->buffer, JIT_CODE_SIZE);
+    free(vm->jit->pool);
+    free(vm->jit);
+    vm->jit = NULL;
+    vm->JIT_ENABLED = FALSE;
 }
 
-int LDI (int instruction) {
-    int DR = (instruction & 0x0E00) >> 9;
-    int PCoffset9 = instruction & 0x01FF;
+/***************************************************************/
+/*                                                             */
+/* Procedure : jitStep                                         */
+/*                                                             */
+/* Purpose   : Run one block, native if it is hot enough and   */
+/*             fits in num_instructions, else interpreted up   */
+/*             to its control transfer.  Returns the number    */
+/*             of instructions retired.                        */
+/*                                                             */
+/***************************************************************/
+int jitStep(LC3_VM *vm, int num_instructions) {
+    Jit_State *jit = vm->jit;
+    int pc = vm->CURRENT_LATCHES.PC;
+    JitBlock *blk;
+    int count;
+
+    /* A store or a loaded image since the last block */
+    if (vm->JIT_FLUSH_PENDING)
+        jitFlush(vm);
+    blk = jit->BLOCKS[pc];
+    if (blk == NULL && jit->HEAT[pc] != JIT_NEVER && ++jit->HEAT[pc] >= JIT_THRESHOLD) {
+        blk = jitCompile(vm, pc);
+        if (blk == NULL)
+            jit->HEAT[pc] = JIT_NEVER;
+    }
 
-    int address = Low16bits((CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
-    CURRENT_LATCHES.REGS[DR] = Low16bits(getMemory(getMemory(address)));
+    if (blk != NULL && num_instructions >= blk->length) {
+        int budget = num_instructions;
 
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+        blk->code(&budget);
+        count = num_instructions - budget;
+        vm->INSTRUCTION_COUNT += count;
+    } else
+        count = interpretInstructions(vm, num_instructions, TRUE);
+    return count;
 }
 
-int LDR (int instruction) {
-    int DR = (instruction & 0x0E00) >> 9;
-    int BaseR = (instruction & 0x01C0) >> 6;
-    int PCoffset6 = instruction & 0x003F;
+/***************************************************************/
+/*                                                             */
+/* Procedure : jitExecute                                      */
+/*                                                             */
+/* Purpose   : Same contract as interpretInstructions, but     */
+/*             runs hot blocks as native code.                 */
+/*                                                             */
+/***************************************************************/
+int jitExecute(LC3_VM *vm, int num_instructions) {
+    int count = 0;
 
-    int address = Low16bits((CURRENT_LATCHES.REGS[BaseR] + SEXT(PCoffset6, 6)));
-    CURRENT_LATCHES.REGS[DR] = Low16bits(getMemory(address));
+    while (count < num_instructions && vm->CURRENT_LATCHES.PC != 0x0000 && !vm->ATTENTION)
+        count += jitStep(vm, num_instructions - count);
+    return count;
+}
 
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+#else   /* no JIT on this host */
+
+int jitInit(LC3_VM *vm) {
+    return FALSE;
 }
 
-int LEA (int instruction) {
-    int DR = (instruction & 0x0E00) >> 9;
-    int PCoffset9 = instruction & 0x01FF;
-    CURRENT_LATCHES.REGS[DR] = Low16bits(CURRENT_LATCHES.PC + SEXT(PCoffset9, 9));
-    return 0;
+void jitRelease(LC3_VM *vm) {
 }
 
-int NOT (int instruction) {
-    int DR = (instruction & 0x0E00) >> 9;
-    int SR = (instruction & 0x01C0) >> 6;
-    CURRENT_LATCHES.REGS[DR] = Low16bits(~ CURRENT_LATCHES.REGS[SR]);
+int jitStep(LC3_VM *vm, int num_instructions) {
+    return interpretInstructions(vm, num_instructions, TRUE);
+}
 
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+int jitExecute(LC3_VM *vm, int num_instructions) {
+    return interpretInstructions(vm, num_instructions, FALSE);
 }
 
-int RTI (int instruction) {
-    if (isEmpty()) {
-        printf("Error: RTI called when stack is empty");
-    } else {
-        CURRENT_LATCHES.PC = Low16bits(POP());
+#endif
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : executeInstructions                             */
+/*                                                             */
+/* Purpose   : Run up to num_instructions instructions on the  */
+/*             selected engine; stops early at PC 0x0000.      */
+/*             While an interrupt source is enabled the run is */
+/*             cut into DEVICE_SLICE pieces so the devices are */
+/*             polled in between, and a machine found in an    */
+/*             idle loop sleeps in idleWait.  A machine taken  */
+/*             back in its history replays up to where the     */
+/*             history ends before it runs live again.         */
+/*                                                             */
+/***************************************************************/
+int executeInstructions(LC3_VM *vm, int num_instructions) {
+    int count = 0;
+
+    while (count < num_instructions && vm->CURRENT_LATCHES.PC != 0x0000) {
+        int slice = num_instructions - count;
+
+        if (vm->HISTORY != NULL && vm->INSTRUCTION_COUNT < vm->HISTORY->END) {
+            count += historyReplay(vm, slice, FALSE);
+            if (vm->DEBUG != NULL && vm->DEBUG->STOPPED)
+                break;
+            continue;
+        }
+        if (vm->ATTENTION || vm->DEVICES_ACTIVE) {
+            if (vm->HISTORY != NULL)
+                historyBetween(vm, TRUE);
+            serviceDevices(vm);
+            slice = vm->CURRENT_LATCHES.PC == 0x0000 ? 0 : idleWait(vm, slice);
+            if (vm->HISTORY != NULL)
+                historyBetween(vm, FALSE);
+            if (vm->CURRENT_LATCHES.PC == 0x0000)
+                break;
+            if (slice > 0) {
+                count += slice;
+                continue;
+            }
+            slice = num_instructions - count;
+            if (vm->DEVICES_ACTIVE && slice > DEVICE_SLICE)
+                slice = DEVICE_SLICE;
+        }
+        if (vm->JIT_ENABLED && !vm->PROFILING && vm->TRACE == NULL && vm->HISTORY == NULL && vm->DEBUG == NULL
+            && !vm->PROTECT->FAULTS)
+            count += jitExecute(vm, slice);
+        else
+            count += interpretInstructions(vm, slice, FALSE);
+        if (vm->DEBUG != NULL && vm->DEBUG->STOPPED)
+            break;
     }
-    return 0;
+    return count;
 }
 
-int ST (int instruction) {
-    int SR = (instruction & 0x0E00) >> 9;
-    int PCoffset9 = instruction & 0x01FF;
-    int address = Low16bits((CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
-    setMemory(address, Low16bits(CURRENT_LATCHES.REGS[SR]));
-    return 0;
-}
+/***************************************************************/
+/*                                                             */
+/* Procedure : translateProgram                                */
+/*                                                             */
+/* Purpose   : Write the loaded image out as a C program with  */
+/*             one label per reachable instruction.            */
+/*                                                             */
+/***************************************************************/
+/*
+  The output #includes lc3sim.c (with LC3SIM_NO_MAIN), so TRAPs,
+  getMemory/setMemory and the interpreter are the same code the
+  simulator runs.  Reachability starts at the entry PC and follows
+  fallthroughs, BR/JSR targets and the return points of JSR, JSRR
+  and TRAP.  JMP/JSRR/RET targets are only known at run time and go
+  through a switch over every translated address.  Anything the
+  translator could not prove to be code runs in the interpreter for
+  one block, then re-enters the switch.  A store into translated
+  code (flagged through JIT_CODE_MAP) or into a device register that
+  raises ATTENTION hands the rest of the run to the interpreter.
+
+  Registers, the instruction count and the last CC-setting result
+  live in locals so the compiler can keep them in host registers;
+  they are copied back into the VM (SYNC_OUT) around anything that
+  looks at the latches.
+
+  Build the result with:  gcc -O2 -pthread -I<lc3sim dir> -o prog out.c
+*/
+static uint8_t translate_reachable[WORDS_IN_MEM];
 
-int STI (int instruction) {
-    int SR = (instruction & 0x0E00) >> 9;
-    int PCoffset9 = instruction & 0x01FF;
-    int address = Low16bits((CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
-    setMemory(getMemory(address), Low16bits(CURRENT_LATCHES.REGS[SR]));
-    return 0;
+static int isTranslated(int address) {
+    return address < WORDS_IN_MEM && translate_reachable[address];
 }
 
-int STR (int instruction) {
-    int SR = (instruction & 0x0E00) >> 9;
-    int BaseR = (instruction & 0x01C0) >> 6;
-    int PCoffset6 = instruction & 0x003F;
-    int address = Low16bits((CURRENT_LATCHES.REGS[BaseR] + SEXT(PCoffset6, 6)));
-    setMemory(address, Low16bits(CURRENT_LATCHES.REGS[SR]));
-    return 0;
+static void translateJump(FILE *out, int target) {
+    if (isTranslated(target))
+        fprintf(out, "goto L_%.4X;", target);
+    else
+        fprintf(out, "{ pc = 0x%.4X; goto dispatch; }", target);
 }
 
-int TRAP(int instruction) {
-    int trapVect = (instruction & 0x00FF);
-    switch (trapVect)
-    {
-        case 0x20: { // GETC
-            set_conio_terminal_mode();
-            fflush(stdin);
-            fflush(stdout);
-            while (!kbhit()) {
-                /* do some work */
-            }
-            int x = getch();
-            if (x == 3 || x == 4) {
-                printf("Error: keyboard interruption");
-                exit(0);
-            }
-            fflush(stdin);
-            fflush(stdout);
-            CURRENT_LATCHES.REGS[0] = x;
-            reset_terminal_mode();
-            break;
-        }
-        case 0x21: { // OUT
-            printASCII(CURRENT_LATCHES.REGS[0]);
-            break;
-        }
-        case 0x22: { // PUTS
-            int address = Low16bits(CURRENT_LATCHES.REGS[0]);
-            while (getMemory(address)) {
-                printASCII(getMemory(address));
-                address++;
-                // printf("%x\n", address);
-                address = Low16bits(address);
-            } 
-            break;
+void translateProgram(LC3_VM *vm, char *out_filename) {
+    static int worklist[WORDS_IN_MEM];
+    int pending = 0, address, start, count = 0;
+    FILE *out;
+    Decoded d;
+
+    /* Walk every statically known path from the entry point */
+    memset(translate_reachable, 0, sizeof(translate_reachable));
+    if (vm->PROGRAM_MAP[vm->CURRENT_LATCHES.PC]) {
+        translate_reachable[vm->CURRENT_LATCHES.PC] = 1;
+        worklist[pending++] = vm->CURRENT_LATCHES.PC;
+    }
+    while (pending > 0) {
+        int successors[2], n = 0, i;
+
+        address = worklist[--pending];
+        decodeInstruction(Low16bits(vm->MEMORY[address]), &d);
+        switch (d.op) {
+            case OP_BR:
+                successors[n++] = Low16bits(address + 1 + d.imm);
+                if (d.dr != 7)
+                    successors[n++] = Low16bits(address + 1);
+                break;
+            case OP_JSR:
+                successors[n++] = Low16bits(address + 1 + d.imm);
+                successors[n++] = Low16bits(address + 1);
+                break;
+            case OP_JMP:
+            case OP_RET:
+            case OP_RTI:
+                break;
+            case OP_TRAP:
+                if (d.imm != 0x25)
+                    successors[n++] = Low16bits(address + 1);
+                break;
+            default:
+                successors[n++] = Low16bits(address + 1);
+                break;
         }
-        case 0x23: { // IN
-            printf("Input a character: ");
-            fflush(stdout);
-            set_conio_terminal_mode();
-            while (!kbhit()) {
-                /* do some work */
-            }
-            int x = getch();
-            if (x == 3 || x == 4) {
-                printf("Error: keyboard interruption");
-                exit(0);
-            }
-            reset_terminal_mode();
-            printf("%c", x);
-            fflush(stdin);
-            fflush(stdout);
-            CURRENT_LATCHES.REGS[0] = x;
-            break;
+        for (i = 0; i < n; i++) {
+            int a = successors[i];
+            if (a > 0 && a < WORDS_IN_MEM && vm->PROGRAM_MAP[a] && !translate_reachable[a]) {
+                translate_reachable[a] = 1;
+                worklist[pending++] = a;
+            }
         }
-        case 0x24: { // PUTSP
-            int address = Low16bits(CURRENT_LATCHES.REGS[0]);
-            while (getMemory(address)) {
-                int value = getMemory(address);
-                printASCII(value & 0x00FF);
-                printASCII(value >> 8);
-                address++;
-                // printf("%x\n", address);
-                address = Low16bits(address);
-            } 
-            break;
+    }
+
+    out = fopen(out_filename, "w");
+    if (out == NULL) {
+        printf("Error: Can't open translation output %s\n", out_filename);
+        exit(-1);
+    }
+
+    fprintf(out, "/* Translated by lc3sim --translate.  Build: gcc -O2 -pthread -I<lc3sim dir> -o prog %s */\n\n",
+            out_filename);
+    fprintf(out, "#define LC3SIM_NO_MAIN\n#include \"lc3sim.c\"\n\n");
+    fprintf(out, "#define SYNC_OUT() (vm->CURRENT_LATCHES.REGS[0] = r0, vm->CURRENT_LATCHES.REGS[1] = r1, \\\n"
+                 "    vm->CURRENT_LATCHES.REGS[2] = r2, vm->CURRENT_LATCHES.REGS[3] = r3, vm->CURRENT_LATCHES.REGS[4] = r4, \\\n"
+                 "    vm->CURRENT_LATCHES.REGS[5] = r5, vm->CURRENT_LATCHES.REGS[6] = r6, vm->CURRENT_LATCHES.REGS[7] = r7, \\\n"
+                 "    vm->CURRENT_LATCHES.CC = cc, vm->INSTRUCTION_COUNT = count, vm->CURRENT_LATCHES.PC = pc)\n");
+    fprintf(out, "#define SYNC_IN() (r0 = vm->CURRENT_LATCHES.REGS[0], r1 = vm->CURRENT_LATCHES.REGS[1], \\\n"
+                 "    r2 = vm->CURRENT_LATCHES.REGS[2], r3 = vm->CURRENT_LATCHES.REGS[3], r4 = vm->CURRENT_LATCHES.REGS[4], \\\n"
+                 "    r5 = vm->CURRENT_LATCHES.REGS[5], r6 = vm->CURRENT_LATCHES.REGS[6], r7 = vm->CURRENT_LATCHES.REGS[7], \\\n"
+                 "    cc = vm->CURRENT_LATCHES.CC, \\\n"
+                 "    count = vm->INSTRUCTION_COUNT, pc = vm->CURRENT_LATCHES.PC)\n\n");
+
+    /* Memory image, one array per loaded run */
+    for (address = 0; address < WORDS_IN_MEM; address++) {
+        if (!vm->PROGRAM_MAP[address] || (address > 0 && vm->PROGRAM_MAP[address - 1]))
+            continue;
+        fprintf(out, "static const uint16_t image_%.4X[] = {", address);
+        for (start = address; start < WORDS_IN_MEM && vm->PROGRAM_MAP[start]; start++)
+            fprintf(out, "%s0x%.4X,", (start - address) % 8 ? " " : "\n    ",
+                    Low16bits(vm->MEMORY[start]));
+        fprintf(out, "\n};\n");
+    }
+
+    fprintf(out, "\nstatic void runTranslated(LC3_VM *vm) {\n");
+    fprintf(out, "    int r0, r1, r2, r3, r4, r5, r6, r7, cc, pc;\n    long long count;\n\n");
+    fprintf(out, "    SYNC_IN();\n");
+    fprintf(out, "dispatch:\n    switch (pc) {\n");
+    fprintf(out, "    case 0x0000: SYNC_OUT(); return;\n");
+    for (address = 0; address < WORDS_IN_MEM; address++)
+        if (translate_reachable[address])
+            fprintf(out, "    case 0x%.4X: goto L_%.4X;\n", address, address);
+    fprintf(out, "    default: goto interpret;\n    }\n\n");
+
+    for (address = 0; address < WORDS_IN_MEM; address++) {
+        int next = Low16bits(address + 1);
+        int ends = FALSE;   /* control never falls through to next */
+        const char *label;
+        int offset;
+        char text[32];
+
+        if (!translate_reachable[address])
+            continue;
+        count++;
+        disassemble(address, Low16bits(vm->MEMORY[address]), text);
+        decodeInstruction(Low16bits(vm->MEMORY[address]), &d);
+        label = symbolFor(vm, address, &offset);
+        if (label != NULL && offset == 0)
+            fprintf(out, "L_%.4X: /* %s: %s */\n    count++; ", address, label, text);
+        else
+            fprintf(out, "L_%.4X: /* %s */\n    count++; ", address, text);
+        if ((d.op >= OP_LD && d.op <= OP_LDR) || (d.op >= OP_ST && d.op <= OP_STR) || d.op == OP_TRAP)
+            fprintf(out, "vm->ACCESS_PC = 0x%.4X; ", address);
+
+        switch (d.op) {
+            case OP_ADD_REG:
+            case OP_AND_REG:
+                fprintf(out, "r%d = Low16bits(r%d %c r%d); cc = r%d;",
+                        d.dr, d.sr1, d.op == OP_ADD_REG ? '+' : '&', d.sr2, d.dr);
+                break;
+            case OP_ADD_IMM:
+                fprintf(out, "r%d = Low16bits(r%d + %d); cc = r%d;", d.dr, d.sr1, d.imm, d.dr);
+                break;
+            case OP_AND_IMM:
+                fprintf(out, "r%d = Low16bits(r%d & %d); cc = r%d;", d.dr, d.sr1, d.imm, d.dr);
+                break;
+            case OP_NOT:
+                fprintf(out, "r%d = Low16bits(~r%d); cc = r%d;", d.dr, d.sr1, d.dr);
+                break;
+            case OP_BR: {
+                static const char *taken_if[8] = {
+                    NULL, "cc != 0 && !(cc & 0x8000)", "cc == 0", "!(cc & 0x8000)",
+                    "cc & 0x8000", "cc != 0", "cc == 0 || (cc & 0x8000)", NULL
+                };
+                int target = Low16bits(next + d.imm);
+
+                if (d.dr != 7)
+                    fprintf(out, "if (%s) ", taken_if[d.dr]);
+                if (target <= address && isTranslated(target))    /* a loop: let devices in */
+                    fprintf(out, "{ if (vm->ATTENTION) { pc = 0x%.4X; goto interpret_rest; } goto L_%.4X; }",
+                            target, target);
+                else
+                    translateJump(out, target);
+                ends = d.dr == 7;
+                break;
+            }
+            case OP_JMP:
+                fprintf(out, "pc = Low16bits(r%d); goto dispatch;", d.sr1);
+                ends = TRUE;
+                break;
+            case OP_RET:
+                fprintf(out, "if (isEmpty(vm)) consolePrintf(vm, \"Error: RET called when stack is empty\"); "
+                        "else r7 = POP(vm); pc = Low16bits(r7); goto dispatch;");
+                ends = TRUE;
+                break;
+            case OP_JSR:
+                fprintf(out, "r7 = 0x%.4X; PUSH(vm, r7); ", next);
+                translateJump(out, Low16bits(next + d.imm));
+                ends = TRUE;
+                break;
+            case OP_JSRR:
+                fprintf(out, "r7 = 0x%.4X; PUSH(vm, r7); pc = Low16bits(r%d); goto dispatch;",
+                        next, d.sr1);
+                ends = TRUE;
+                break;
+            case OP_LD:
+                fprintf(out, "r%d = Low16bits(getMemory(vm, 0x%.4X)); cc = r%d;",
+                        d.dr, Low16bits(next + d.imm), d.dr);
+                break;
+            case OP_LDI:
+                fprintf(out, "r%d = Low16bits(getMemory(vm, getMemory(vm, 0x%.4X))); cc = r%d;",
+                        d.dr, Low16bits(next + d.imm), d.dr);
+                break;
+            case OP_LDR:
+                fprintf(out, "r%d = Low16bits(getMemory(vm, Low16bits(r%d + %d))); cc = r%d;",
+                        d.dr, d.sr1, d.imm, d.dr);
+                break;
+            case OP_LEA:
+                fprintf(out, "r%d = 0x%.4X;", d.dr, Low16bits(next + d.imm));
+                break;
+            case OP_ST:
+            case OP_STI:
+            case OP_STR:
+                if (d.op == OP_ST)
+                    fprintf(out, "setMemory(vm, 0x%.4X, r%d);", Low16bits(next + d.imm), d.dr);
+                else if (d.op == OP_STI)
+                    fprintf(out, "setMemory(vm, getMemory(vm, 0x%.4X), r%d);", Low16bits(next + d.imm), d.dr);
+                else
+                    fprintf(out, "setMemory(vm, Low16bits(r%d + %d), r%d);", d.sr1, d.imm, d.dr);
+                fprintf(out, "\n    if (vm->JIT_FLUSH_PENDING || vm->ATTENTION) { pc = 0x%.4X; goto interpret_rest; }", next);
+                break;
+            case OP_RTI:
+                fprintf(out, "pc = 0x%.4X; SYNC_OUT(); RTI(vm, 0x8000); SYNC_IN();\n", next);
+                fprintf(out, "    if (vm->ATTENTION) goto interpret_rest; goto dispatch;");
+                ends = TRUE;
+                break;
+            case OP_TRAP:
+                fprintf(out, "pc = 0x%.4X; SYNC_OUT(); TRAP(vm, 0x%.4X); SYNC_IN();\n", next, 0xF000 | d.imm);
+                fprintf(out, "    if (pc != 0x%.4X) goto dispatch;", next);
+                ends = d.imm == 0x25;
+                break;
+            default:
+                break;
         }
-        case 0x25: { // HALT
-            CURRENT_LATCHES.PC = 0x0000;
-            // RUN_BIT = FALSE; // Already handled
+        fprintf(out, "\n");
+        if (!ends && !isTranslated(next)) {
+            fprintf(out, "    ");
+            translateJump(out, Low16bits(next));
+            fprintf(out, "\n");
         }
     }
-    return 0;
-}
 
+    fprintf(out, "\ninterpret:  /* not proven to be code: run one block */\n");
+    fprintf(out, "    SYNC_OUT();\n");
+    fprintf(out, "    interpretInstructions(vm, INT_MAX, TRUE);\n");
+    fprintf(out, "    SYNC_IN();\n");
+    fprintf(out, "    if (!vm->JIT_FLUSH_PENDING && !vm->ATTENTION) goto dispatch;\n");
+    fprintf(out, "    goto interpret_rest;\n\n");
+    fprintf(out, "interpret_rest:  /* code was overwritten, or devices are in use */\n");
+    fprintf(out, "    SYNC_OUT();\n");
+    fprintf(out, "    while (vm->CURRENT_LATCHES.PC != 0x0000)\n");
+    fprintf(out, "        executeInstructions(vm, INT_MAX);\n");
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "int main(int argc, char *argv[]) {\n    LC3_VM *vm = vmCreate();\n    int i;\n\n");
+    for (address = 0; address < WORDS_IN_MEM; address++) {
+        if (!vm->PROGRAM_MAP[address] || (address > 0 && vm->PROGRAM_MAP[address - 1]))
+            continue;
+        fprintf(out, "    for (i = 0; i < (int) (sizeof(image_%.4X) / 2); i++)\n", address);
+        fprintf(out, "        vm->MEMORY[0x%.4X + i] = image_%.4X[i];\n", address, address);
+    }
+    for (address = 0; address < WORDS_IN_MEM; address++) {
+        if (!translate_reachable[address] || (address > 0 && translate_reachable[address - 1]))
+            continue;
+        for (start = address; isTranslated(start); start++)
+            ;
+        fprintf(out, "    memset(vm->JIT_CODE_MAP + 0x%.4X, 1, %d);\n", address, start - address);
+    }
+    for (address = 0; address < TRAP_VECTORS; address++)
+        if (vm->TRAP_GUEST[address])
+            fprintf(out, "    vm->TRAP_GUEST[0x%.2X] = 1;\n", address);
+    fprintf(out, "\n    vm->CURRENT_LATCHES.PC = 0x%.4X;\n", vm->CURRENT_LATCHES.PC);
+    fprintf(out, "    vm->CURRENT_LATCHES.CC = 0;\n");
+    fprintf(out, "    vm->RUN_BIT = TRUE;\n");
+    fprintf(out, "    openInput(vm, NULL, argc > 1 ? argv[1] : NULL);\n");
+    fprintf(out, "    runTranslated(vm);\n");
+    fprintf(out, "    vmDestroy(vm);\n");
+    fprintf(out, "    return 0;\n}\n");
+    fclose(out);
+
+    printf("Translated %d instructions into %s\n", count, out_filename);
+}
@@ -0,0 +1,406 @@
+; lc3os.asm: the operating system image that --os loads
+;
+; The trap vector table is at x0000-x00FF and the service routines
+; start at x0200.  The interrupt vector table at x0100-x01FF is left
+; empty for programs to fill in.
+;
+; TRAP enters its routine in supervisor mode on the supervisor stack
+; (R6), with the caller's PSR and PC pushed, and the routine returns
+; with RTI.  The routines change no register but R0 (GETC and IN),
+; and reach the console only through the device registers.  Vectors
+; with no routine return at once, as they do on the host.
+;
+; Assemble with: lc3as lc3os.asm
+
+        .ORIG x0000
+
+        .FILL BAD_TRAP   ; x00
+        .FILL BAD_TRAP   ; x01
+        .FILL BAD_TRAP   ; x02
+        .FILL BAD_TRAP   ; x03
+        .FILL BAD_TRAP   ; x04
+        .FILL BAD_TRAP   ; x05
+        .FILL BAD_TRAP   ; x06
+        .FILL BAD_TRAP   ; x07
+        .FILL BAD_TRAP   ; x08
+        .FILL BAD_TRAP   ; x09
+        .FILL BAD_TRAP   ; x0A
+        .FILL BAD_TRAP   ; x0B
+        .FILL BAD_TRAP   ; x0C
+        .FILL BAD_TRAP   ; x0D
+        .FILL BAD_TRAP   ; x0E
+        .FILL BAD_TRAP   ; x0F
+        .FILL BAD_TRAP   ; x10
+        .FILL BAD_TRAP   ; x11
+        .FILL BAD_TRAP   ; x12
+        .FILL BAD_TRAP   ; x13
+        .FILL BAD_TRAP   ; x14
+        .FILL BAD_TRAP   ; x15
+        .FILL BAD_TRAP   ; x16
+        .FILL BAD_TRAP   ; x17
+        .FILL BAD_TRAP   ; x18
+        .FILL BAD_TRAP   ; x19
+        .FILL BAD_TRAP   ; x1A
+        .FILL BAD_TRAP   ; x1B
+        .FILL BAD_TRAP   ; x1C
+        .FILL BAD_TRAP   ; x1D
+        .FILL BAD_TRAP   ; x1E
+        .FILL BAD_TRAP   ; x1F
+        .FILL TRAP_GETC  ; x20
+        .FILL TRAP_OUT   ; x21
+        .FILL TRAP_PUTS  ; x22
+        .FILL TRAP_IN    ; x23
+        .FILL TRAP_PUTSP ; x24
+        .FILL TRAP_HALT  ; x25
+        .FILL BAD_TRAP   ; x26
+        .FILL BAD_TRAP   ; x27
+        .FILL BAD_TRAP   ; x28
+        .FILL BAD_TRAP   ; x29
+        .FILL BAD_TRAP   ; x2A
+        .FILL BAD_TRAP   ; x2B
+        .FILL BAD_TRAP   ; x2C
+        .FILL BAD_TRAP   ; x2D
+        .FILL BAD_TRAP   ; x2E
+        .FILL BAD_TRAP   ; x2F
+        .FILL BAD_TRAP   ; x30
+        .FILL BAD_TRAP   ; x31
+        .FILL BAD_TRAP   ; x32
+        .FILL BAD_TRAP   ; x33
+        .FILL BAD_TRAP   ; x34
+        .FILL BAD_TRAP   ; x35
+        .FILL BAD_TRAP   ; x36
+        .FILL BAD_TRAP   ; x37
+        .FILL BAD_TRAP   ; x38
+        .FILL BAD_TRAP   ; x39
+        .FILL BAD_TRAP   ; x3A
+        .FILL BAD_TRAP   ; x3B
+        .FILL BAD_TRAP   ; x3C
+        .FILL BAD_TRAP   ; x3D
+        .FILL BAD_TRAP   ; x3E
+        .FILL BAD_TRAP   ; x3F
+        .FILL BAD_TRAP   ; x40
+        .FILL BAD_TRAP   ; x41
+        .FILL BAD_TRAP   ; x42
+        .FILL BAD_TRAP   ; x43
+        .FILL BAD_TRAP   ; x44
+        .FILL BAD_TRAP   ; x45
+        .FILL BAD_TRAP   ; x46
+        .FILL BAD_TRAP   ; x47
+        .FILL BAD_TRAP   ; x48
+        .FILL BAD_TRAP   ; x49
+        .FILL BAD_TRAP   ; x4A
+        .FILL BAD_TRAP   ; x4B
+        .FILL BAD_TRAP   ; x4C
+        .FILL BAD_TRAP   ; x4D
+        .FILL BAD_TRAP   ; x4E
+        .FILL BAD_TRAP   ; x4F
+        .FILL BAD_TRAP   ; x50
+        .FILL BAD_TRAP   ; x51
+        .FILL BAD_TRAP   ; x52
+        .FILL BAD_TRAP   ; x53
+        .FILL BAD_TRAP   ; x54
+        .FILL BAD_TRAP   ; x55
+        .FILL BAD_TRAP   ; x56
+        .FILL BAD_TRAP   ; x57
+        .FILL BAD_TRAP   ; x58
+        .FILL BAD_TRAP   ; x59
+        .FILL BAD_TRAP   ; x5A
+        .FILL BAD_TRAP   ; x5B
+        .FILL BAD_TRAP   ; x5C
+        .FILL BAD_TRAP   ; x5D
+        .FILL BAD_TRAP   ; x5E
+        .FILL BAD_TRAP   ; x5F
+        .FILL BAD_TRAP   ; x60
+        .FILL BAD_TRAP   ; x61
+        .FILL BAD_TRAP   ; x62
+        .FILL BAD_TRAP   ; x63
+        .FILL BAD_TRAP   ; x64
+        .FILL BAD_TRAP   ; x65
+        .FILL BAD_TRAP   ; x66
+        .FILL BAD_TRAP   ; x67
+        .FILL BAD_TRAP   ; x68
+        .FILL BAD_TRAP   ; x69
+        .FILL BAD_TRAP   ; x6A
+        .FILL BAD_TRAP   ; x6B
+        .FILL BAD_TRAP   ; x6C
+        .FILL BAD_TRAP   ; x6D
+        .FILL BAD_TRAP   ; x6E
+        .FILL BAD_TRAP   ; x6F
+        .FILL BAD_TRAP   ; x70
+        .FILL BAD_TRAP   ; x71
+        .FILL BAD_TRAP   ; x72
+        .FILL BAD_TRAP   ; x73
+        .FILL BAD_TRAP   ; x74
+        .FILL BAD_TRAP   ; x75
+        .FILL BAD_TRAP   ; x76
+        .FILL BAD_TRAP   ; x77
+        .FILL BAD_TRAP   ; x78
+        .FILL BAD_TRAP   ; x79
+        .FILL BAD_TRAP   ; x7A
+        .FILL BAD_TRAP   ; x7B
+        .FILL BAD_TRAP   ; x7C
+        .FILL BAD_TRAP   ; x7D
+        .FILL BAD_TRAP   ; x7E
+        .FILL BAD_TRAP   ; x7F
+        .FILL BAD_TRAP   ; x80
+        .FILL BAD_TRAP   ; x81
+        .FILL BAD_TRAP   ; x82
+        .FILL BAD_TRAP   ; x83
+        .FILL BAD_TRAP   ; x84
+        .FILL BAD_TRAP   ; x85
+        .FILL BAD_TRAP   ; x86
+        .FILL BAD_TRAP   ; x87
+        .FILL BAD_TRAP   ; x88
+        .FILL BAD_TRAP   ; x89
+        .FILL BAD_TRAP   ; x8A
+        .FILL BAD_TRAP   ; x8B
+        .FILL BAD_TRAP   ; x8C
+        .FILL BAD_TRAP   ; x8D
+        .FILL BAD_TRAP   ; x8E
+        .FILL BAD_TRAP   ; x8F
+        .FILL BAD_TRAP   ; x90
+        .FILL BAD_TRAP   ; x91
+        .FILL BAD_TRAP   ; x92
+        .FILL BAD_TRAP   ; x93
+        .FILL BAD_TRAP   ; x94
+        .FILL BAD_TRAP   ; x95
+        .FILL BAD_TRAP   ; x96
+        .FILL BAD_TRAP   ; x97
+        .FILL BAD_TRAP   ; x98
+        .FILL BAD_TRAP   ; x99
+        .FILL BAD_TRAP   ; x9A
+        .FILL BAD_TRAP   ; x9B
+        .FILL BAD_TRAP   ; x9C
+        .FILL BAD_TRAP   ; x9D
+        .FILL BAD_TRAP   ; x9E
+        .FILL BAD_TRAP   ; x9F
+        .FILL BAD_TRAP   ; xA0
+        .FILL BAD_TRAP   ; xA1
+        .FILL BAD_TRAP   ; xA2
+        .FILL BAD_TRAP   ; xA3
+        .FILL BAD_TRAP   ; xA4
+        .FILL BAD_TRAP   ; xA5
+        .FILL BAD_TRAP   ; xA6
+        .FILL BAD_TRAP   ; xA7
+        .FILL BAD_TRAP   ; xA8
+        .FILL BAD_TRAP   ; xA9
+        .FILL BAD_TRAP   ; xAA
+        .FILL BAD_TRAP   ; xAB
+        .FILL BAD_TRAP   ; xAC
+        .FILL BAD_TRAP   ; xAD
+        .FILL BAD_TRAP   ; xAE
+        .FILL BAD_TRAP   ; xAF
+        .FILL BAD_TRAP   ; xB0
+        .FILL BAD_TRAP   ; xB1
+        .FILL BAD_TRAP   ; xB2
+        .FILL BAD_TRAP   ; xB3
+        .FILL BAD_TRAP   ; xB4
+        .FILL BAD_TRAP   ; xB5
+        .FILL BAD_TRAP   ; xB6
+        .FILL BAD_TRAP   ; xB7
+        .FILL BAD_TRAP   ; xB8
+        .FILL BAD_TRAP   ; xB9
+        .FILL BAD_TRAP   ; xBA
+        .FILL BAD_TRAP   ; xBB
+        .FILL BAD_TRAP   ; xBC
+        .FILL BAD_TRAP   ; xBD
+        .FILL BAD_TRAP   ; xBE
+        .FILL BAD_TRAP   ; xBF
+        .FILL BAD_TRAP   ; xC0
+        .FILL BAD_TRAP   ; xC1
+        .FILL BAD_TRAP   ; xC2
+        .FILL BAD_TRAP   ; xC3
+        .FILL BAD_TRAP   ; xC4
+        .FILL BAD_TRAP   ; xC5
+        .FILL BAD_TRAP   ; xC6
+        .FILL BAD_TRAP   ; xC7
+        .FILL BAD_TRAP   ; xC8
+        .FILL BAD_TRAP   ; xC9
+        .FILL BAD_TRAP   ; xCA
+        .FILL BAD_TRAP   ; xCB
+        .FILL BAD_TRAP   ; xCC
+        .FILL BAD_TRAP   ; xCD
+        .FILL BAD_TRAP   ; xCE
+        .FILL BAD_TRAP   ; xCF
+        .FILL BAD_TRAP   ; xD0
+        .FILL BAD_TRAP   ; xD1
+        .FILL BAD_TRAP   ; xD2
+        .FILL BAD_TRAP   ; xD3
+        .FILL BAD_TRAP   ; xD4
+        .FILL BAD_TRAP   ; xD5
+        .FILL BAD_TRAP   ; xD6
+        .FILL BAD_TRAP   ; xD7
+        .FILL BAD_TRAP   ; xD8
+        .FILL BAD_TRAP   ; xD9
+        .FILL BAD_TRAP   ; xDA
+        .FILL BAD_TRAP   ; xDB
+        .FILL BAD_TRAP   ; xDC
+        .FILL BAD_TRAP   ; xDD
+        .FILL BAD_TRAP   ; xDE
+        .FILL BAD_TRAP   ; xDF
+        .FILL BAD_TRAP   ; xE0
+        .FILL BAD_TRAP   ; xE1
+        .FILL BAD_TRAP   ; xE2
+        .FILL BAD_TRAP   ; xE3
+        .FILL BAD_TRAP   ; xE4
+        .FILL BAD_TRAP   ; xE5
+        .FILL BAD_TRAP   ; xE6
+        .FILL BAD_TRAP   ; xE7
+        .FILL BAD_TRAP   ; xE8
+        .FILL BAD_TRAP   ; xE9
+        .FILL BAD_TRAP   ; xEA
+        .FILL BAD_TRAP   ; xEB
+        .FILL BAD_TRAP   ; xEC
+        .FILL BAD_TRAP   ; xED
+        .FILL BAD_TRAP   ; xEE
+        .FILL BAD_TRAP   ; xEF
+        .FILL BAD_TRAP   ; xF0
+        .FILL BAD_TRAP   ; xF1
+        .FILL BAD_TRAP   ; xF2
+        .FILL BAD_TRAP   ; xF3
+        .FILL BAD_TRAP   ; xF4
+        .FILL BAD_TRAP   ; xF5
+        .FILL BAD_TRAP   ; xF6
+        .FILL BAD_TRAP   ; xF7
+        .FILL BAD_TRAP   ; xF8
+        .FILL BAD_TRAP   ; xF9
+        .FILL BAD_TRAP   ; xFA
+        .FILL BAD_TRAP   ; xFB
+        .FILL BAD_TRAP   ; xFC
+        .FILL BAD_TRAP   ; xFD
+        .FILL BAD_TRAP   ; xFE
+        .FILL BAD_TRAP   ; xFF
+        .BLKW x100              ; x0100-x01FF: interrupt vectors
+
+; Unknown vectors do nothing
+BAD_TRAP
+        RTI
+
+; GETC: wait for a key and return it in R0
+TRAP_GETC
+        LDI R0, KBSR_P
+        BRzp TRAP_GETC
+        LDI R0, KBDR_P
+        RTI
+
+; OUT: write R0 to the display
+TRAP_OUT
+        ADD R6, R6, #-1
+        STR R7, R6, #0
+        JSR DISPLAY
+        LDR R7, R6, #0
+        ADD R6, R6, #1
+        RTI
+
+; PUTS: write the string at R0, one character per word
+TRAP_PUTS
+        ADD R6, R6, #-3
+        STR R0, R6, #0
+        STR R1, R6, #1
+        STR R7, R6, #2
+        ADD R1, R0, #0
+PUTS_NEXT
+        LDR R0, R1, #0
+        BRz PUTS_DONE
+        JSR DISPLAY
+        ADD R1, R1, #1
+        BRnzp PUTS_NEXT
+PUTS_DONE
+        LDR R0, R6, #0
+        LDR R1, R6, #1
+        LDR R7, R6, #2
+        ADD R6, R6, #3
+        RTI
+
+; IN: prompt, wait for a key, echo it and return it in R0
+TRAP_IN
+        ADD R6, R6, #-2
+        STR R1, R6, #0
+        STR R7, R6, #1
+        LEA R1, IN_PROMPT
+IN_NEXT
+        LDR R0, R1, #0
+        BRz IN_KEY
+        JSR DISPLAY
+        ADD R1, R1, #1
+        BRnzp IN_NEXT
+IN_KEY
+        LDI R0, KBSR_P
+        BRzp IN_KEY
+        LDI R0, KBDR_P
+        JSR DISPLAY
+        LDR R1, R6, #0
+        LDR R7, R6, #1
+        ADD R6, R6, #2
+        RTI
+
+; PUTSP: write the string at R0, two characters per word, low byte
+; first; a zero high byte ends it as well as a zero word
+TRAP_PUTSP
+        ADD R6, R6, #-5
+        STR R0, R6, #0
+        STR R1, R6, #1
+        STR R2, R6, #2
+        STR R3, R6, #3
+        STR R7, R6, #4
+        ADD R1, R0, #0
+PUTSP_NEXT
+        LDR R2, R1, #0
+        BRz PUTSP_DONE
+        LD R0, LOW_BYTE
+        AND R0, R2, R0
+        JSR DISPLAY
+        AND R0, R0, #0          ; shift the high byte down into R0
+        AND R3, R3, #0
+        ADD R3, R3, #8
+PUTSP_SHIFT
+        ADD R0, R0, R0
+        ADD R2, R2, #0
+        BRzp PUTSP_CARRY
+        ADD R0, R0, #1
+PUTSP_CARRY
+        ADD R2, R2, R2
+        ADD R3, R3, #-1
+        BRp PUTSP_SHIFT
+        ADD R0, R0, #0
+        BRz PUTSP_DONE
+        JSR DISPLAY
+        ADD R1, R1, #1
+        BRnzp PUTSP_NEXT
+PUTSP_DONE
+        LDR R0, R6, #0
+        LDR R1, R6, #1
+        LDR R2, R6, #2
+        LDR R3, R6, #3
+        LDR R7, R6, #4
+        ADD R6, R6, #5
+        RTI
+
+; HALT: stop the clock.  R6 is the supervisor stack pointer, below
+; x8000, so storing it clears the clock enable bit of MCR without
+; changing any of the caller's registers.
+TRAP_HALT
+        STI R6, MCR_P
+        BRnzp TRAP_HALT
+
+; Write R0 to the display once it is ready; changes nothing else
+DISPLAY
+        ADD R6, R6, #-1
+        STR R1, R6, #0
+DISPLAY_WAIT
+        LDI R1, DSR_P
+        BRzp DISPLAY_WAIT
+        STI R0, DDR_P
+        LDR R1, R6, #0
+        ADD R6, R6, #1
+        RET
+
+KBSR_P      .FILL xFE00
+KBDR_P      .FILL xFE02
+DSR_P       .FILL xFE04
+DDR_P       .FILL xFE06
+MCR_P       .FILL xFFFE
+LOW_BYTE    .FILL x00FF
+IN_PROMPT   .STRINGZ "Input a character: "
+
+        .END
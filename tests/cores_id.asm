@@ -0,0 +1,14 @@
+; Each core prints its number (CID) three times: --cores 4 --round-robin 1 prints 012301230123
+        .ORIG x3000
+        LDI R1, CIDP
+        LD R0, ZERO
+        ADD R0,R0,R1
+        AND R2,R2,#0
+        ADD R2,R2,#3
+L       OUT
+        ADD R2,R2,#-1
+        BRp L
+        HALT
+CIDP    .FILL xFE0C
+ZERO    .FILL x30
+        .END
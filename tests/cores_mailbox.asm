@@ -0,0 +1,37 @@
+; Core 0 produces 1..9 into a one-word mailbox and core 1 prints them: run with --cores 2
+        .ORIG x3000
+        LDI R1, CIDP
+        BRz PROD
+        ADD R1,R1,#-1
+        BRz CONS
+        HALT
+PROD    AND R2,R2,#0
+        ADD R2,R2,#1
+PW      LD R3, FULL
+        BRnp PW
+        ST R2, BOX
+        AND R3,R3,#0
+        ADD R3,R3,#1
+        ST R3, FULL
+        ADD R2,R2,#1
+        ADD R3,R2,#-10
+        BRn PW
+        HALT
+CONS    AND R4,R4,#0
+        ADD R4,R4,#9
+CW      LD R3, FULL
+        BRz CW
+        LD R0, BOX
+        LD R5, ZERO
+        ADD R0,R0,R5
+        OUT
+        AND R3,R3,#0
+        ST R3, FULL
+        ADD R4,R4,#-1
+        BRp CW
+        HALT
+CIDP    .FILL xFE0C
+ZERO    .FILL x30
+FULL    .FILL 0
+BOX     .FILL 0
+        .END
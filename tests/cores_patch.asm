@@ -0,0 +1,16 @@
+; Core 0 spins on a BR that core 1 patches into HALT; both halt: run with --cores 2
+        .ORIG x3000
+        LDI R1, CIDP
+        BRnp PATCH
+L       ADD R0,R0,#1
+SITE    BRnzp L
+PATCH   LD R2, WAIT
+W       ADD R2,R2,#-1
+        BRp W
+        LD R2, HLT
+        ST R2, SITE
+        HALT
+CIDP    .FILL xFE0C
+WAIT    .FILL #3000
+HLT     .FILL xF025
+        .END